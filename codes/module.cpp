@@ -3,22 +3,152 @@
 #include <string>
 #include <vector>
 #include <cstring>
+#include <cstdlib>
 #include <ctime>
 #include <algorithm>
 #include <sstream>
 #include <fstream>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// x86-64 CPUs may have the SSE4.2 crc32 instruction; it is compiled in for
+// the block checksums and only used after checking the CPU at run time
+#if defined(__x86_64__) || defined(_M_X64)
+#include <nmmintrin.h>
+#define CRC32C_HARDWARE
+#if defined(__GNUC__)
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#else
+#define CRC32C_TARGET
+#endif
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Constants for file system
-const unsigned int MEMORY_SIZE = 1024 * 1024; // 1MB
-const unsigned int BLOCK_SIZE = 1024;         // 1KB (kept as required)
-const unsigned int TOTAL_BLOCKS = MEMORY_SIZE / BLOCK_SIZE; // 1024 blocks
-const unsigned int MAX_INODES = 128;
-const unsigned int INODE_SIZE = 64;
-const unsigned int INODE_BLOCKS = (MAX_INODES * INODE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE;
-const unsigned int FIRST_DATA_BLOCK = 1 + INODE_BLOCKS; // SuperBlock + Inode blocks
-const unsigned int DIRECT_BLOCKS = 10;
+// Image geometry is chosen at format time and stored in the SuperBlock;
+// these are only the defaults used when a new image is created.
+const unsigned long long DEFAULT_IMAGE_SIZE = 1024 * 1024; // 1MB
+const unsigned int DEFAULT_BLOCK_SIZE = 1024;  // 1KB
+const unsigned int DEFAULT_MAX_INODES = 128;
+const unsigned int DEFAULT_DIRECT_BLOCKS = 10;
+const unsigned int MIN_BLOCK_SIZE = 512;
+const unsigned int MAX_BLOCK_SIZE = 64 * 1024;
+const unsigned int MAX_DIRECT_BLOCKS = 16;     // Direct pointer slots in an on-disk inode
+const unsigned int INODE_SIZE = 128;
+const unsigned int FS_MAGIC = 0x12345678;
+const unsigned int FS_VERSION = 1;             // On-disk format version; images from before it was recorded read as 0
 const unsigned int MAX_FILENAME_LENGTH = 28;
 const unsigned int MAX_PATH_LENGTH = 256;
+const char* const IMAGE_FILE = "filesystem.dat";
+const char* const JOURNAL_FILE = "filesystem.journal";
+const unsigned int BITS_PER_WORD = 64;
+const unsigned int INODES_PER_CHUNK = 64;      // Inode table grows in chunks of this many inodes
+const unsigned int INODE_CHUNK_SIZE = INODES_PER_CHUNK * INODE_SIZE;
+const unsigned int INVALID_INODE = 0xFFFFFFFF; // Returned when no inode can be allocated
+const unsigned int SNAPSHOT_INODE_BASE = 0x40000000; // Snapshot inodes are numbered from here; live ones stay below
+
+// Bit scan helpers for the block bitmap (word must be non-zero for ctz)
+inline unsigned int countTrailingZeros(uint64_t word) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return static_cast<unsigned int>(index);
+#else
+    return static_cast<unsigned int>(__builtin_ctzll(word));
+#endif
+}
+
+inline unsigned int popCount(uint64_t word) {
+#ifdef _MSC_VER
+    return static_cast<unsigned int>(__popcnt64(word));
+#else
+    return static_cast<unsigned int>(__builtin_popcountll(word));
+#endif
+}
+
+// Mask of bits [first, first + count) within one 64-bit word
+inline uint64_t bitRange(unsigned int first, unsigned int count) {
+    uint64_t bits = (count >= BITS_PER_WORD) ? ~0ULL : ((1ULL << count) - 1);
+    return bits << first;
+}
+
+// Image feature flags (SuperBlock::features)
+const unsigned int FEATURE_EXTENTS = 0x1;     // New files are mapped by extents
+const unsigned int FEATURE_DELALLOC = 0x2;    // Blocks for written holes are picked at flush time
+const unsigned int FEATURE_BUDDY = 0x4;       // Runs of up to 2^BUDDY_MAX_ORDER blocks come from a buddy allocator
+const unsigned int FEATURE_DEDUP = 0x8;       // Identical file blocks are stored once and reference counted
+const unsigned int FEATURE_REFLINK = 0x10;    // Block reference counts are kept so cp can share blocks
+const unsigned int FEATURE_CHECKSUMS = 0x20;  // Every block has a CRC32C in the checksum table
+const unsigned int KNOWN_FEATURES = FEATURE_EXTENTS | FEATURE_DELALLOC | FEATURE_BUDDY | FEATURE_DEDUP |
+                                    FEATURE_REFLINK | FEATURE_CHECKSUMS;
+
+// Largest buddy block: 2^10 = 1024 blocks
+const unsigned int BUDDY_MAX_ORDER = 10;
+
+// Buffered data for delayed allocation is flushed once it exceeds this
+const unsigned long long DELALLOC_LIMIT = 4 * 1024 * 1024;
+
+// Default time one defrag command may spend relocating files
+const unsigned int DEFRAG_BUDGET_MS = 100;
+
+// Compressed files are packed in clusters of this many blocks
+const unsigned int CLUSTER_BLOCKS = 16;
+
+// The journal is checkpointed into the image once it grows past this
+const unsigned long long JOURNAL_LIMIT = 1024 * 1024;
+const unsigned int JOURNAL_MAGIC = 0x4C4E524A; // "JRNL"
+
+// cat checks and prints file data in pieces of this many bytes
+const unsigned int CHECKSUM_PIECE_BYTES = 128 * 1024;
+
+// Saving a buffered image writes changed ranges closer than this as one
+const unsigned long long SAVE_MERGE_GAP = 64 * 1024;
+
+// The background flusher writes the image back this often (seconds), or as
+// soon as a command leaves this many data blocks waiting
+const unsigned int FLUSH_INTERVAL_SECONDS = 5;
+const unsigned int FLUSH_DIRTY_BLOCKS = 1024;
+
+// Inode flags
+const unsigned int INODE_EXTENTS = 0x1;       // Data mapped by extents instead of block pointers
+const unsigned int INODE_INLINE = 0x2;        // Data stored in the inode's blockAddresses area
+const unsigned int INODE_COMPRESSED = 0x4;    // Data packed in compressed clusters (always extent-mapped once out of the inode)
+const unsigned int INODE_SNAPSHOT = 0x8;      // The read-only directory listing the snapshots
+
+// Absolute paths starting with this name lead to the snapshots
+const char* const SNAPSHOT_PREFIX = ".snapshots";
+
+// Geometry of an image, used when formatting
+struct FormatOptions {
+    unsigned long long imageSize; // Size of the image in bytes
+    unsigned int blockSize;       // Size of each block
+    unsigned int maxInodes;       // Number of inode slots in the initial inode table
+    unsigned int directBlocks;    // Direct pointers used per inode
+    unsigned int features;        // FEATURE_* flags
+};
 
 // SuperBlock structure
 struct SuperBlock {
@@ -26,20 +156,150 @@ struct SuperBlock {
     unsigned int blockSize;       // Size of each block
     unsigned int totalBlocks;     // Total number of blocks
     unsigned int freeBlocks;      // Number of free blocks
-    unsigned int maxInodes;       // Maximum number of inodes
+    unsigned int maxInodes;       // Number of inode slots (grows with the inode table)
     unsigned int freeInodes;      // Number of free inodes
-    unsigned int firstFreeBlock;  // First free block in free list
-    unsigned int firstFreeInode;  // First free inode in free list
+    unsigned int firstFreeBlock;  // Lowest block that may be free (allocation hint)
+    unsigned int firstFreeInode;  // Lowest inode that may be free (allocation hint)
+    unsigned int directBlocks;    // Direct pointers used per inode
+    unsigned int inodeSize;       // Size of an inode slot in bytes
+    unsigned int firstDataBlock;  // First block after the inode table and bitmap
+    unsigned int bitmapStart;     // First block of the block bitmap
+    unsigned int bitmapBlocks;    // Number of block bitmap blocks
+    unsigned int features;        // FEATURE_* flags chosen at format time
+    unsigned int inodeMapStart;   // First block of the inode map chain
+    unsigned int inodeChunks;     // Number of inode table chunks
+    unsigned int blocksPerGroup;  // Blocks in each block group (one bitmap block's worth)
+    unsigned int groupCount;      // Number of block groups
+    unsigned int groupTableStart; // First block of the group descriptor table
+    unsigned int reservedBlocks;  // Free blocks promised to delayed writes
+    unsigned int refcountStart;   // First block of the block reference count table (0 = none)
+    unsigned int snapshotDir;     // Directory inode listing the snapshots (0 = none taken yet)
+    unsigned int journalSequence; // Last journal transaction the image is known to contain
+    unsigned int checksumStart;   // First block of the block checksum table (0 = none)
+    unsigned int version;         // FS_VERSION of the code that formatted the image
 };
 
+// Block group descriptor. Group g covers blocks [g * blocksPerGroup,
+// (g + 1) * blocksPerGroup); its free map is block g of the bitmap, and its
+// inode slice is the inode table chunks stored inside the group.
+struct GroupDescriptor {
+    unsigned int freeBlocks;      // Free blocks in the group
+    unsigned int freeInodes;      // Free inodes in the group's chunks
+    unsigned int directories;     // Directories whose inode is in the group
+    unsigned int flags;           // GROUP_* flags
+};
+
+// Group flags
+const unsigned int GROUP_BLOCKS_UNINIT = 0x1; // No block was ever allocated: the group's bitmap is all zero
+
 // Inode structure
 struct Inode {
     unsigned int type;            // 0 = file, 1 = directory
-    unsigned int size;            // Size in bytes
+    unsigned int flags;           // INODE_* flags
+    unsigned long long size;      // Size in bytes
     time_t creationTime;          // Creation time
     time_t modificationTime;      // Last modification time
-    unsigned int blockAddresses[DIRECT_BLOCKS]; // Direct block addresses
-    unsigned int indirectBlock;   // Indirect block address
+    unsigned int blockAddresses[MAX_DIRECT_BLOCKS]; // Direct block addresses (superblock decides how many are used)
+    unsigned int indirectBlock;   // Indirect block address (first extent block for INODE_EXTENTS)
+    unsigned int doubleIndirectBlock; // Block of pointers to indirect blocks
+    unsigned int tripleIndirectBlock; // Block of pointers to double-indirect blocks
+};
+
+static_assert(sizeof(Inode) <= INODE_SIZE, "Inode does not fit in its slot");
+
+// Extent: a run of contiguous blocks. Extent-mapped inodes keep their first
+// extents in the blockAddresses area and the rest in a chain of extent blocks.
+struct Extent {
+    unsigned int logicalBlock;    // First file block covered
+    unsigned int physicalBlock;   // First image block
+    unsigned int length;          // Number of blocks (0 marks an unused slot)
+    unsigned int flags;           // EXTENT_* flags
+};
+
+// Extent flags
+const unsigned int EXTENT_UNWRITTEN = 0x1;    // Blocks are allocated but never written: they read as zeros
+const unsigned int EXTENT_COMPRESSED = 0x2;   // One cluster starting at logicalBlock, packed into length blocks
+
+// Start of the first block of a compressed cluster; the packed bytes follow
+struct ClusterHeader {
+    unsigned int packedBytes;     // Size of the compressed stream
+    unsigned int rawBytes;        // Bytes it unpacks to (the rest of the cluster reads as zeros)
+};
+
+// Write-ahead journal (JOURNAL_FILE): one record per operation that changed
+// metadata, made of entries that each give new bytes for a range of the image
+struct JournalRecord {
+    unsigned int magic;           // JOURNAL_MAGIC
+    unsigned int sequence;        // Transaction number, one more than the previous record's
+    unsigned int length;          // Bytes of entries following this header
+    unsigned int checksum;        // journalChecksum of those bytes
+};
+
+struct JournalEntry {
+    unsigned long long offset;    // Image offset of the range
+    unsigned int length;          // Bytes in the range; they follow the entry unless JOURNAL_ZERO or JOURNAL_REVOKE is set
+    unsigned int flags;           // JOURNAL_* flags
+};
+
+// Journal entry flags
+const unsigned int JOURNAL_ZERO = 0x1;        // The range is cleared; no bytes follow
+const unsigned int JOURNAL_REVOKE = 0x2;      // The blocks were freed: entries for them up to this record are skipped
+
+// Header at the start of each block in an extent chain or the inode map
+struct ChainBlockHeader {
+    unsigned int nextBlock;       // Next block in the chain (0 = end of chain)
+    unsigned int count;           // Entries stored in this block
+    unsigned int reserved[2];
+};
+
+// Inode map entry: where one chunk of the inode table lives and which of its
+// inodes are in use. The first chunks are the table formatted after the
+// superblock; later ones are allocated from the data area as inodes run out.
+struct InodeChunk {
+    uint64_t usedMask;            // Bit i set when inode (chunk * INODES_PER_CHUNK + i) is allocated
+    unsigned int block;           // Block holding the chunk
+    unsigned int offset;          // Byte offset of the chunk within that block
+};
+
+const unsigned int INLINE_EXTENTS = MAX_DIRECT_BLOCKS * sizeof(unsigned int) / sizeof(Extent);
+
+// Files up to this size keep their bytes inside the inode
+const unsigned int INLINE_DATA_SIZE = MAX_DIRECT_BLOCKS * sizeof(unsigned int);
+
+// A mapped run of a file: logical blocks [logicalBlock, logicalBlock + length)
+// live in image blocks [physicalBlock, physicalBlock + length)
+struct BlockRun {
+    unsigned int logicalBlock;
+    unsigned int physicalBlock;
+    unsigned int length;
+    unsigned int flags;           // EXTENT_* flags of the extent it came from
+};
+
+// Pointer blocks on the path to the last block looked up in an indirect
+// tree. Sequential lookups reuse them instead of walking down from the root.
+struct BlockMapCursor {
+    int depth = 0;                // Tree of the cached path (1-3, 0 = nothing cached)
+    unsigned int root = 0;        // Root block of that tree
+    unsigned long long key[3];    // Which pointer block is cached at each level
+    unsigned int block[3];        // Cached pointer block at each level
+};
+
+// Writes into holes of one file that are waiting for delayed allocation
+struct DelayedFile {
+    std::map<unsigned int, std::vector<char>> blocks; // Logical block -> buffered contents
+    unsigned int reserved = 0;    // Blocks reserved for the data and its mapping
+    unsigned int baseExtents = 0; // Extents the file had when buffering started
+};
+
+// One write to the image file, of data blocks or of metadata: the byte
+// ranges to write, in order, and the dirty blocks they were collected
+// from, marked again if it fails
+struct ImageWrite {
+    std::vector<std::pair<unsigned long long, unsigned long long>> ranges;
+    std::vector<char> bytes;      // The ranges' contents when written without stateMutex (empty: read from memory)
+    std::vector<unsigned int> dirty;
+    unsigned long long fileSize = 0; // Size of the image file once written (0: unchanged)
+    bool whole = false;           // No saved copy yet: the file is written from scratch
 };
 
 // Directory entry structure
@@ -48,44 +308,747 @@ struct DirectoryEntry {
     unsigned int inodeNumber;
 };
 
+// LZ77 codec for compressed clusters, laid out like LZ4: a series of
+// sequences, each a token byte (literal count in the high nibble, match
+// length minus LZ_MIN_MATCH in the low one; 15 means more length bytes
+// follow), the literals, then a 2-byte offset back into the output. The
+// last sequence holds literals only.
+const unsigned int LZ_HASH_BITS = 12;
+const unsigned int LZ_MIN_MATCH = 4;
+
+static void lzPutLength(std::vector<char>& output, size_t length) {
+    while (length >= 255) {
+        output.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    output.push_back(static_cast<char>(length));
+}
+
+static void lzPutSequence(std::vector<char>& output, const unsigned char* literals, size_t literalCount,
+                          size_t offset, size_t matchLength) {
+    size_t matchCode = matchLength > 0 ? matchLength - LZ_MIN_MATCH : 0;
+    output.push_back(static_cast<char>((std::min<size_t>(literalCount, 15) << 4) | std::min<size_t>(matchCode, 15)));
+    if (literalCount >= 15) {
+        lzPutLength(output, literalCount - 15);
+    }
+    output.insert(output.end(), literals, literals + literalCount);
+    
+    if (matchLength > 0) {
+        output.push_back(static_cast<char>(offset & 0xFF));
+        output.push_back(static_cast<char>(offset >> 8));
+        if (matchCode >= 15) {
+            lzPutLength(output, matchCode - 15);
+        }
+    }
+}
+
+static size_t lzCompress(const char* input, size_t size, std::vector<char>& output) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(input);
+    std::vector<size_t> table(1U << LZ_HASH_BITS, SIZE_MAX); // Last position of each hashed 4-byte sequence
+    output.clear();
+    
+    size_t anchor = 0; // First byte not yet emitted
+    size_t pos = 0;
+    while (pos + LZ_MIN_MATCH <= size) {
+        uint32_t sequence;
+        memcpy(&sequence, in + pos, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = pos;
+        
+        if (candidate == SIZE_MAX || pos - candidate > 0xFFFF || memcmp(in + candidate, in + pos, LZ_MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+        
+        size_t length = LZ_MIN_MATCH;
+        while (pos + length < size && in[candidate + length] == in[pos + length]) {
+            length++;
+        }
+        lzPutSequence(output, in + anchor, pos - anchor, pos - candidate, length);
+        pos += length;
+        anchor = pos;
+    }
+    
+    lzPutSequence(output, in + anchor, size - anchor, 0, 0);
+    return output.size();
+}
+
+static bool lzDecompress(const char* input, size_t size, char* output, size_t outputSize) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(input);
+    size_t ip = 0;
+    size_t op = 0;
+    auto getLength = [in, size, &ip](size_t& length) {
+        unsigned char byte;
+        do {
+            if (ip >= size) {
+                return false;
+            }
+            byte = in[ip++];
+            length += byte;
+        } while (byte == 255);
+        return true;
+    };
+    
+    // Every length and offset is checked: a damaged cluster fails instead of
+    // writing outside the output
+    while (ip < size) {
+        unsigned char token = in[ip++];
+        size_t literals = token >> 4;
+        if ((literals == 15 && !getLength(literals)) || literals > size - ip || literals > outputSize - op) {
+            return false;
+        }
+        memcpy(output + op, in + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == size) {
+            break; // Last sequence
+        }
+        
+        if (size - ip < 2) {
+            return false;
+        }
+        size_t offset = in[ip] | (static_cast<size_t>(in[ip + 1]) << 8);
+        ip += 2;
+        size_t length = token & 15;
+        if (length == 15 && !getLength(length)) {
+            return false;
+        }
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || length > outputSize - op) {
+            return false;
+        }
+        
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t i = 0; i < length; i++) {
+            output[op + i] = output[op - offset + i];
+        }
+        op += length;
+    }
+    return op == outputSize;
+}
+
+// FNV-1a over a journal record, so a record torn by a crash is not replayed
+static uint32_t journalChecksum(const char* data, size_t size) {
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619U;
+    }
+    return hash;
+}
+
+// 64-bit hash of a block for the dedup index, a multiply-accumulate in the
+// style of XXH3: each 64-bit lane adds the product of the two halves of
+// (data ^ key) and the neighbouring data word. SSE2 runs two lanes per
+// instruction; the scalar loop computes the same value. size must be a
+// multiple of 32.
+static uint64_t hashBlock(const char* data, size_t size) {
+    static const uint64_t keys[4] = {0xBE4BA423396CFEB8ULL, 0x1CAD21F72C81017CULL,
+                                     0xDB979083E96DD4DEULL, 0x1F67B3B7A4A44072ULL};
+    uint64_t lanes[4] = {0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x85EBCA77C2B2AE63ULL};
+    
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes));
+    __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes + 2));
+    const __m128i lowKey = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys));
+    const __m128i highKey = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + 2));
+    for (size_t pos = 0; pos < size; pos += 32) {
+        __m128i lowData = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        __m128i highData = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos + 16));
+        __m128i lowMixed = _mm_xor_si128(lowData, lowKey);
+        __m128i highMixed = _mm_xor_si128(highData, highKey);
+        low = _mm_add_epi64(low, _mm_add_epi64(_mm_mul_epu32(lowMixed, _mm_shuffle_epi32(lowMixed, _MM_SHUFFLE(2, 3, 0, 1))),
+                                               _mm_shuffle_epi32(lowData, _MM_SHUFFLE(1, 0, 3, 2))));
+        high = _mm_add_epi64(high, _mm_add_epi64(_mm_mul_epu32(highMixed, _mm_shuffle_epi32(highMixed, _MM_SHUFFLE(2, 3, 0, 1))),
+                                                 _mm_shuffle_epi32(highData, _MM_SHUFFLE(1, 0, 3, 2))));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), low);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes + 2), high);
+#else
+    for (size_t pos = 0; pos < size; pos += 32) {
+        uint64_t words[4];
+        memcpy(words, data + pos, sizeof(words));
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t mixed = words[lane] ^ keys[lane];
+            lanes[lane] += (mixed & 0xFFFFFFFFULL) * (mixed >> 32) + words[lane ^ 1];
+        }
+    }
+#endif
+    
+    // Fold the lanes together and mix the bits
+    uint64_t hash = size * 0x9E3779B185EBCA87ULL;
+    for (int lane = 0; lane < 4; lane++) {
+        hash = (hash ^ lanes[lane]) * 0xC2B2AE3D27D4EB4FULL;
+        hash ^= hash >> 29;
+    }
+    return hash ^ (hash >> 32);
+}
+
+// CRC32C (Castagnoli polynomial, bit-reflected) of the image blocks. The
+// functions below work on the raw CRC register; crc32c() adds the usual
+// inversion before and after.
+const uint32_t CRC32C_POLY = 0x82F63B78;
+
+// Product of two polynomials modulo the CRC polynomial (bit 31 is x^0)
+static uint32_t crc32cMultiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 1U << 31; bit != 0; bit >>= 1) {
+        if (a & bit) {
+            product ^= b;
+        }
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// x^(8 * bytes) modulo the polynomial: multiplying a CRC register by it
+// gives the register after that many zero bytes
+static uint32_t crc32cZeros(unsigned long long bytes) {
+    uint32_t result = 1U << 31;
+    uint32_t power = 1U << 30; // x^1, squared for each bit of the count
+    for (unsigned long long bits = bytes * 8; bits != 0; bits >>= 1) {
+        if (bits & 1) {
+            result = crc32cMultiply(power, result);
+        }
+        power = crc32cMultiply(power, power);
+    }
+    return result;
+}
+
+// Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zero bytes
+struct Crc32cTables {
+    uint32_t table[8][256];
+};
+
+static const Crc32cTables& crc32cTables() {
+    static const Crc32cTables tables = [] {
+        Crc32cTables built;
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            uint32_t crc = byte;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+            built.table[0][byte] = crc;
+        }
+        for (int k = 1; k < 8; k++) {
+            for (uint32_t byte = 0; byte < 256; byte++) {
+                uint32_t previous = built.table[k - 1][byte];
+                built.table[k][byte] = (previous >> 8) ^ built.table[0][previous & 0xFF];
+            }
+        }
+        return built;
+    }();
+    return tables;
+}
+
+// Table-driven CRC, eight bytes per step
+static uint32_t crc32cSoftware(uint32_t crc, const char* data, size_t size) {
+    const Crc32cTables& tables = crc32cTables();
+    const uint32_t (*table)[256] = tables.table;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        word ^= crc;
+        crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF] ^ table[5][(word >> 16) & 0xFF] ^
+              table[4][(word >> 24) & 0xFF] ^ table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF] ^
+              table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+    }
+    for (; size > 0; data++, size--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ static_cast<unsigned char>(*data)) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HARDWARE
+// Moves a CRC register past a fixed number of zero bytes with four lookups:
+// table[k][b] is the product of x^(8 * bytes) and byte b placed at byte k
+struct Crc32cShift {
+    uint32_t table[4][256];
+};
+
+static bool cpuHasCrc32c() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+// crc32 has a latency of three cycles but a throughput of one, so a whole
+// block is summed as three lanes side by side. Each lane's register is then
+// shifted past the next lane and combined with it. Other sizes (and the
+// tail after the lanes) go through a single lane.
+CRC32C_TARGET static uint32_t crc32cHardware(uint32_t crc, const char* data, size_t size) {
+    static const std::vector<Crc32cShift> shifts = [] {
+        std::vector<Crc32cShift> built;
+        for (unsigned int blockBytes = MIN_BLOCK_SIZE; blockBytes <= MAX_BLOCK_SIZE; blockBytes *= 2) {
+            Crc32cShift shift;
+            uint32_t zeros = crc32cZeros(blockBytes / 24 * 8);
+            for (int k = 0; k < 4; k++) {
+                for (uint32_t byte = 0; byte < 256; byte++) {
+                    shift.table[k][byte] = crc32cMultiply(zeros, byte << (8 * k));
+                }
+            }
+            built.push_back(shift);
+        }
+        return built;
+    }();
+    
+    if (size >= MIN_BLOCK_SIZE && size <= MAX_BLOCK_SIZE && (size & (size - 1)) == 0) {
+        const Crc32cShift& shift = shifts[countTrailingZeros(size) - countTrailingZeros(MIN_BLOCK_SIZE)];
+        auto shifted = [&shift](uint32_t value) {
+            return shift.table[0][value & 0xFF] ^ shift.table[1][(value >> 8) & 0xFF] ^
+                   shift.table[2][(value >> 16) & 0xFF] ^ shift.table[3][value >> 24];
+        };
+        
+        size_t lane = size / 24 * 8;
+        uint64_t first = crc, second = 0, third = 0;
+        for (size_t pos = 0; pos < lane; pos += 8) {
+            uint64_t words[3];
+            memcpy(&words[0], data + pos, 8);
+            memcpy(&words[1], data + lane + pos, 8);
+            memcpy(&words[2], data + 2 * lane + pos, 8);
+            first = _mm_crc32_u64(first, words[0]);
+            second = _mm_crc32_u64(second, words[1]);
+            third = _mm_crc32_u64(third, words[2]);
+        }
+        crc = shifted(shifted(static_cast<uint32_t>(first)) ^ static_cast<uint32_t>(second)) ^ static_cast<uint32_t>(third);
+        data += 3 * lane;
+        size -= 3 * lane;
+    }
+    
+    uint64_t state = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        state = _mm_crc32_u64(state, word);
+    }
+    crc = static_cast<uint32_t>(state);
+    for (; size > 0; data++, size--) {
+        crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data));
+    }
+    return crc;
+}
+#endif
+
+static uint32_t crc32c(const char* data, size_t size) {
+#ifdef CRC32C_HARDWARE
+    static const bool hardware = cpuHasCrc32c();
+    if (hardware) {
+        return ~crc32cHardware(~0U, data, size);
+    }
+#endif
+    return ~crc32cSoftware(~0U, data, size);
+}
+
 class FileSystem {
 private:
     char* memory;                 // File system memory
+    bool memoryMapped;            // true when memory is a private mmap of IMAGE_FILE
+    int imageFd;                  // Descriptor backing the mapping (-1 if buffered)
+    
+    // Geometry, copied from the SuperBlock when the image is opened
+    unsigned long long imageSize;
+    unsigned int blockSize;
+    unsigned int totalBlocks;
+    unsigned int maxInodes;
+    unsigned int directBlocks;
+    unsigned int firstDataBlock;
+    unsigned int bitmapStart;
+    unsigned int features;
+    unsigned int blocksPerGroup;
+    unsigned int groupCount;
+    unsigned int groupTableStart;
+    unsigned int refcountStart;
+    unsigned int checksumStart;
+    
+    // In-memory summary of the block bitmap: bit i of fullWords is set when
+    // bitmap word i is completely allocated, and bit j of fullSummaryWords is
+    // set when fullWords word j is all ones (4096 allocated blocks).
+    std::vector<uint64_t> fullWords;
+    std::vector<uint64_t> fullSummaryWords;
+    
+    // Buddy allocator index, built from the bitmap when FEATURE_BUDDY is set:
+    // buddyFree[k] holds the first block of each free, aligned run of 2^k
+    // blocks. Alignment is counted from firstDataBlock.
+    std::vector<std::set<unsigned int>> buddyFree;
+    
+    // Inode map, loaded when the image is opened: the map blocks in chain
+    // order, the image offset of each chunk, and a bit per chunk that is set
+    // when all of its inodes are allocated.
+    std::vector<unsigned int> inodeMapBlocks;
+    std::vector<unsigned long long> inodeChunkOffsets;
+    std::vector<uint64_t> fullChunkWords;
+    std::vector<std::vector<unsigned int>> groupChunks; // Chunks stored in each block group
+    
+    // Snapshots: each keeps its own copy of the inode map, whose chunks it
+    // shares with the live table until live changes one of them. A snapshot's
+    // inodes are numbered from the view's base, assigned when it is loaded.
+    // chunkSharers counts the view entries pointing at each chunk offset.
+    struct SnapshotView {
+        unsigned int mapStart;
+        std::vector<unsigned int> mapBlocks;
+        std::vector<unsigned long long> chunkOffsets;
+    };
+    std::map<unsigned int, SnapshotView> snapshotViews;
+    std::unordered_map<unsigned long long, unsigned int> chunkSharers;
+    
+    // Delayed allocation: buffered writes per inode, and their total size
+    std::map<unsigned int, DelayedFile> delayedFiles;
+    unsigned long long delayedBytes;
+    
+    // Incremental defrag: the target of the last run (-1 for every file,
+    // -2 for none) and the inode number to resume from
+    int defragTarget;
+    unsigned int defragNext;
+    
+    // While compacting, blocks are only allocated below this (0: anywhere)
+    unsigned int allocationLimit;
+    
+    // Compact and defrag move data the journal does not carry, so the
+    // blocks they free are held here until the checkpoint that writes the
+    // moves is done: until then, a crash recovers the old mappings.
+    bool deferFrees;
+    std::vector<std::pair<unsigned int, unsigned int>> deferredFrees;
+    
+    // Dedup index (FEATURE_DEDUP): content hash -> a file data block holding
+    // it, and the hash each indexed block was entered under. Built on the
+    // first deduplicated write of a session; hits are confirmed with memcmp.
+    std::unordered_map<uint64_t, unsigned int> dedupIndex;
+    std::unordered_map<unsigned int, uint64_t> dedupHashes;
+    bool dedupIndexBuilt;
+    
+    // Metadata journal (not on Windows, where journalFd stays -1). The
+    // blocks before firstDataBlock are compared with journalShadow, their
+    // contents at the last commit. Metadata blocks in the data area are
+    // registered with journalBlock before they change, keeping their old
+    // contents (empty for a block that is new as a whole). Those with
+    // entries in the journal are in loggedBlocks; when one is freed it may
+    // hold file data next, so the next record revokes it (journalRevokes)
+    // and replay no longer writes the old entries over that data.
+    int journalFd;
+    unsigned int journalSequence; // Last transaction written to the journal
+    unsigned long long journalSize;
+    std::unique_ptr<char[]> journalShadow;
+    std::map<unsigned int, std::vector<char>> journalBlocks;
+    std::set<unsigned int> loggedBlocks;
+    std::set<unsigned int> journalRevokes;
+    
+    // Block checksums (FEATURE_CHECKSUMS): a bit per block written since the
+    // last update, and the words of that map with bits set. The blocks
+    // before the table are compared with journalShadow instead. The journal
+    // only compares the table blocks marked in checksumTableChanged.
+    std::vector<uint64_t> staleChecksums;
+    std::vector<size_t> staleChecksumWords;
+    std::vector<bool> checksumTableChanged;
+    
+    // Image writeback: a bit per data-area block changed since the image
+    // was last written and the words of that map with bits set, the blocks
+    // before firstDataBlock as they were written, and the size of the image
+    // file. A null savedShadow makes the next write cover everything.
+    std::vector<uint64_t> dirtyBlocks;
+    std::vector<size_t> dirtyWords;
+    std::unique_ptr<char[]> savedShadow;
+    unsigned long long savedSize;
+    
+    // Groups whose bitmap, reference count and checksum blocks are held in
+    // the shadows. The rest have not changed since the image was opened
+    // (they were never allocated from), so the shadows skip them and
+    // opening a large image copies only the part in use.
+    std::vector<bool> shadowedGroups;
+    
+    // Background flusher, running while run() reads commands: it writes the
+    // image back every flushInterval seconds (0: never), or when run() sets
+    // flushRequested. stateMutex is held by whichever thread is using the
+    // file system; the flusher lets go of it while it writes, with
+    // writebackActive set, and other writers of the image wait on
+    // writebackDone. Such a wait releases stateMutex in the middle of a
+    // command, so commandActive keeps the background threads from starting
+    // anything until run() has committed it and notified commandDone.
+    // Counters cover every writeback that wrote something.
+    unsigned int flushInterval;
+    std::thread flusher;
+    std::mutex stateMutex;
+    std::condition_variable flushWake;
+    std::condition_variable writebackDone;
+    std::condition_variable commandDone;
+    bool flushRequested;
+    bool writebackActive;
+    bool commandActive;
+    bool stopThreads;             // Set when run() returns, for both background threads
+    unsigned long long writebackCount;
+    unsigned long long writebackBytes;  // Bytes written to the image file, checkpoints included
+    unsigned long long writebackLastUs;
+    unsigned long long writebackMaxUs;
+    unsigned long long writebackTotalUs;
+    
+    // Background check (run() with verify): the checker thread goes over
+    // the image a group or a slice of blocks at a time, so opening it never
+    // waits for deep validation. run() prints checkReport once it is set.
+    std::thread checker;
+    std::string checkReport;
+    
     unsigned int currentInodeNumber; // Current directory inode number
     std::string currentPath;      // Current path
 
     // Helper functions
-    void initializeFileSystem();
+    void initializeFileSystem(const FormatOptions& options);
+    bool readImageGeometry(FormatOptions& options, bool& newImage);
+    void loadGeometry();
     void loadFileSystem();
-    void saveFileSystem();
+    ImageWrite collectData(unsigned long long fileSize);
+    ImageWrite collectMetadata(unsigned long long fileSize);
+    void finishWrite(const ImageWrite& write, bool saved);
+    bool saveFileSystem(const ImageWrite& write);
+    bool syncImageFile();
+    bool mapFileSystem(bool newImage);
+    void unmapFileSystem(unsigned long long fileSize = 0);
+    bool writeImage();
+    bool writeMetadata(unsigned long long fileSize);
+    bool writeBack();
+    void writeBackUnlocked(std::unique_lock<std::mutex>& lock);
+    void countWriteback(std::chrono::steady_clock::time_point started);
+    void waitForWriteback();
+    std::unique_lock<std::mutex> lockBetweenCommands();
+    void copyRanges(ImageWrite& write);
+    void flushLoop();
+    void checkLoop();
+    std::vector<unsigned int> checksummedBlocks();
+    unsigned long long liveImageSize();
+    unsigned int replayJournal();
+    void startJournal(bool checkpointNow);
+    void journalBlock(unsigned int block, bool newBlock = false);
+    void journalChanges(std::vector<char>& record, unsigned long long offset, const char* before, const char* after, size_t size);
+    bool writeJournalRecord();
+    bool writeRevokeRecord();
+    void journalRevoked(std::vector<char>& record);
+    bool appendJournalRecord(std::vector<char>& record);
+    void commitJournal();
+    bool checkpoint();
+    unsigned long long dirtyBlockCount() const;
+    unsigned int metadataGroup(unsigned int block) const;
+    bool metadataShadowed(unsigned int block) const {
+        unsigned int group = metadataGroup(block);
+        return group >= groupCount || shadowedGroups[group];
+    }
+    void copyMetadata(std::unique_ptr<char[]>& shadow);
+    void shadowGroup(unsigned int group);
+    
+    uint32_t* blockChecksums() {
+        return reinterpret_cast<uint32_t*>(blockAt(checksumStart));
+    }
+    void setChecksum(unsigned int block, uint32_t checksum) {
+        blockChecksums()[block] = checksum;
+        checksumTableChanged[static_cast<size_t>(block) * sizeof(uint32_t) / blockSize] = true;
+    }
+    bool checksumStale(unsigned int block) const {
+        return (staleChecksums[block / BITS_PER_WORD] >> (block % BITS_PER_WORD)) & 1;
+    }
+    void markDirty(unsigned int start, unsigned int count = 1);
+    void markCopied(unsigned int dest, unsigned int src, unsigned int count);
+    static void addToBlockSet(std::vector<uint64_t>& bits, std::vector<size_t>& words, unsigned int block) {
+        if (bits[block / BITS_PER_WORD] == 0) {
+            words.push_back(block / BITS_PER_WORD);
+        }
+        bits[block / BITS_PER_WORD] |= 1ULL << (block % BITS_PER_WORD);
+    }
+    void updateChecksums();
+    bool verifyBlocks(unsigned int start, unsigned int count, unsigned int& badBlock);
+    
+    char* blockAt(unsigned int blockNum) {
+        return memory + static_cast<size_t>(blockNum) * blockSize;
+    }
+    unsigned long long inodeOffset(unsigned int inodeNum) {
+        if (inodeNum >= SNAPSHOT_INODE_BASE) {
+            auto view = std::prev(snapshotViews.upper_bound(inodeNum));
+            unsigned int local = inodeNum - view->first;
+            return view->second.chunkOffsets[local / INODES_PER_CHUNK] + (local % INODES_PER_CHUNK) * INODE_SIZE;
+        }
+        return inodeChunkOffsets[inodeNum / INODES_PER_CHUNK] + (inodeNum % INODES_PER_CHUNK) * INODE_SIZE;
+    }
+    char* inodeSlot(unsigned int inodeNum) {
+        return memory + inodeOffset(inodeNum);
+    }
+    InodeChunk* inodeChunk(unsigned int chunk) {
+        char* mapBlock = blockAt(inodeMapBlocks[chunk / chunksPerMapBlock()]);
+        return reinterpret_cast<InodeChunk*>(mapBlock + sizeof(ChainBlockHeader)) + chunk % chunksPerMapBlock();
+    }
+    InodeChunk* viewChunk(const SnapshotView& view, unsigned int chunk) {
+        char* mapBlock = blockAt(view.mapBlocks[chunk / chunksPerMapBlock()]);
+        return reinterpret_cast<InodeChunk*>(mapBlock + sizeof(ChainBlockHeader)) + chunk % chunksPerMapBlock();
+    }
+    bool validInode(unsigned int inodeNum) {
+        if (inodeNum < SNAPSHOT_INODE_BASE) {
+            return inodeNum < maxInodes;
+        }
+        auto view = snapshotViews.upper_bound(inodeNum);
+        if (view == snapshotViews.begin()) {
+            return false;
+        }
+        --view;
+        return inodeNum - view->first < view->second.chunkOffsets.size() * INODES_PER_CHUNK;
+    }
+    unsigned int chunksPerMapBlock() const {
+        return (blockSize - sizeof(ChainBlockHeader)) / sizeof(InodeChunk);
+    }
+    GroupDescriptor* groupDescriptor(unsigned int group) {
+        return reinterpret_cast<GroupDescriptor*>(blockAt(groupTableStart)) + group;
+    }
+    unsigned int groupStart(unsigned int group) const {
+        return group * blocksPerGroup;
+    }
+    unsigned int inodeGroup(unsigned int inodeNum) {
+        return static_cast<unsigned int>(inodeOffset(inodeNum) / blockSize / blocksPerGroup);
+    }
     
     unsigned int allocateBlock();
+    unsigned int allocateBlockRun(unsigned int count, unsigned int goal = 0, bool clear = true);
+    bool allocateBlocks(unsigned int count, std::vector<unsigned int>& blocks, unsigned int goal = 0, bool clear = true);
     void deallocateBlock(unsigned int blockNum);
+    void deallocateBlockRun(unsigned int start, unsigned int count);
+    void deallocateBlocks(const std::vector<unsigned int>& blocks);
+    void releaseBlockRun(unsigned int start, unsigned int count);
+    void releaseDeferredFrees();
+    
+    // References to each block beyond its first (0 for a block used once)
+    uint16_t* blockRefs() {
+        return reinterpret_cast<uint16_t*>(blockAt(refcountStart));
+    }
+    bool remapBlocks(Inode& inode, const std::vector<std::pair<unsigned int, unsigned int>>& moves);
+    bool unshareBlocks(unsigned int inodeNum, Inode& inode, unsigned int firstBlock, unsigned int lastBlock);
+    void dedupBlocks(unsigned int inodeNum, Inode& inode, unsigned int firstBlock, unsigned int lastBlock);
+    void indexBlock(unsigned int block, uint64_t hash);
+    void buildDedupIndex();
+    bool canReflink(const Inode& inode);
+    bool reflinkFile(const Inode& srcInode, Inode& destInode);
+    unsigned int createDirectory(unsigned int parentInodeNum);
+    bool loadSnapshots();
+    unsigned int addSnapshotView(unsigned int mapStart);
+    void removeSnapshotView(unsigned int base);
+    bool shareInode(Inode& inode);
+    bool preserveChunk(unsigned int chunk);
+    bool preserveInode(unsigned int inodeNum);
+    bool inodeShared(unsigned int inodeNum) {
+        return inodeNum < maxInodes && chunkSharers.count(inodeChunkOffsets[inodeNum / INODES_PER_CHUNK]) != 0;
+    }
+    std::vector<std::pair<unsigned int, unsigned int>> snapshotOnlyChunks();
+    bool isSnapshot(int inodeNum) {
+        return inodeNum >= 0 && (static_cast<unsigned int>(inodeNum) >= SNAPSHOT_INODE_BASE ||
+                                 (readInode(inodeNum).flags & INODE_SNAPSHOT) != 0);
+    }
     
-    unsigned int allocateInode();
+    uint64_t* bitmapWords() {
+        return reinterpret_cast<uint64_t*>(blockAt(bitmapStart));
+    }
+    size_t bitmapWordCount() const {
+        return (static_cast<size_t>(totalBlocks) + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    }
+    unsigned int markBlocks(unsigned int start, unsigned int count, bool used);
+    void updateSummary(size_t word);
+    void buildAllocatorSummary();
+    size_t nextNonFullWord(size_t word);
+    bool findFreeRun(unsigned int count, unsigned int& start, unsigned int from);
+    void buildBuddyIndex();
+    bool findBuddyRun(unsigned int count, unsigned int& start, unsigned int goal, unsigned int limit);
+    void buddyInsert(unsigned int start, unsigned int count);
+    void buddyRemove(unsigned int start, unsigned int count);
+    
+    unsigned int allocateInode(unsigned int group, bool directory = false);
     void deallocateInode(unsigned int inodeNum);
+    bool addInodeChunk(unsigned int block, unsigned int offset);
+    bool growInodeTable(unsigned int group);
+    bool loadInodeMap();
+    unsigned int findFreeChunk(unsigned int group);
+    unsigned int findDirectoryGroup(unsigned int parentInodeNum);
+    void countGroupBlocks();
     
     Inode readInode(unsigned int inodeNum);
     void writeInode(unsigned int inodeNum, const Inode& inode);
     
-    std::vector<DirectoryEntry> readDirectoryEntries(unsigned int inodeNum);
+    std::vector<DirectoryEntry> readDirectoryEntries(unsigned int inodeNum, bool stored = false);
     bool addDirectoryEntry(unsigned int dirInodeNum, const std::string& name, unsigned int inodeNum);
     bool removeDirectoryEntry(unsigned int dirInodeNum, const std::string& name);
     int findDirectoryEntry(unsigned int dirInodeNum, const std::string& name);
     
     void initializeDirectory(unsigned int dirInodeNum, unsigned int parentInodeNum);
     
+    std::vector<Extent> readExtents(const Inode& inode);
+    bool writeExtents(Inode& inode, const std::vector<Extent>& extents);
+    static std::vector<Extent> extentsFromBlocks(const std::vector<unsigned int>& blocks, unsigned int firstLogical);
+    std::vector<BlockRun> getFileRuns(const Inode& inode, unsigned int firstBlock = 0, unsigned int lastBlock = 0xFFFFFFFF);
+    std::vector<unsigned int> getMappingBlocks(const Inode& inode);
+    static void appendRun(std::vector<BlockRun>& runs, unsigned int logical, unsigned int physical,
+                          unsigned int length = 1, unsigned int flags = 0);
+    void walkIndirectTree(unsigned int block, int depth, unsigned long long firstLogical,
+                          std::vector<BlockRun>* runs, std::vector<unsigned int>* mappingBlocks,
+                          unsigned int firstBlock = 0, unsigned int lastBlock = 0xFFFFFFFF);
+    int locateBlock(unsigned int logical, unsigned long long& offset) const;
+    unsigned int* findTreeSlot(unsigned int& root, int depth, unsigned long long offset, BlockMapCursor& cursor,
+                               const std::function<unsigned int()>* newMappingBlock);
+    unsigned int lookupBlock(const Inode& inode, unsigned int logical, BlockMapCursor& cursor);
+    unsigned int* getBlockSlot(Inode& inode, unsigned int logical, BlockMapCursor& cursor,
+                               const std::function<unsigned int()>& newMappingBlock);
+    unsigned int mappingBlocksFor(unsigned long long blockCount) const;
+    unsigned long long maxMappedBlocks() const;
+    unsigned int pointersPerBlock() const {
+        return blockSize / sizeof(unsigned int);
+    }
+    void freeInodeBlocks(const Inode& inode);
+    bool allocateRange(Inode& inode, unsigned int firstBlock, unsigned int lastBlock, unsigned int goal,
+                       unsigned int extentFlags = 0, std::vector<BlockRun>* fresh = nullptr);
+    bool convertToExtents(Inode& inode);
+    bool markWritten(Inode& inode, unsigned int firstBlock, unsigned int lastBlock);
+    bool preallocateFile(unsigned int inodeNum, unsigned long long offset, unsigned long long length);
+    unsigned int countFragments(const Inode& inode);
+    bool defragFile(unsigned int inodeNum, unsigned int& blocksMoved);
+    void collectFiles(unsigned int dirInodeNum, std::vector<unsigned int>& files);
+    bool moveTreeBlocks(unsigned int& block, int depth, unsigned int limit);
+    bool relocateInode(unsigned int inodeNum, unsigned int limit);
+    void relocateInodeTable(unsigned int limit);
+    void recountGroups();
+    static void mergeExtents(std::vector<Extent>& extents);
+    bool readCluster(const std::vector<Extent>& extents, unsigned int firstBlock, char* buffer);
+    bool storeCluster(const char* buffer, unsigned int firstBlock, unsigned int blocks, unsigned int goal,
+                      std::vector<Extent>& extents);
+    bool writeCompressed(unsigned int inodeNum, Inode& inode, unsigned long long offset, const char* data, size_t length);
+    bool compressFile(unsigned int inodeNum);
+    bool copyClusters(const Inode& srcInode, Inode& destInode, unsigned int goal);
+    bool moveInlineToBlocks(unsigned int inodeNum, Inode& inode);
+    bool writeFile(unsigned int inodeNum, unsigned long long offset, const char* data, size_t length);
+    bool bufferWrite(unsigned int inodeNum, const Inode& inode, unsigned long long offset, const char* data, size_t length);
+    unsigned int delayedReservation(const Inode& inode, const DelayedFile& file) const;
+    bool flushFile(unsigned int inodeNum);
+    bool flushDelayed();
+    void discardDelayed(unsigned int inodeNum);
+    unsigned int availableBlocks() const {
+        const SuperBlock* superBlock = reinterpret_cast<const SuperBlock*>(memory);
+        return superBlock->freeBlocks - superBlock->reservedBlocks;
+    }
+    unsigned int extentsPerBlock() const {
+        return blockSize / sizeof(Extent) - 1; // First slot holds the ChainBlockHeader
+    }
+    
     int getInodeFromPath(const std::string& path);
     std::vector<std::string> parsePath(const std::string& path);
     std::pair<int, std::string> getParentInodeAndFilename(const std::string& path);
 
 public:
-    FileSystem();
+    explicit FileSystem(const FormatOptions* format = nullptr);
     ~FileSystem();
-    void run();
+    bool isOpen() const { return memory != nullptr; }
+    void run(unsigned int flushSeconds = FLUSH_INTERVAL_SECONDS, bool verify = false);
+    
+    static FormatOptions defaultFormatOptions();
+    static bool validateFormatOptions(const FormatOptions& options);
+    static unsigned int bitmapBlocksFor(unsigned long long totalBlocks, unsigned int blockSize);
+    static unsigned int groupTableBlocksFor(unsigned long long totalBlocks, unsigned int blockSize);
+    static unsigned int refcountBlocksFor(unsigned long long totalBlocks, unsigned int blockSize);
+    static unsigned int checksumBlocksFor(unsigned long long totalBlocks, unsigned int blockSize);
     
     // Command functions
-    void cmdTouch(const std::string& filename, unsigned int size);
+    void cmdTouch(const std::string& filename, unsigned long long size);
     void cmdRm(const std::string& filename);
     void cmdMkdir(const std::string& dirname);
     void cmdRmdir(const std::string& dirname);
@@ -94,56 +1057,359 @@ public:
     void cmdCopyFile(const std::string& src, const std::string& dest);
     void cmdSum();
     void cmdCat(const std::string& filename);
+    void cmdWrite(const std::string& filename, unsigned long long offset, const std::string& text);
+    void cmdPrealloc(const std::string& filename, unsigned long long bytes);
+    void cmdDefrag(const std::string& path, unsigned int budgetMs);
+    void cmdCompact();
+    void cmdCompress(const std::string& filename);
+    void cmdSnapshot(const std::string& action, const std::string& name);
+    void cmdSync();
     void cmdDebug(); // Added debug command
 };
 
-FileSystem::FileSystem() {
-    memory = new char[MEMORY_SIZE];
-    initializeFileSystem();
-    loadFileSystem();
+FileSystem::FileSystem(const FormatOptions* format) {
+    memory = nullptr;
+    memoryMapped = false;
+    imageFd = -1;
+    delayedBytes = 0;
+    defragTarget = -2;
+    defragNext = 0;
+    allocationLimit = 0;
+    deferFrees = false;
+    dedupIndexBuilt = false;
+    journalFd = -1;
+    journalSequence = 0;
+    journalSize = 0;
+    savedSize = 0;
+    flushInterval = 0;
+    flushRequested = false;
+    writebackActive = false;
+    commandActive = false;
+    stopThreads = false;
+    writebackCount = 0;
+    writebackBytes = 0;
+    writebackLastUs = 0;
+    writebackMaxUs = 0;
+    writebackTotalUs = 0;
+    
+    FormatOptions options = format ? *format : defaultFormatOptions();
+    bool newImage = (format != nullptr);
+    if (!newImage && !readImageGeometry(options, newImage)) {
+        return; // Existing image is not usable, leave the file system closed
+    }
+    imageSize = options.imageSize;
+    
+    // Prefer mapping the image; fall back to a buffer. Either way changes
+    // stay in memory until a writeback. calloc hands large buffers out as
+    // untouched zero pages, so only the part read from the file costs anything.
+    if (!mapFileSystem(newImage)) {
+        memory = static_cast<char*>(calloc(static_cast<size_t>(imageSize), 1));
+        if (memory == nullptr) {
+            std::cout << "Error: Not enough memory for a " << imageSize << " byte image\n";
+            return;
+        }
+        if (!newImage) {
+            loadFileSystem();
+        }
+    }
+    
+    unsigned int replayed = 0;
+    if (newImage) {
+        initializeFileSystem(options);
+    } else {
+        // The image is written back incrementally against what was loaded.
+        // Replaying the journal changes memory first, so then the saved copy
+        // is taken before it, for every group.
+        loadGeometry();
+        std::error_code error;
+        if (std::filesystem::file_size(JOURNAL_FILE, error) > 0 && !error) {
+            shadowedGroups.assign(groupCount, true);
+            copyMetadata(savedShadow);
+        }
+        replayed = replayJournal();
+        maxInodes = reinterpret_cast<SuperBlock*>(memory)->maxInodes; // The inode table may have grown
+        buildAllocatorSummary();
+        if (!loadInodeMap() || !loadSnapshots()) {
+            std::cout << "Error: " << IMAGE_FILE << " has a corrupt inode map\n";
+            if (memoryMapped) {
+                unmapFileSystem();
+            } else {
+                free(memory);
+            }
+            memory = nullptr;
+            return;
+        }
+    }
+    
+    // Delayed writes never survive a restart, so nothing is reserved yet
+    reinterpret_cast<SuperBlock*>(memory)->reservedBlocks = 0;
+    
+    // A new image is written out whole first
+    if (!savedShadow) {
+        shadowedGroups.assign(groupCount, false);
+        for (unsigned int group = 0; group < groupCount; group++) {
+            shadowedGroups[group] = !(groupDescriptor(group)->flags & GROUP_BLOCKS_UNINIT);
+        }
+        if (!newImage) {
+            copyMetadata(savedShadow);
+        }
+    }
+    
+    // A new or recovered image is written back before the journal starts over
+    startJournal(newImage || replayed > 0);
+    
+    // Set current directory to root
+    currentInodeNumber = 0;
+    currentPath = "/";
 }
 
 FileSystem::~FileSystem() {
-    saveFileSystem();
-    delete[] memory;
+    if (memory == nullptr) {
+        return;
+    }
+    
+    flushDelayed();
+    
+    // With a journal this is a last checkpoint, which only empties the
+    // journal if the image was written; otherwise it is replayed next time
+    bool saved;
+    if (journalFd >= 0) {
+        saved = checkpoint();
+    } else {
+        updateChecksums();
+        saved = writeImage();
+    }
+    
+    // The image file ends after the last block in use; the free tail is
+    // restored as zeros when the image is opened again
+    if (memoryMapped) {
+        unmapFileSystem(saved ? liveImageSize() : 0);
+    } else {
+        free(memory);
+    }
+    
+#ifndef _WIN32
+    if (journalFd >= 0) {
+        close(journalFd);
+    }
+#endif
+}
+
+FormatOptions FileSystem::defaultFormatOptions() {
+    FormatOptions options;
+    options.imageSize = DEFAULT_IMAGE_SIZE;
+    options.blockSize = DEFAULT_BLOCK_SIZE;
+    options.maxInodes = DEFAULT_MAX_INODES;
+    options.directBlocks = DEFAULT_DIRECT_BLOCKS;
+    options.features = 0;
+    return options;
+}
+
+bool FileSystem::validateFormatOptions(const FormatOptions& options) {
+    if (options.blockSize < MIN_BLOCK_SIZE || options.blockSize > MAX_BLOCK_SIZE ||
+        (options.blockSize & (options.blockSize - 1)) != 0) {
+        std::cout << "Error: Block size must be a power of two between " << MIN_BLOCK_SIZE
+                  << " and " << MAX_BLOCK_SIZE << " bytes\n";
+        return false;
+    }
+    
+    if (options.directBlocks == 0 || options.directBlocks > MAX_DIRECT_BLOCKS) {
+        std::cout << "Error: Direct blocks must be between 1 and " << MAX_DIRECT_BLOCKS << "\n";
+        return false;
+    }
+    
+    if (options.maxInodes < 2 || options.maxInodes > SNAPSHOT_INODE_BASE - INODES_PER_CHUNK) {
+        std::cout << "Error: Inode count must be between 2 and " << SNAPSHOT_INODE_BASE - INODES_PER_CHUNK << "\n";
+        return false;
+    }
+    
+    unsigned long long totalBlocks = options.imageSize / options.blockSize;
+    unsigned long long chunks = (options.maxInodes + INODES_PER_CHUNK - 1) / INODES_PER_CHUNK;
+    unsigned long long inodeBlocks = (chunks * INODE_CHUNK_SIZE + options.blockSize - 1) / options.blockSize;
+    unsigned long long chunksPerMapBlock = (options.blockSize - sizeof(ChainBlockHeader)) / sizeof(InodeChunk);
+    unsigned long long mapBlocks = (chunks + chunksPerMapBlock - 1) / chunksPerMapBlock;
+    if (totalBlocks > 0xFFFFFFFFULL) {
+        std::cout << "Error: Image has too many blocks, use a larger block size\n";
+        return false;
+    }
+    
+    // SuperBlock + inode table + bitmap + group table + reference counts + checksums + inode map + root directory
+    // + at least one data block
+    unsigned long long refcountBlocks = (options.features & (FEATURE_DEDUP | FEATURE_REFLINK))
+        ? refcountBlocksFor(totalBlocks, options.blockSize) : 0;
+    unsigned long long checksumBlocks = (options.features & FEATURE_CHECKSUMS) ? checksumBlocksFor(totalBlocks, options.blockSize) : 0;
+    if (totalBlocks < 1 + inodeBlocks + bitmapBlocksFor(totalBlocks, options.blockSize) +
+                      groupTableBlocksFor(totalBlocks, options.blockSize) + refcountBlocks + checksumBlocks + mapBlocks + 2) {
+        std::cout << "Error: Image size too small for " << options.maxInodes << " inodes\n";
+        return false;
+    }
+    
+    return true;
+}
+
+unsigned int FileSystem::bitmapBlocksFor(unsigned long long totalBlocks, unsigned int blockSize) {
+    // One bit per block, rounded up to whole 64-bit words
+    unsigned long long bytes = (totalBlocks + BITS_PER_WORD - 1) / BITS_PER_WORD * sizeof(uint64_t);
+    return static_cast<unsigned int>((bytes + blockSize - 1) / blockSize);
+}
+
+unsigned int FileSystem::groupTableBlocksFor(unsigned long long totalBlocks, unsigned int blockSize) {
+    // One descriptor per group of blockSize * 8 blocks
+    unsigned long long blocksPerGroup = static_cast<unsigned long long>(blockSize) * 8;
+    unsigned long long groups = (totalBlocks + blocksPerGroup - 1) / blocksPerGroup;
+    return static_cast<unsigned int>((groups * sizeof(GroupDescriptor) + blockSize - 1) / blockSize);
+}
+
+unsigned int FileSystem::refcountBlocksFor(unsigned long long totalBlocks, unsigned int blockSize) {
+    // One 16-bit count per block
+    return static_cast<unsigned int>((totalBlocks * sizeof(uint16_t) + blockSize - 1) / blockSize);
+}
+
+unsigned int FileSystem::checksumBlocksFor(unsigned long long totalBlocks, unsigned int blockSize) {
+    // One CRC32C per block
+    return static_cast<unsigned int>((totalBlocks * sizeof(uint32_t) + blockSize - 1) / blockSize);
 }
 
-void FileSystem::initializeFileSystem() {
-    // Initialize memory
-    memset(memory, 0, MEMORY_SIZE);
+bool FileSystem::readImageGeometry(FormatOptions& options, bool& newImage) {
+    std::ifstream file(IMAGE_FILE, std::ios::binary);
+    SuperBlock header;
+    
+    if (!file || !file.read(reinterpret_cast<char*>(&header), sizeof(SuperBlock))) {
+        // No image yet (or an empty file): create one with the requested geometry
+        newImage = true;
+        return true;
+    }
+    
+    if (header.magic != FS_MAGIC || header.inodeSize != INODE_SIZE) {
+        std::cout << "Error: " << IMAGE_FILE << " is not a valid file system image\n";
+        return false;
+    }
+    if (header.version > FS_VERSION || (header.features & ~KNOWN_FEATURES) != 0) {
+        std::cout << "Error: " << IMAGE_FILE << " was formatted by a newer version (format " << header.version
+                  << ", features 0x" << std::hex << header.features << std::dec << ")\n";
+        return false;
+    }
+    
+    options.blockSize = header.blockSize;
+    options.imageSize = static_cast<unsigned long long>(header.totalBlocks) * header.blockSize;
+    // Only the initial inode table sits before the bitmap; chunks added later
+    // live in the data area
+    options.maxInodes = static_cast<unsigned int>(
+        std::min<unsigned long long>((header.bitmapStart - 1ULL) * header.blockSize / INODE_SIZE, SNAPSHOT_INODE_BASE - INODES_PER_CHUNK));
+    options.directBlocks = header.directBlocks;
+    options.features = header.features;
+    
+    if (!validateFormatOptions(options)) {
+        std::cout << "Error: " << IMAGE_FILE << " has an invalid geometry\n";
+        return false;
+    }
     
+    newImage = false;
+    return true;
+}
+
+void FileSystem::loadGeometry() {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    blockSize = superBlock->blockSize;
+    totalBlocks = superBlock->totalBlocks;
+    maxInodes = superBlock->maxInodes;
+    directBlocks = superBlock->directBlocks;
+    firstDataBlock = superBlock->firstDataBlock;
+    bitmapStart = superBlock->bitmapStart;
+    features = superBlock->features;
+    blocksPerGroup = superBlock->blocksPerGroup;
+    groupCount = superBlock->groupCount;
+    groupTableStart = superBlock->groupTableStart;
+    refcountStart = superBlock->refcountStart;
+    checksumStart = superBlock->checksumStart;
+    imageSize = static_cast<unsigned long long>(totalBlocks) * blockSize;
+    
+    staleChecksums.assign(checksumStart != 0 ? bitmapWordCount() : 0, 0);
+    staleChecksumWords.clear();
+    checksumTableChanged.assign(checksumStart != 0 ? firstDataBlock - checksumStart : 0, false);
+    dirtyBlocks.assign(bitmapWordCount(), 0);
+    dirtyWords.clear();
+}
+
+void FileSystem::initializeFileSystem(const FormatOptions& options) {
+    // Memory starts zero-filled: a freshly extended mapping or a calloc buffer
     // Initialize SuperBlock
     SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
-    superBlock->magic = 0x12345678;
-    superBlock->blockSize = BLOCK_SIZE;
-    superBlock->totalBlocks = TOTAL_BLOCKS;
-    superBlock->freeBlocks = TOTAL_BLOCKS - FIRST_DATA_BLOCK;
-    superBlock->maxInodes = MAX_INODES;
-    superBlock->freeInodes = MAX_INODES - 1; // Reserve inode 0 for root directory
-    superBlock->firstFreeBlock = FIRST_DATA_BLOCK; // This should be FIRST_DATA_BLOCK, not 0
-    superBlock->firstFreeInode = 1; // Inode 0 is reserved for root directory
-
-    // Initialize free block list
-    for (unsigned int i = FIRST_DATA_BLOCK; i < TOTAL_BLOCKS - 1; i++) {
-        unsigned int* nextFree = reinterpret_cast<unsigned int*>(memory + i * BLOCK_SIZE);
-        *nextFree = i + 1;
-    }
-    // Last block points to 0 (end of list)
-    unsigned int* lastBlock = reinterpret_cast<unsigned int*>(memory + (TOTAL_BLOCKS - 1) * BLOCK_SIZE);
-    *lastBlock = 0;
-    
-    // Initialize free inode list
-    for (unsigned int i = 1; i < MAX_INODES - 1; i++) {
-        Inode* inode = reinterpret_cast<Inode*>(memory + BLOCK_SIZE + i * INODE_SIZE);
-        inode->indirectBlock = i + 1; // Use indirectBlock field to store next free inode
-    }
-    // Last inode points to 0 (end of list)
-    Inode* lastInode = reinterpret_cast<Inode*>(memory + BLOCK_SIZE + (MAX_INODES - 1) * INODE_SIZE);
-    lastInode->indirectBlock = 0;
+    unsigned int initialChunks = (options.maxInodes + INODES_PER_CHUNK - 1) / INODES_PER_CHUNK;
+    unsigned int inodeBlocks = static_cast<unsigned int>(
+        (static_cast<unsigned long long>(initialChunks) * INODE_CHUNK_SIZE + options.blockSize - 1) / options.blockSize);
+    
+    superBlock->magic = FS_MAGIC;
+    superBlock->version = FS_VERSION;
+    superBlock->blockSize = options.blockSize;
+    superBlock->totalBlocks = static_cast<unsigned int>(options.imageSize / options.blockSize);
+    superBlock->maxInodes = 0; // Counted up as the inode table chunks are added
+    superBlock->directBlocks = options.directBlocks;
+    superBlock->inodeSize = INODE_SIZE;
+    superBlock->bitmapStart = 1 + inodeBlocks; // SuperBlock + Inode blocks
+    superBlock->bitmapBlocks = bitmapBlocksFor(superBlock->totalBlocks, options.blockSize);
+    superBlock->blocksPerGroup = options.blockSize * 8;
+    superBlock->groupCount = (superBlock->totalBlocks + superBlock->blocksPerGroup - 1) / superBlock->blocksPerGroup;
+    superBlock->groupTableStart = superBlock->bitmapStart + superBlock->bitmapBlocks;
+    superBlock->firstDataBlock = superBlock->groupTableStart +
+                                 groupTableBlocksFor(superBlock->totalBlocks, options.blockSize);
+    
+    // Images that share blocks keep a reference count per block after the group table
+    superBlock->refcountStart = 0;
+    superBlock->snapshotDir = 0;
+    superBlock->journalSequence = 0;
+    if (options.features & (FEATURE_DEDUP | FEATURE_REFLINK)) {
+        superBlock->refcountStart = superBlock->firstDataBlock;
+        superBlock->firstDataBlock += refcountBlocksFor(superBlock->totalBlocks, options.blockSize);
+    }
+    
+    // The checksum table comes last, so every other metadata block is before it
+    superBlock->checksumStart = 0;
+    if (options.features & FEATURE_CHECKSUMS) {
+        superBlock->checksumStart = superBlock->firstDataBlock;
+        superBlock->firstDataBlock += checksumBlocksFor(superBlock->totalBlocks, options.blockSize);
+    }
+    superBlock->features = options.features;
+    loadGeometry();
+    
+    superBlock->freeBlocks = totalBlocks - firstDataBlock;
+    superBlock->freeInodes = 0;
+    superBlock->firstFreeBlock = firstDataBlock;
+    superBlock->firstFreeInode = 0;
+    superBlock->inodeMapStart = 0;
+    superBlock->inodeChunks = 0;
+
+    // Initialize block bitmap: metadata blocks are in use, and the padding
+    // bits past the last block are marked used so they are never handed out
+    uint64_t* words = bitmapWords();
+    for (unsigned int block = 0; block < firstDataBlock; block += BITS_PER_WORD) {
+        unsigned int count = std::min(BITS_PER_WORD, firstDataBlock - block);
+        words[block / BITS_PER_WORD] |= bitRange(0, count);
+    }
+    if (totalBlocks % BITS_PER_WORD != 0) {
+        unsigned int tail = totalBlocks % BITS_PER_WORD;
+        words[totalBlocks / BITS_PER_WORD] |= bitRange(tail, BITS_PER_WORD - tail);
+    }
+    buildAllocatorSummary();
+    countGroupBlocks();
+    
+    // Register the initial inode table, packed after the superblock, in the inode map
+    inodeMapBlocks.clear();
+    inodeChunkOffsets.clear();
+    fullChunkWords.clear();
+    groupChunks.assign(groupCount, std::vector<unsigned int>());
+    for (unsigned int chunk = 0; chunk < initialChunks; chunk++) {
+        unsigned long long offset = static_cast<unsigned long long>(chunk) * INODE_CHUNK_SIZE;
+        addInodeChunk(1 + static_cast<unsigned int>(offset / blockSize), static_cast<unsigned int>(offset % blockSize));
+    }
+    
+    // Inode 0 is reserved for root directory
+    allocateInode(0, true);
     
     // Initialize root directory
     Inode rootInode;
     rootInode.type = 1; // Directory
+    rootInode.flags = 0;
     rootInode.size = 0;
     rootInode.creationTime = time(nullptr);
     rootInode.modificationTime = rootInode.creationTime;
@@ -153,375 +1419,4046 @@ void FileSystem::initializeFileSystem() {
     unsigned int rootBlock = allocateBlock();
     rootInode.blockAddresses[0] = rootBlock;
     rootInode.indirectBlock = 0;
+    rootInode.doubleIndirectBlock = 0;
+    rootInode.tripleIndirectBlock = 0;
     
     // Write root inode
     writeInode(0, rootInode);
     
     // Initialize root directory with . and .. entries
     initializeDirectory(0, 0);
-    
-    // Set current directory to root
-    currentInodeNumber = 0;
-    currentPath = "/";
 }
 
 void FileSystem::loadFileSystem() {
-    std::ifstream file("filesystem.dat", std::ios::binary);
+    std::ifstream file(IMAGE_FILE, std::ios::binary);
+    size_t loaded = 0;
     if (file) {
-        file.read(memory, MEMORY_SIZE);
+        file.read(memory, imageSize);
+        loaded = static_cast<size_t>(file.gcount());
         file.close();
-        
-        // Set current directory to root
-        currentInodeNumber = 0;
-        currentPath = "/";
     }
+    
+    // A saved image stops after its last block in use; the buffer is
+    // already zero past it
+    savedSize = loaded;
 }
 
-void FileSystem::saveFileSystem() {
-    std::ofstream file("filesystem.dat", std::ios::binary);
-    if (file) {
-        file.write(memory, MEMORY_SIZE);
-        file.close();
+// Adds a byte range to a write, clipped to the live part of the image.
+// Ranges a short gap apart are joined; the blocks in between are unchanged.
+static void addWriteRange(ImageWrite& write, unsigned long long start, unsigned long long end, unsigned long long fileSize) {
+    end = std::min(end, fileSize);
+    if (start >= end) {
+        return; // Past the live data: not part of the file
+    }
+    if (!write.ranges.empty() && start <= write.ranges.back().second + SAVE_MERGE_GAP) {
+        write.ranges.back().second = std::max(write.ranges.back().second, end);
+    } else {
+        write.ranges.push_back({start, end});
     }
 }
 
-unsigned int FileSystem::allocateBlock() {
-    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
-    
-    if (superBlock->freeBlocks == 0 || superBlock->firstFreeBlock == 0) {
-        std::cout << "Debug: No free blocks available. Free blocks: " << superBlock->freeBlocks 
-                  << ", First free block: " << superBlock->firstFreeBlock << std::endl;
-        return 0; // No free blocks
+ImageWrite FileSystem::collectData(unsigned long long fileSize) {
+    // The data-area blocks changed since the last writeback, in order. The
+    // dirty bits are taken here and marked again if the write fails.
+    ImageWrite write;
+    std::sort(dirtyWords.begin(), dirtyWords.end());
+    for (size_t word : dirtyWords) {
+        uint64_t bits = dirtyBlocks[word];
+        dirtyBlocks[word] = 0;
+        while (bits != 0) {
+            unsigned int block = static_cast<unsigned int>(word * BITS_PER_WORD + countTrailingZeros(bits));
+            bits &= bits - 1;
+            write.dirty.push_back(block);
+            if (savedShadow) {
+                addWriteRange(write, static_cast<unsigned long long>(block) * blockSize,
+                              static_cast<unsigned long long>(block + 1) * blockSize, fileSize);
+            }
+        }
     }
-    
-    unsigned int blockNum = superBlock->firstFreeBlock;
-    
-    // FIXED: Check if block number is valid
-    if (blockNum >= TOTAL_BLOCKS) {
-        std::cout << "Debug: Invalid block number in free list: " << blockNum << std::endl;
-        return 0;
+    dirtyWords.clear();
+    return write; // Without a saved copy, collectMetadata writes everything
+}
+
+ImageWrite FileSystem::collectMetadata(unsigned long long fileSize) {
+    // The metadata blocks that differ from the saved copy, which is only
+    // updated once the write succeeds. A new image is written from scratch:
+    // every block that is not all zeros, so the file stays sparse.
+    ImageWrite write;
+    write.fileSize = fileSize;
+    write.whole = !savedShadow;
+    if (write.whole) {
+        for (unsigned long long offset = 0; offset < fileSize; offset += blockSize) {
+            const char* data = memory + offset;
+            if (data[0] != 0 || memcmp(data, data + 1, blockSize - 1) != 0) {
+                addWriteRange(write, offset, offset + blockSize, fileSize);
+            }
+        }
+        return write;
     }
     
-    unsigned int* nextFree = reinterpret_cast<unsigned int*>(memory + blockNum * BLOCK_SIZE);
-    superBlock->firstFreeBlock = *nextFree;
-    superBlock->freeBlocks--;
-    
-    // Clear the allocated block
-    memset(memory + blockNum * BLOCK_SIZE, 0, BLOCK_SIZE);
-    
-    return blockNum;
+    for (unsigned int block = 0; block < firstDataBlock; block++) {
+        size_t offset = static_cast<size_t>(block) * blockSize;
+        if (metadataShadowed(block) && memcmp(savedShadow.get() + offset, memory + offset, blockSize) != 0) {
+            addWriteRange(write, offset, offset + blockSize, fileSize);
+        }
+    }
+    return write;
 }
 
-void FileSystem::deallocateBlock(unsigned int blockNum) {
-    if (blockNum < FIRST_DATA_BLOCK || blockNum >= TOTAL_BLOCKS) {
-        return; // Invalid block number
+void FileSystem::finishWrite(const ImageWrite& write, bool saved) {
+    if (!saved) {
+        // Nothing counts as written: the metadata still differs from the
+        // saved copy, and the dirty blocks are marked for the next try. An
+        // image file that went missing is written whole next time.
+        for (unsigned int block : write.dirty) {
+            addToBlockSet(dirtyBlocks, dirtyWords, block);
+        }
+        if (!memoryMapped && !std::filesystem::exists(IMAGE_FILE)) {
+            savedShadow.reset();
+        }
+        std::cout << "Error: could not write " << IMAGE_FILE << ", its changes are kept for the next writeback\n";
+        return;
     }
     
-    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
-    
-    // Add block to free list
-    unsigned int* nextFree = reinterpret_cast<unsigned int*>(memory + blockNum * BLOCK_SIZE);
-    *nextFree = superBlock->firstFreeBlock;
-    superBlock->firstFreeBlock = blockNum;
-    superBlock->freeBlocks++;
+    for (const auto& range : write.ranges) {
+        writebackBytes += range.second - range.first;
+    }
+    if (write.whole) {
+        copyMetadata(savedShadow);
+    } else if (savedShadow) {
+        // What was written, which may be older than memory by now
+        unsigned long long metadataEnd = static_cast<unsigned long long>(firstDataBlock) * blockSize;
+        size_t at = 0;
+        for (const auto& range : write.ranges) {
+            const char* source = write.bytes.empty() ? memory + range.first : write.bytes.data() + at;
+            at += static_cast<size_t>(range.second - range.first);
+            if (range.first < metadataEnd) {
+                memcpy(savedShadow.get() + range.first, source, static_cast<size_t>(std::min(range.second, metadataEnd) - range.first));
+            }
+        }
+    }
+    if (write.fileSize != 0) {
+        savedSize = write.fileSize;
+    }
 }
 
-unsigned int FileSystem::allocateInode() {
-    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
-    
-    if (superBlock->freeInodes == 0 || superBlock->firstFreeInode == 0) {
-        return MAX_INODES; // No free inodes
+void FileSystem::copyRanges(ImageWrite& write) {
+    for (const auto& range : write.ranges) {
+        write.bytes.insert(write.bytes.end(), memory + range.first, memory + range.second);
     }
-    
-    unsigned int inodeNum = superBlock->firstFreeInode;
-    Inode* inode = reinterpret_cast<Inode*>(memory + BLOCK_SIZE + inodeNum * INODE_SIZE);
-    superBlock->firstFreeInode = inode->indirectBlock;
-    superBlock->freeInodes--;
-    
-    // Initialize the allocated inode
-    inode->type = 0;
-    inode->size = 0;
-    inode->creationTime = time(nullptr);
-    inode->modificationTime = inode->creationTime;
-    memset(inode->blockAddresses, 0, sizeof(inode->blockAddresses));
-    inode->indirectBlock = 0;
-    
-    return inodeNum;
 }
 
-void FileSystem::deallocateInode(unsigned int inodeNum) {
-    if (inodeNum >= MAX_INODES) {
-        return; // Invalid inode number
+bool FileSystem::saveFileSystem(const ImageWrite& write) {
+    // The stream is checked after every write; on failure the caller keeps
+    // the changes for the next writeback
+    if (write.ranges.empty() && (write.fileSize == 0 || memoryMapped || write.fileSize == savedSize)) {
+        return true;
+    }
+    std::fstream file;
+    if (write.whole && !memoryMapped) {
+        // First save of a new buffered image. A mapped one already has its
+        // all-zero file, which must keep backing the mapping.
+        file.open(IMAGE_FILE, std::ios::out | std::ios::trunc | std::ios::binary);
+    } else {
+        file.open(IMAGE_FILE, std::ios::in | std::ios::out | std::ios::binary);
+    }
+    if (!file) {
+        return false;
     }
     
-    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    // The superblock says which journal records the image holds, so it is
+    // written last, once everything else is on disk
+    const char* superBlock = nullptr;
+    size_t at = 0;
+    for (const auto& range : write.ranges) {
+        const char* source = write.bytes.empty() ? memory + range.first : write.bytes.data() + at;
+        at += static_cast<size_t>(range.second - range.first);
+        unsigned long long start = range.first;
+        if (start < blockSize) {
+            superBlock = source;
+            source += blockSize;
+            start = blockSize;
+        }
+        if (start < range.second) {
+            file.seekp(static_cast<std::streamoff>(start));
+            file.write(source, static_cast<std::streamsize>(range.second - start));
+            if (!file) {
+                return false;
+            }
+        }
+    }
+    if (!file.flush()) {
+        return false;
+    }
+    if (!memoryMapped && write.fileSize != 0 && write.fileSize != savedSize) {
+        std::error_code error;
+        std::filesystem::resize_file(IMAGE_FILE, write.fileSize, error);
+        if (error) {
+            return false;
+        }
+    }
     
-    // Add inode to free list
-    Inode* inode = reinterpret_cast<Inode*>(memory + BLOCK_SIZE + inodeNum * INODE_SIZE);
-    inode->indirectBlock = superBlock->firstFreeInode;
-    superBlock->firstFreeInode = inodeNum;
-    superBlock->freeInodes++;
+    if (superBlock != nullptr) {
+        if (!syncImageFile()) {
+            return false;
+        }
+        file.seekp(0);
+        file.write(superBlock, blockSize);
+    }
+    file.close();
+    return file && syncImageFile();
 }
 
-Inode FileSystem::readInode(unsigned int inodeNum) {
-    Inode inode;
+bool FileSystem::syncImageFile() {
+#ifndef _WIN32
+    // The journal is emptied once the image is saved, so it must be on disk
+    int fd = open(IMAGE_FILE, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = (fsync(fd) == 0);
+    close(fd);
+    return synced;
+#else
+    return true;
+#endif
+}
+
+bool FileSystem::mapFileSystem(bool newImage) {
+#ifdef _WIN32
+    (void)newImage;
+    return false; // No mmap backend on Windows, use the buffered image
+#else
+    int fd = open(IMAGE_FILE, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return false;
+    }
     
-    if (inodeNum >= MAX_INODES) {
-        // Return empty inode for invalid inode number
-        memset(&inode, 0, sizeof(Inode));
-        return inode;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
     }
     
-    // Read inode from memory
-    memcpy(&inode, memory + BLOCK_SIZE + inodeNum * INODE_SIZE, sizeof(Inode));
+    // A new image starts from an all-zero file; a short one is extended with zeros
+    if (newImage && ftruncate(fd, 0) != 0) {
+        close(fd);
+        return false;
+    }
+    if ((newImage || st.st_size < static_cast<off_t>(imageSize)) &&
+        ftruncate(fd, static_cast<off_t>(imageSize)) != 0) {
+        close(fd);
+        return false;
+    }
     
-    return inode;
+    // The mapping is private: changes stay in memory until a writeback
+    // writes them to the file, so the image on disk only ever moves from
+    // one checkpoint to the next and never holds half an operation. Memory
+    // is only charged for the pages that are changed.
+    void* mapped = mmap(nullptr, imageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        std::cout << "Debug: mmap of " << IMAGE_FILE << " failed, using buffered image" << std::endl;
+        close(fd);
+        return false;
+    }
+    
+    memory = static_cast<char*>(mapped);
+    memoryMapped = true;
+    imageFd = fd;
+    return true;
+#endif
 }
 
-void FileSystem::writeInode(unsigned int inodeNum, const Inode& inode) {
-    if (inodeNum >= MAX_INODES) {
-        return; // Invalid inode number
+void FileSystem::unmapFileSystem(unsigned long long fileSize) {
+#ifndef _WIN32
+    // Changes were written back beforehand; the file has backed the whole
+    // mapping until now and only shrinks once it is gone
+    munmap(memory, imageSize);
+    if (fileSize > 0 && fileSize < imageSize && ftruncate(imageFd, static_cast<off_t>(fileSize)) != 0) {
+        std::cout << "Debug: could not shrink " << IMAGE_FILE << std::endl;
     }
-    
-    // Write inode to memory
-    memcpy(memory + BLOCK_SIZE + inodeNum * INODE_SIZE, &inode, sizeof(Inode));
+    close(imageFd);
+#else
+    (void)fileSize;
+#endif
+    memory = nullptr;
+    memoryMapped = false;
+    imageFd = -1;
 }
 
-std::vector<DirectoryEntry> FileSystem::readDirectoryEntries(unsigned int inodeNum) {
-    std::vector<DirectoryEntry> entries;
+unsigned long long FileSystem::liveImageSize() {
+    // Bytes up to the end of the last block in use, found from the back of
+    // the bitmap; groups never allocated from are skipped unread
+    const uint64_t* words = bitmapWords();
+    size_t wordsPerGroup = blocksPerGroup / BITS_PER_WORD;
+    
+    for (unsigned int group = groupCount; group-- > 0;) {
+        if (groupDescriptor(group)->flags & GROUP_BLOCKS_UNINIT) {
+            continue;
+        }
+        
+        size_t first = group * wordsPerGroup;
+        size_t last = std::min(first + wordsPerGroup, bitmapWordCount());
+        for (size_t word = last; word-- > first;) {
+            uint64_t bits = words[word];
+            if (word == bitmapWordCount() - 1 && totalBlocks % BITS_PER_WORD != 0) {
+                bits &= bitRange(0, totalBlocks % BITS_PER_WORD); // Not the padding
+            }
+            if (bits != 0) {
+                unsigned int bit = BITS_PER_WORD - 1;
+                while ((bits >> bit) == 0) {
+                    bit--;
+                }
+                return (word * BITS_PER_WORD + bit + 1) * static_cast<unsigned long long>(blockSize);
+            }
+        }
+    }
     
-    Inode inode = readInode(inodeNum);
-    if (inode.type != 1) {
-        return entries; // Not a directory
+    return static_cast<unsigned long long>(firstDataBlock) * blockSize;
+}
+
+unsigned int FileSystem::replayJournal() {
+    // Redo the transactions committed after the image was last written
+    // back. Entries hold final bytes, so replaying one twice does no harm.
+    std::ifstream file(JOURNAL_FILE, std::ios::binary);
+    std::vector<char> journal;
+    if (file) {
+        journal.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
     }
     
-    // Read directory entries from direct blocks
-    for (unsigned int i = 0; i < DIRECT_BLOCKS; i++) {
-        if (inode.blockAddresses[i] == 0) {
-            continue;
+    // First the records to redo, every entry checked before any is applied,
+    // and the last record that revoked each block
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    journalSequence = superBlock->journalSequence;
+    std::vector<std::pair<JournalRecord, const char*>> records;
+    std::unordered_map<unsigned long long, unsigned int> revokedBy;
+    size_t pos = 0;
+    while (journal.size() - pos >= sizeof(JournalRecord)) {
+        JournalRecord record;
+        memcpy(&record, journal.data() + pos, sizeof(record));
+        const char* entries = journal.data() + pos + sizeof(record);
+        if (record.magic != JOURNAL_MAGIC || record.length > journal.size() - pos - sizeof(record) ||
+            journalChecksum(entries, record.length) != record.checksum) {
+            break; // Torn by a crash: nothing after it was committed
+        }
+        pos += sizeof(record) + record.length;
+        if (record.sequence <= journalSequence) {
+            continue; // Already in the image
+        }
+        if (record.sequence != journalSequence + 1) {
+            break;
         }
         
-        char* blockData = memory + inode.blockAddresses[i] * BLOCK_SIZE;
-        unsigned int entriesPerBlock = BLOCK_SIZE / sizeof(DirectoryEntry);
+        size_t at = 0;
+        bool valid = true;
+        while (valid && at < record.length) {
+            JournalEntry entry;
+            valid = record.length - at >= sizeof(entry);
+            if (valid) {
+                memcpy(&entry, entries + at, sizeof(entry));
+                at += sizeof(entry) + ((entry.flags & (JOURNAL_ZERO | JOURNAL_REVOKE)) ? 0 : entry.length);
+                valid = entry.offset <= imageSize && entry.length <= imageSize - entry.offset && at <= record.length;
+            }
+        }
+        if (!valid) {
+            break;
+        }
         
-        for (unsigned int j = 0; j < entriesPerBlock; j++) {
-            DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
-            
-            if (entry->inodeNumber != 0) {
-                entries.push_back(*entry);
+        for (at = 0; at < record.length;) {
+            JournalEntry entry;
+            memcpy(&entry, entries + at, sizeof(entry));
+            at += sizeof(entry) + ((entry.flags & (JOURNAL_ZERO | JOURNAL_REVOKE)) ? 0 : entry.length);
+            if (entry.flags & JOURNAL_REVOKE) {
+                for (unsigned long long block = entry.offset / blockSize; block * blockSize < entry.offset + entry.length; block++) {
+                    revokedBy[block] = record.sequence;
+                }
             }
         }
+        records.push_back({record, entries});
+        journalSequence = record.sequence;
     }
     
-    // Read directory entries from indirect blocks
-    if (inode.indirectBlock != 0) {
-        unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(memory + inode.indirectBlock * BLOCK_SIZE);
-        
-        for (unsigned int i = 0; i < BLOCK_SIZE / sizeof(unsigned int); i++) {
-            if (indirectBlockData[i] == 0) {
+    // Then apply them block by block, leaving out the blocks a later record
+    // revoked: they were freed and may hold file data since
+    for (const auto& logged : records) {
+        const JournalRecord& record = logged.first;
+        const char* entries = logged.second;
+        for (size_t at = 0; at < record.length;) {
+            JournalEntry entry;
+            memcpy(&entry, entries + at, sizeof(entry));
+            at += sizeof(entry);
+            if (entry.flags & JOURNAL_REVOKE) {
                 continue;
             }
+            const char* bytes = entries + at;
+            if (!(entry.flags & JOURNAL_ZERO)) {
+                at += entry.length;
+            }
             
-            char* blockData = memory + indirectBlockData[i] * BLOCK_SIZE;
-            unsigned int entriesPerBlock = BLOCK_SIZE / sizeof(DirectoryEntry);
-            
-            for (unsigned int j = 0; j < entriesPerBlock; j++) {
-                DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
-                
-                if (entry->inodeNumber != 0) {
-                    entries.push_back(*entry);
+            unsigned long long end = entry.offset + entry.length;
+            for (unsigned long long offset = entry.offset; offset < end;) {
+                unsigned long long block = offset / blockSize;
+                unsigned long long next = std::min(end, (block + 1) * blockSize);
+                auto revoked = revokedBy.find(block);
+                if (revoked == revokedBy.end() || revoked->second < record.sequence) {
+                    if (entry.flags & JOURNAL_ZERO) {
+                        memset(memory + offset, 0, next - offset);
+                    } else {
+                        memcpy(memory + offset, bytes + (offset - entry.offset), next - offset);
+                    }
+                    
+                    // Blocks in the data area are written back like dirty file data
+                    if (block >= firstDataBlock) {
+                        addToBlockSet(dirtyBlocks, dirtyWords, static_cast<unsigned int>(block));
+                    }
                 }
+                offset = next;
             }
         }
     }
+    unsigned int replayed = static_cast<unsigned int>(records.size());
     
-    return entries;
+    if (replayed > 0) {
+        std::cout << "Recovered " << replayed << " operation(s) from " << JOURNAL_FILE << std::endl;
+    }
+    return replayed;
 }
 
-bool FileSystem::addDirectoryEntry(unsigned int dirInodeNum, const std::string& name, unsigned int inodeNum) {
-    if (name.length() >= MAX_FILENAME_LENGTH) {
-        return false; // Name too long
+void FileSystem::startJournal(bool checkpointNow) {
+#ifndef _WIN32
+    journalFd = open(JOURNAL_FILE, O_RDWR | O_CREAT, 0644);
+    if (journalFd < 0) {
+        std::cout << "Debug: could not open " << JOURNAL_FILE << ", changes are only saved on exit" << std::endl;
+        return;
     }
     
-    Inode dirInode = readInode(dirInodeNum);
-    if (dirInode.type != 1) {
-        return false; // Not a directory
+    if (checkpointNow) {
+        checkpoint();
+        return;
     }
     
-    // Create new directory entry
-    DirectoryEntry newEntry;
-    strncpy(newEntry.name, name.c_str(), MAX_FILENAME_LENGTH - 1);
-    newEntry.name[MAX_FILENAME_LENGTH - 1] = '\0';
-    newEntry.inodeNumber = inodeNum;
-    
-    // Find a free slot in direct blocks
-    for (unsigned int i = 0; i < DIRECT_BLOCKS; i++) {
-        if (dirInode.blockAddresses[i] == 0) {
-            // Allocate a new block
-            unsigned int newBlock = allocateBlock();
-            if (newBlock == 0) {
-                std::cout << "Debug: Failed to allocate block for directory entry" << std::endl;
-                return false; // No free blocks
-            }
-            
-            dirInode.blockAddresses[i] = newBlock;
-            writeInode(dirInodeNum, dirInode);
-        }
-        
-        char* blockData = memory + dirInode.blockAddresses[i] * BLOCK_SIZE;
-        unsigned int entriesPerBlock = BLOCK_SIZE / sizeof(DirectoryEntry);
-        
-        for (unsigned int j = 0; j < entriesPerBlock; j++) {
-            DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
-            
-            if (entry->inodeNumber == 0) {
-                // Found a free slot
-                *entry = newEntry;
-                
-                // Update directory size
-                dirInode.size += sizeof(DirectoryEntry);
-                dirInode.modificationTime = time(nullptr);
-                writeInode(dirInodeNum, dirInode);
-                
-                return true;
-            }
-        }
+    // Whatever the journal holds is already in the image
+    if (ftruncate(journalFd, 0) == 0) {
+        fsync(journalFd);
     }
-    
-    // No free slots in direct blocks, try indirect block
-    if (dirInode.indirectBlock == 0) {
-        // Allocate indirect block
-        unsigned int indirectBlock = allocateBlock();
-        if (indirectBlock == 0) {
-            std::cout << "Debug: Failed to allocate indirect block for directory" << std::endl;
-            return false; // No free blocks
-        }
-        
-        dirInode.indirectBlock = indirectBlock;
-        writeInode(dirInodeNum, dirInode);
+    journalSequence = reinterpret_cast<SuperBlock*>(memory)->journalSequence;
+    copyMetadata(journalShadow);
+#else
+    (void)checkpointNow;
+#endif
+}
+
+void FileSystem::journalBlock(unsigned int block, bool newBlock) {
+    // Blocks before firstDataBlock are covered by the shadow copy
+    if (block < firstDataBlock) {
+        return;
+    }
+    markDirty(block);
+    if (journalFd < 0) {
+        return;
     }
     
-    unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(memory + dirInode.indirectBlock * BLOCK_SIZE);
+    // A freed block back in use is logged whole instead of revoked
+    if (journalRevokes.erase(block) != 0) {
+        newBlock = true;
+    }
     
-    for (unsigned int i = 0; i < BLOCK_SIZE / sizeof(unsigned int); i++) {
-        if (indirectBlockData[i] == 0) {
-            // Allocate a new block
-            unsigned int newBlock = allocateBlock();
-            if (newBlock == 0) {
-                std::cout << "Debug: Failed to allocate block for directory entry (indirect)" << std::endl;
-                return false; // No free blocks
-            }
-            
-            indirectBlockData[i] = newBlock;
-        }
-        
-        char* blockData = memory + indirectBlockData[i] * BLOCK_SIZE;
-        unsigned int entriesPerBlock = BLOCK_SIZE / sizeof(DirectoryEntry);
-        
-        for (unsigned int j = 0; j < entriesPerBlock; j++) {
-            DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
-            
-            if (entry->inodeNumber == 0) {
-                // Found a free slot
-                *entry = newEntry;
-                
-                // Update directory size
-                dirInode.size += sizeof(DirectoryEntry);
-                dirInode.modificationTime = time(nullptr);
-                writeInode(dirInodeNum, dirInode);
-                
-                return true;
-            }
+    auto found = journalBlocks.find(block);
+    if (found == journalBlocks.end()) {
+        std::vector<char>& before = journalBlocks[block];
+        if (!newBlock) {
+            before.assign(blockAt(block), blockAt(block) + blockSize);
         }
+    } else if (newBlock) {
+        found->second.clear();
     }
-    
-    std::cout << "Debug: No free slots for directory entry" << std::endl;
-    return false; // No free slots
 }
 
-bool FileSystem::removeDirectoryEntry(unsigned int dirInodeNum, const std::string& name) {
-    Inode dirInode = readInode(dirInodeNum);
-    if (dirInode.type != 1) {
-        return false; // Not a directory
-    }
-    
-    // Search in direct blocks
-    for (unsigned int i = 0; i < DIRECT_BLOCKS; i++) {
-        if (dirInode.blockAddresses[i] == 0) {
+void FileSystem::journalChanges(std::vector<char>& record, unsigned long long offset, const char* before,
+                                const char* after, size_t size) {
+    // One entry per changed range; ranges closer than an entry header are joined
+    const size_t word = sizeof(uint64_t);
+    size_t pos = 0;
+    while (pos < size) {
+        if (memcmp(before + pos, after + pos, word) == 0) {
+            pos += word;
             continue;
         }
         
-        char* blockData = memory + dirInode.blockAddresses[i] * BLOCK_SIZE;
-        unsigned int entriesPerBlock = BLOCK_SIZE / sizeof(DirectoryEntry);
-        
-        for (unsigned int j = 0; j < entriesPerBlock; j++) {
-            DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
-            
-            if (entry->inodeNumber != 0 && strcmp(entry->name, name.c_str()) == 0) {
-                // Found the entry to remove
-                entry->inodeNumber = 0;
-                
-                // Update directory size
-                dirInode.size -= sizeof(DirectoryEntry);
-                dirInode.modificationTime = time(nullptr);
-                writeInode(dirInodeNum, dirInode);
-                
-                return true;
+        size_t start = pos;
+        size_t end = pos + word;
+        for (pos = end; pos < size && pos - end < sizeof(JournalEntry); pos += word) {
+            if (memcmp(before + pos, after + pos, word) != 0) {
+                end = pos + word;
             }
         }
+        pos = end;
+        
+        JournalEntry entry = {offset + start, static_cast<unsigned int>(end - start), 0};
+        record.insert(record.end(), reinterpret_cast<const char*>(&entry), reinterpret_cast<const char*>(&entry + 1));
+        record.insert(record.end(), after + start, after + end);
+    }
+}
+
+bool FileSystem::writeJournalRecord() {
+    // Log the metadata changed since the last record as one record, synced
+    // before returning. Nothing is pending before the journal has started.
+    if (journalFd < 0 || !journalShadow) {
+        return true;
     }
     
-    // Search in indirect blocks
-    if (dirInode.indirectBlock != 0) {
-        unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(memory + dirInode.indirectBlock * BLOCK_SIZE);
-        
-        for (unsigned int i = 0; i < BLOCK_SIZE / sizeof(unsigned int); i++) {
-            if (indirectBlockData[i] == 0) {
+    std::vector<char> record(sizeof(JournalRecord));
+    journalRevoked(record);
+    for (unsigned int block = 0; block < firstDataBlock; block++) {
+        if (checksumStart != 0 && block >= checksumStart) {
+            // Only the checksum table blocks that were written can differ
+            if (!checksumTableChanged[block - checksumStart]) {
                 continue;
             }
-            
-            char* blockData = memory + indirectBlockData[i] * BLOCK_SIZE;
-            unsigned int entriesPerBlock = BLOCK_SIZE / sizeof(DirectoryEntry);
-            
-            for (unsigned int j = 0; j < entriesPerBlock; j++) {
-                DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
-                
-                if (entry->inodeNumber != 0 && strcmp(entry->name, name.c_str()) == 0) {
-                    // Found the entry to remove
-                    entry->inodeNumber = 0;
-                    
-                    // Update directory size
-                    dirInode.size -= sizeof(DirectoryEntry);
-                    dirInode.modificationTime = time(nullptr);
-                    writeInode(dirInodeNum, dirInode);
-                    
-                    return true;
-                }
-            }
+            checksumTableChanged[block - checksumStart] = false;
+        }
+        const char* before = journalShadow.get() + static_cast<size_t>(block) * blockSize;
+        if (metadataShadowed(block) && memcmp(before, blockAt(block), blockSize) != 0) {
+            journalChanges(record, static_cast<unsigned long long>(block) * blockSize, before, blockAt(block), blockSize);
+            memcpy(journalShadow.get() + static_cast<size_t>(block) * blockSize, blockAt(block), blockSize);
         }
     }
     
-    return false; // Entry not found
+    std::vector<char> zeros;
+    for (const auto& logged : journalBlocks) {
+        loggedBlocks.insert(logged.first);
+        unsigned long long offset = static_cast<unsigned long long>(logged.first) * blockSize;
+        const char* before = logged.second.data();
+        if (logged.second.empty()) {
+            // A new block: clear it, then add what was put in it
+            JournalEntry entry = {offset, blockSize, JOURNAL_ZERO};
+            record.insert(record.end(), reinterpret_cast<const char*>(&entry), reinterpret_cast<const char*>(&entry + 1));
+            zeros.resize(blockSize);
+            before = zeros.data();
+        }
+        journalChanges(record, offset, before, blockAt(logged.first), blockSize);
+    }
+    journalBlocks.clear();
+    return appendJournalRecord(record);
 }
 
-int FileSystem::findDirectoryEntry(unsigned int dirInodeNum, const std::string& name) {
-    std::vector<DirectoryEntry> entries = readDirectoryEntries(dirInodeNum);
+bool FileSystem::writeRevokeRecord() {
+    // A record of just the blocks freed since the last one, for a
+    // checkpoint to write before data that may reuse them
+    if (journalFd < 0 || !journalShadow) {
+        return true;
+    }
     
-    for (const DirectoryEntry& entry : entries) {
+    std::vector<char> record(sizeof(JournalRecord));
+    journalRevoked(record);
+    return appendJournalRecord(record);
+}
+
+void FileSystem::journalRevoked(std::vector<char>& record) {
+    // One revoke per run of freed blocks; what they held is not logged
+    for (auto revoked = journalRevokes.begin(); revoked != journalRevokes.end();) {
+        unsigned int start = *revoked;
+        unsigned int count = 0;
+        for (; revoked != journalRevokes.end() && *revoked == start + count && count < 0xFFFFFFFFU / blockSize; ++revoked) {
+            journalBlocks.erase(*revoked);
+            loggedBlocks.erase(*revoked);
+            count++;
+        }
+        JournalEntry entry = {static_cast<unsigned long long>(start) * blockSize, count * blockSize, JOURNAL_REVOKE};
+        record.insert(record.end(), reinterpret_cast<const char*>(&entry), reinterpret_cast<const char*>(&entry + 1));
+    }
+}
+
+bool FileSystem::appendJournalRecord(std::vector<char>& record) {
+    // Fill in the header of a record built after it, then write and sync it
+    if (record.size() == sizeof(JournalRecord)) {
+        return true; // Nothing changed
+    }
+    
+#ifndef _WIN32
+    JournalRecord header = {JOURNAL_MAGIC, journalSequence + 1, static_cast<unsigned int>(record.size() - sizeof(JournalRecord)), 0};
+    header.checksum = journalChecksum(record.data() + sizeof(JournalRecord), header.length);
+    memcpy(record.data(), &header, sizeof(header));
+    
+    if (pwrite(journalFd, record.data(), record.size(), static_cast<off_t>(journalSize)) != static_cast<ssize_t>(record.size()) ||
+        fdatasync(journalFd) != 0) {
+        return false; // The record's sequence number is used again by the next one
+    }
+    journalSequence++;
+    journalSize += record.size();
+    journalRevokes.clear();
+#endif
+    return true;
+}
+
+void FileSystem::commitJournal() {
+    // Log the metadata the last operation changed, synced before the shell
+    // moves on
+    if (!writeJournalRecord()) {
+        // The change is still in memory; write the image instead
+        std::cout << "Debug: could not write " << JOURNAL_FILE << ", checkpointing instead" << std::endl;
+        checkpoint();
+    } else if (journalSize > JOURNAL_LIMIT) {
+        checkpoint();
+    }
+}
+
+bool FileSystem::checkpoint() {
+    // Write the image back, then start the journal over
+    if (journalFd < 0) {
+        return false;
+    }
+    
+#ifndef _WIN32
+    // The image on disk is the last checkpoint, and a crash while writing
+    // this one leaves a mix of the two that replaying the journal completes.
+    // So every change is logged before the metadata is written, and the
+    // data goes first: blocks moved by compact and defrag are not logged,
+    // and the blocks they left stay allocated until this is done, so the
+    // old mappings still hold their data. The superblock's sequence,
+    // written last, moves past the journal only once the rest of the image
+    // is on disk; after a failed write the journal is kept whole and the
+    // next writeback retries. Blocks freed since the last record may be
+    // reused by the data, so their revokes are written first.
+    waitForWriteback();
+    if (!writeRevokeRecord()) {
+        std::cout << "Debug: could not write " << JOURNAL_FILE << " before checkpointing" << std::endl;
+        return false;
+    }
+    updateChecksums();
+    unsigned long long fileSize = liveImageSize();
+    ImageWrite data = collectData(fileSize);
+    bool saved = saveFileSystem(data);
+    finishWrite(data, saved);
+    if (!saved) {
+        return false;
+    }
+    if (!writeJournalRecord()) {
+        std::cout << "Debug: could not write " << JOURNAL_FILE << " before checkpointing" << std::endl;
+    }
+    reinterpret_cast<SuperBlock*>(memory)->journalSequence = journalSequence;
+    updateChecksums();
+    if (!writeMetadata(fileSize)) {
+        return false;
+    }
+    
+    if (ftruncate(journalFd, 0) == 0) {
+        fsync(journalFd);
+    }
+    journalSize = 0;
+    journalBlocks.clear();
+    loggedBlocks.clear();
+    journalRevokes.clear();
+    copyMetadata(journalShadow);
+    
+    // The moves are in the image now; log their freed blocks at once
+    if (!deferredFrees.empty()) {
+        releaseDeferredFrees();
+        updateChecksums();
+        writeJournalRecord();
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool FileSystem::writeImage() {
+    // Write what changed since the last writeback to the image file: the
+    // data blocks first, then the metadata that points to them. A session
+    // that changed nothing does no I/O at all.
+    waitForWriteback();
+    unsigned long long fileSize = liveImageSize();
+    ImageWrite data = collectData(fileSize);
+    bool saved = saveFileSystem(data);
+    finishWrite(data, saved);
+    return saved && writeMetadata(fileSize);
+}
+
+bool FileSystem::writeMetadata(unsigned long long fileSize) {
+    ImageWrite write = collectMetadata(fileSize);
+    bool saved = saveFileSystem(write);
+    finishWrite(write, saved);
+    return saved;
+}
+
+bool FileSystem::writeBack() {
+    // Give delayed writes their blocks and bring the image file up to date;
+    // with a journal this is a checkpoint, which also empties it
+    auto started = std::chrono::steady_clock::now();
+    unsigned long long bytesBefore = writebackBytes;
+    
+    flushDelayed();
+    bool saved;
+    if (journalFd >= 0) {
+        saved = checkpoint();
+    } else {
+        updateChecksums();
+        saved = writeImage();
+    }
+    if (writebackBytes != bytesBefore) {
+        countWriteback(started);
+    }
+    return saved;
+}
+
+void FileSystem::writeBackUnlocked(std::unique_lock<std::mutex>& lock) {
+    // checkpoint() for the flusher, which holds stateMutex only to collect
+    // and copy what to write and to record the result; commands run while
+    // the copies are written. Their own transactions are not in this
+    // checkpoint's data, so the superblock records the sequence reached
+    // when the data was collected and the journal is only emptied if no
+    // transaction was committed since.
+    auto started = std::chrono::steady_clock::now();
+    unsigned long long bytesBefore = writebackBytes;
+    
+    flushDelayed();
+    updateChecksums();
+    if (!writeJournalRecord()) {
+        std::cout << "Debug: could not write " << JOURNAL_FILE << " before checkpointing" << std::endl;
+    }
+    unsigned int sequence = journalSequence;
+    ImageWrite data = collectData(liveImageSize());
+    copyRanges(data);
+    writebackActive = true;
+    
+    lock.unlock();
+    bool saved = saveFileSystem(data);
+    lock.lock();
+    finishWrite(data, saved);
+    
+    if (saved) {
+        reinterpret_cast<SuperBlock*>(memory)->journalSequence = sequence;
+        updateChecksums();
+        ImageWrite metadata = collectMetadata(liveImageSize());
+        copyRanges(metadata);
+        
+        lock.unlock();
+        saved = saveFileSystem(metadata);
+        lock.lock();
+        finishWrite(metadata, saved);
+    }
+    
+#ifndef _WIN32
+    if (saved && journalFd >= 0 && journalSequence == sequence) {
+        if (ftruncate(journalFd, 0) == 0) {
+            fsync(journalFd);
+        }
+        journalSize = 0;
+        loggedBlocks.clear();
+    }
+#endif
+    writebackActive = false;
+    writebackDone.notify_all();
+    if (writebackBytes != bytesBefore) {
+        countWriteback(started);
+    }
+}
+
+void FileSystem::countWriteback(std::chrono::steady_clock::time_point started) {
+    unsigned long long elapsed = static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+    writebackCount++;
+    writebackLastUs = elapsed;
+    writebackMaxUs = std::max(writebackMaxUs, elapsed);
+    writebackTotalUs += elapsed;
+}
+
+void FileSystem::waitForWriteback() {
+    // Called with stateMutex held: a background writeback still writing
+    // must finish before the image is written again. Waiting lets go of
+    // the lock so that it can; commandActive keeps the flusher from
+    // starting another one on the half-done command meanwhile.
+    if (!writebackActive) {
+        return;
+    }
+    std::unique_lock<std::mutex> lock(stateMutex, std::adopt_lock);
+    writebackDone.wait(lock, [this] { return !writebackActive; });
+    lock.release();
+}
+
+std::unique_lock<std::mutex> FileSystem::lockBetweenCommands() {
+    // stateMutex for the checker, taken only once the running command has
+    // committed, even if it let go of the lock to wait for a writeback
+    std::unique_lock<std::mutex> lock(stateMutex);
+    commandDone.wait(lock, [this] { return !commandActive || stopThreads; });
+    return lock;
+}
+
+void FileSystem::flushLoop() {
+    // Body of the flusher thread. The wait releases stateMutex, and so do
+    // the writes themselves, so commands never wait for the disk.
+    std::unique_lock<std::mutex> lock(stateMutex);
+    while (true) {
+        flushWake.wait_for(lock, std::chrono::seconds(flushInterval),
+                           [this] { return (flushRequested && !commandActive) || stopThreads; });
+        if (stopThreads) {
+            return;
+        }
+        
+        // The period ran out while a command waits for the last writeback:
+        // write back once run() has committed it
+        if (commandActive) {
+            flushRequested = true;
+            continue;
+        }
+        flushRequested = false;
+        
+        // An idle shell costs nothing: no journal, delayed data or dirty
+        // blocks means the image is current, unless there is no journal to
+        // tell whether the metadata changed
+        if (journalFd >= 0 && journalSize == 0 && delayedBytes == 0 && dirtyBlockCount() == 0) {
+            continue;
+        }
+        
+        // An image not written yet is written whole, straight from memory
+        if (savedShadow) {
+            writeBackUnlocked(lock);
+        } else {
+            writeBack();
+        }
+    }
+}
+
+unsigned long long FileSystem::dirtyBlockCount() const {
+    unsigned long long dirty = 0;
+    for (size_t word : dirtyWords) {
+        dirty += popCount(dirtyBlocks[word]);
+    }
+    return dirty;
+}
+
+unsigned int FileSystem::metadataGroup(unsigned int block) const {
+    // The block group whose bitmap block, reference counts or checksums a
+    // metadata block holds; groupCount for metadata shared by all groups
+    if (block >= bitmapStart && block < groupTableStart) {
+        return block - bitmapStart;
+    }
+    if (checksumStart != 0 && block >= checksumStart) {
+        return static_cast<unsigned int>(
+            static_cast<unsigned long long>(block - checksumStart) * (blockSize / sizeof(uint32_t)) / blocksPerGroup);
+    }
+    if (refcountStart != 0 && block >= refcountStart) {
+        return static_cast<unsigned int>(
+            static_cast<unsigned long long>(block - refcountStart) * (blockSize / sizeof(uint16_t)) / blocksPerGroup);
+    }
+    return groupCount;
+}
+
+void FileSystem::copyMetadata(std::unique_ptr<char[]>& shadow) {
+    // The shadow is left uninitialized for the groups that are skipped, so
+    // its untouched pages cost nothing
+    if (!shadow) {
+        shadow.reset(new char[static_cast<size_t>(firstDataBlock) * blockSize]);
+    }
+    for (unsigned int block = 0; block < firstDataBlock; block++) {
+        if (metadataShadowed(block)) {
+            memcpy(shadow.get() + static_cast<size_t>(block) * blockSize, blockAt(block), blockSize);
+        }
+    }
+}
+
+void FileSystem::shadowGroup(unsigned int group) {
+    // A group is being allocated from for the first time this session. Its
+    // metadata has not changed since the shadows were taken, so its current
+    // contents are what they would have held.
+    shadowedGroups[group] = true;
+    for (unsigned int block = 0; block < firstDataBlock; block++) {
+        if (metadataGroup(block) != group) {
+            continue;
+        }
+        size_t offset = static_cast<size_t>(block) * blockSize;
+        if (journalShadow) {
+            memcpy(journalShadow.get() + offset, blockAt(block), blockSize);
+        }
+        if (savedShadow) {
+            memcpy(savedShadow.get() + offset, blockAt(block), blockSize);
+        }
+    }
+}
+
+void FileSystem::markDirty(unsigned int start, unsigned int count) {
+    // Data-area blocks whose contents changed: their checksums are out of
+    // date, and the next writeback writes them
+    for (unsigned int block = start; block < start + count; block++) {
+        if (checksumStart != 0) {
+            addToBlockSet(staleChecksums, staleChecksumWords, block);
+        }
+        addToBlockSet(dirtyBlocks, dirtyWords, block);
+    }
+}
+
+void FileSystem::markCopied(unsigned int dest, unsigned int src, unsigned int count) {
+    // Blocks copied as they are keep their checksum, so a damaged source
+    // stays detectable in the copy
+    for (unsigned int i = 0; i < count; i++) {
+        if (checksumStart != 0) {
+            setChecksum(dest + i, blockChecksums()[src + i]);
+            if (checksumStale(src + i)) {
+                addToBlockSet(staleChecksums, staleChecksumWords, dest + i);
+            }
+        }
+        addToBlockSet(dirtyBlocks, dirtyWords, dest + i);
+    }
+}
+
+void FileSystem::updateChecksums() {
+    // Sum the blocks written since the last update, then the metadata
+    // before the table that changed since the last commit (all of it when
+    // there is no journal shadow to compare with)
+    if (checksumStart == 0) {
+        return;
+    }
+    
+    for (size_t word : staleChecksumWords) {
+        uint64_t bits = staleChecksums[word];
+        staleChecksums[word] = 0;
+        while (bits != 0) {
+            unsigned int block = static_cast<unsigned int>(word * BITS_PER_WORD + countTrailingZeros(bits));
+            bits &= bits - 1;
+            setChecksum(block, crc32c(blockAt(block), blockSize));
+        }
+    }
+    staleChecksumWords.clear();
+    
+    for (unsigned int block = 0; block < checksumStart; block++) {
+        if (!journalShadow ||
+            (metadataShadowed(block) &&
+             memcmp(journalShadow.get() + static_cast<size_t>(block) * blockSize, blockAt(block), blockSize) != 0)) {
+            setChecksum(block, crc32c(blockAt(block), blockSize));
+        }
+    }
+}
+
+bool FileSystem::verifyBlocks(unsigned int start, unsigned int count, unsigned int& badBlock) {
+    // Blocks written during this command are not summed yet; they were not
+    // read from the image either
+    if (checksumStart == 0) {
+        return true;
+    }
+    
+    const uint32_t* sums = blockChecksums();
+    for (unsigned int block = start; block < start + count; block++) {
+        if (!checksumStale(block) && crc32c(blockAt(block), blockSize) != sums[block]) {
+            badBlock = block;
+            return false;
+        }
+    }
+    return true;
+}
+
+void FileSystem::updateSummary(size_t word) {
+    size_t summaryWord = word / BITS_PER_WORD;
+    uint64_t summaryBit = 1ULL << (word % BITS_PER_WORD);
+    
+    if (bitmapWords()[word] == ~0ULL) {
+        fullWords[summaryWord] |= summaryBit;
+    } else {
+        fullWords[summaryWord] &= ~summaryBit;
+    }
+    
+    size_t topWord = summaryWord / BITS_PER_WORD;
+    uint64_t topBit = 1ULL << (summaryWord % BITS_PER_WORD);
+    if (fullWords[summaryWord] == ~0ULL) {
+        fullSummaryWords[topWord] |= topBit;
+    } else {
+        fullSummaryWords[topWord] &= ~topBit;
+    }
+}
+
+void FileSystem::buildAllocatorSummary() {
+    size_t wordCount = bitmapWordCount();
+    size_t summaryCount = (wordCount + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    
+    fullWords.assign(summaryCount, 0);
+    fullSummaryWords.assign((summaryCount + BITS_PER_WORD - 1) / BITS_PER_WORD, 0);
+    
+    // Groups that never had a block allocated have no full words, so their
+    // part of the bitmap is not read at all
+    const uint64_t* words = bitmapWords();
+    size_t wordsPerGroup = blocksPerGroup / BITS_PER_WORD;
+    for (size_t i = 0; i < wordCount; i++) {
+        if (i % wordsPerGroup == 0 && (groupDescriptor(static_cast<unsigned int>(i / wordsPerGroup))->flags & GROUP_BLOCKS_UNINIT)) {
+            i += wordsPerGroup - 1;
+            continue;
+        }
+        if (words[i] == ~0ULL) {
+            fullWords[i / BITS_PER_WORD] |= 1ULL << (i % BITS_PER_WORD);
+        }
+    }
+    for (size_t i = 0; i < summaryCount; i++) {
+        if (fullWords[i] == ~0ULL) {
+            fullSummaryWords[i / BITS_PER_WORD] |= 1ULL << (i % BITS_PER_WORD);
+        }
+    }
+    
+    buildBuddyIndex();
+}
+
+void FileSystem::buildBuddyIndex() {
+    buddyFree.clear();
+    if (!(features & FEATURE_BUDDY)) {
+        return;
+    }
+    buddyFree.resize(BUDDY_MAX_ORDER + 1);
+    
+    // Feed every free run of the data area to the index
+    const uint64_t* words = bitmapWords();
+    unsigned int runStart = 0;
+    unsigned int runLength = 0;
+    unsigned int block = firstDataBlock;
+    
+    while (block < totalBlocks) {
+        // A group that was never allocated from is one free run
+        if (block % blocksPerGroup == 0 && (groupDescriptor(block / blocksPerGroup)->flags & GROUP_BLOCKS_UNINIT)) {
+            unsigned int groupBlocks = std::min(blocksPerGroup, totalBlocks - block);
+            if (runLength == 0) {
+                runStart = block;
+            }
+            runLength += groupBlocks;
+            block += groupBlocks;
+            continue;
+        }
+        
+        uint64_t word = words[block / BITS_PER_WORD];
+        unsigned int bit = block % BITS_PER_WORD;
+        
+        if (bit == 0 && (word == 0 || word == ~0ULL)) {
+            // Whole word free or used
+            if (word == 0) {
+                if (runLength == 0) {
+                    runStart = block;
+                }
+                runLength += BITS_PER_WORD;
+            } else if (runLength > 0) {
+                buddyInsert(runStart, runLength);
+                runLength = 0;
+            }
+            block += BITS_PER_WORD;
+            continue;
+        }
+        
+        if (word & (1ULL << bit)) {
+            if (runLength > 0) {
+                buddyInsert(runStart, runLength);
+                runLength = 0;
+            }
+        } else {
+            if (runLength == 0) {
+                runStart = block;
+            }
+            runLength++;
+        }
+        block++;
+    }
+    
+    // The padding bits past the last block are used, so a run never passes it
+    if (runLength > 0) {
+        buddyInsert(runStart, std::min(runLength, totalBlocks - runStart));
+    }
+}
+
+void FileSystem::buddyInsert(unsigned int start, unsigned int count) {
+    unsigned long long end = static_cast<unsigned long long>(start) + count;
+    
+    while (start < end) {
+        // Largest aligned block that starts here and fits in the range
+        unsigned int offset = start - firstDataBlock;
+        unsigned int order = 0;
+        while (order < BUDDY_MAX_ORDER && (offset & ((2U << order) - 1)) == 0 && start + (2ULL << order) <= end) {
+            order++;
+        }
+        
+        // Merge with free buddies on the way up
+        unsigned int block = start;
+        start += 1U << order;
+        while (order < BUDDY_MAX_ORDER) {
+            unsigned int buddy = firstDataBlock + ((block - firstDataBlock) ^ (1U << order));
+            std::set<unsigned int>::iterator it = buddyFree[order].find(buddy);
+            if (it == buddyFree[order].end()) {
+                break;
+            }
+            buddyFree[order].erase(it);
+            block = std::min(block, buddy);
+            order++;
+        }
+        buddyFree[order].insert(block);
+    }
+}
+
+void FileSystem::buddyRemove(unsigned int start, unsigned int count) {
+    unsigned long long end = static_cast<unsigned long long>(start) + count;
+    unsigned int pos = start;
+    
+    while (pos < end) {
+        // Find the free block holding pos, take it out and give back the
+        // parts on either side of [start, end)
+        bool found = false;
+        for (unsigned int order = 0; order <= BUDDY_MAX_ORDER && !found; order++) {
+            unsigned int block = firstDataBlock + (((pos - firstDataBlock) >> order) << order);
+            std::set<unsigned int>::iterator it = buddyFree[order].find(block);
+            if (it == buddyFree[order].end()) {
+                continue;
+            }
+            buddyFree[order].erase(it);
+            
+            unsigned long long blockEnd = static_cast<unsigned long long>(block) + (1U << order);
+            if (block < pos) {
+                buddyInsert(block, pos - block);
+            }
+            if (blockEnd > end) {
+                buddyInsert(static_cast<unsigned int>(end), static_cast<unsigned int>(blockEnd - end));
+            }
+            pos = static_cast<unsigned int>(std::min(blockEnd, end));
+            found = true;
+        }
+        
+        if (!found) {
+            pos++; // Not indexed as free
+        }
+    }
+}
+
+bool FileSystem::findBuddyRun(unsigned int count, unsigned int& start, unsigned int goal, unsigned int limit) {
+    // Smallest order that holds count blocks, then the first free block of
+    // that size or larger, preferring one at or after the goal. The run
+    // must end by limit.
+    unsigned int order = 0;
+    while ((1U << order) < count) {
+        order++;
+    }
+    
+    for (; order <= BUDDY_MAX_ORDER; order++) {
+        const std::set<unsigned int>& blocks = buddyFree[order];
+        if (blocks.empty()) {
+            continue;
+        }
+        std::set<unsigned int>::const_iterator it = blocks.lower_bound(goal);
+        if (it != blocks.end() && static_cast<unsigned long long>(*it) + count <= limit) {
+            start = *it;
+            return true;
+        }
+        if (static_cast<unsigned long long>(*blocks.begin()) + count <= limit) {
+            start = *blocks.begin();
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+unsigned int FileSystem::markBlocks(unsigned int start, unsigned int count, bool used) {
+    uint64_t* words = bitmapWords();
+    unsigned int changed = 0;
+    
+    // Update one word at a time, counting the bits that actually flipped
+    while (count > 0) {
+        size_t word = start / BITS_PER_WORD;
+        unsigned int bit = start % BITS_PER_WORD;
+        unsigned int span = std::min(count, BITS_PER_WORD - bit);
+        uint64_t mask = bitRange(bit, span);
+        
+        // A word never spans two groups, so the flips land in one descriptor
+        GroupDescriptor* group = groupDescriptor(start / blocksPerGroup);
+        if (used) {
+            if (!shadowedGroups.empty() && !shadowedGroups[start / blocksPerGroup]) {
+                shadowGroup(start / blocksPerGroup);
+            }
+            group->flags &= ~GROUP_BLOCKS_UNINIT;
+            unsigned int flipped = popCount(~words[word] & mask);
+            group->freeBlocks -= flipped;
+            changed += flipped;
+            words[word] |= mask;
+        } else {
+            unsigned int flipped = popCount(words[word] & mask);
+            group->freeBlocks += flipped;
+            changed += flipped;
+            words[word] &= ~mask;
+        }
+        updateSummary(word);
+        
+        start += span;
+        count -= span;
+    }
+    
+    return changed;
+}
+
+void FileSystem::countGroupBlocks() {
+    // Each group's free map is one bitmap block; padding bits are marked used.
+    // Groups past the metadata are untouched: they are counted without
+    // reading their bitmap and flagged so later scans skip them too.
+    const uint64_t* words = bitmapWords();
+    size_t wordsPerGroup = blocksPerGroup / BITS_PER_WORD;
+    
+    for (unsigned int group = 0; group < groupCount; group++) {
+        if (groupStart(group) >= firstDataBlock) {
+            groupDescriptor(group)->freeBlocks = std::min(blocksPerGroup, totalBlocks - groupStart(group));
+            groupDescriptor(group)->flags = GROUP_BLOCKS_UNINIT;
+            continue;
+        }
+        
+        size_t first = group * wordsPerGroup;
+        size_t last = std::min(first + wordsPerGroup, bitmapWordCount());
+        unsigned int freeBlocks = 0;
+        for (size_t word = first; word < last; word++) {
+            freeBlocks += BITS_PER_WORD - popCount(words[word]);
+        }
+        groupDescriptor(group)->freeBlocks = freeBlocks;
+    }
+}
+
+size_t FileSystem::nextNonFullWord(size_t word) {
+    size_t wordCount = bitmapWordCount();
+    
+    while (word < wordCount) {
+        size_t summaryWord = word / BITS_PER_WORD;
+        
+        // Whole summary word full: skip 64 bitmap words, or 4096 when the
+        // top level says the following summary words are full as well
+        if (word % BITS_PER_WORD == 0 && fullWords[summaryWord] == ~0ULL) {
+            size_t topWord = summaryWord / BITS_PER_WORD;
+            uint64_t notFull = ~fullSummaryWords[topWord] & (~0ULL << (summaryWord % BITS_PER_WORD));
+            if (notFull == 0) {
+                word = (topWord + 1) * BITS_PER_WORD * BITS_PER_WORD;
+            } else {
+                word = (topWord * BITS_PER_WORD + countTrailingZeros(notFull)) * BITS_PER_WORD;
+            }
+            continue;
+        }
+        
+        uint64_t notFull = ~fullWords[summaryWord] & (~0ULL << (word % BITS_PER_WORD));
+        if (notFull != 0) {
+            return summaryWord * BITS_PER_WORD + countTrailingZeros(notFull);
+        }
+        word = (summaryWord + 1) * BITS_PER_WORD;
+    }
+    
+    return wordCount;
+}
+
+bool FileSystem::findFreeRun(unsigned int count, unsigned int& start, unsigned int from) {
+    const uint64_t* words = bitmapWords();
+    size_t wordCount = bitmapWordCount();
+    
+    unsigned int runStart = 0;
+    unsigned int runLength = 0;
+    size_t word = from / BITS_PER_WORD;
+    
+    while (word < wordCount) {
+        if (runLength == 0) {
+            word = nextNonFullWord(word);
+            if (word >= wordCount) {
+                break;
+            }
+        }
+        
+        uint64_t bits = words[word];
+        unsigned int bit = 0;
+        
+        while (bit < BITS_PER_WORD) {
+            if (runLength == 0) {
+                // Look for the next free bit in this word
+                uint64_t freeBits = ~bits & (~0ULL << bit);
+                if (freeBits == 0) {
+                    break;
+                }
+                bit = countTrailingZeros(freeBits);
+                runStart = static_cast<unsigned int>(word * BITS_PER_WORD + bit);
+            }
+            
+            // Extend the run up to the next used bit
+            uint64_t usedBits = bits & (~0ULL << bit);
+            unsigned int end = usedBits ? countTrailingZeros(usedBits) : BITS_PER_WORD;
+            runLength += end - bit;
+            
+            if (runLength >= count) {
+                start = runStart;
+                return true;
+            }
+            if (end < BITS_PER_WORD) {
+                runLength = 0;
+            }
+            bit = end;
+        }
+        
+        word++;
+    }
+    
+    return false;
+}
+
+unsigned int FileSystem::allocateBlock() {
+    return allocateBlockRun(1);
+}
+
+unsigned int FileSystem::allocateBlockRun(unsigned int count, unsigned int goal, bool clear) {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    
+    if (count == 0 || availableBlocks() < count) {
+        std::cout << "Debug: No free blocks available. Free blocks: " << availableBlocks()
+                  << ", requested: " << count << std::endl;
+        return 0; // No free blocks
+    }
+    
+    // Compaction keeps new blocks below the part of the image it is emptying
+    unsigned int limit = allocationLimit != 0 ? allocationLimit : totalBlocks;
+    
+    unsigned int blockNum;
+    bool buddy = (features & FEATURE_BUDDY) != 0;
+    if (buddy && count <= (1U << BUDDY_MAX_ORDER)) {
+        // Power-of-two size classes: the run starts an aligned free block
+        if (!findBuddyRun(count, blockNum, goal, limit)) {
+            return 0;
+        }
+    } else {
+        // Search from the goal first (to keep a file's blocks together), then
+        // from the lowest block that may be free
+        bool found = goal > superBlock->firstFreeBlock && goal < limit && findFreeRun(count, blockNum, goal) &&
+                     static_cast<unsigned long long>(blockNum) + count <= limit;
+        if (!found && !(findFreeRun(count, blockNum, superBlock->firstFreeBlock) &&
+                        static_cast<unsigned long long>(blockNum) + count <= limit)) {
+            return 0; // No contiguous run large enough
+        }
+    }
+    
+    markBlocks(blockNum, count, true);
+    superBlock->freeBlocks -= count;
+    if (buddy) {
+        buddyRemove(blockNum, count);
+    }
+    
+    // Everything below the first block we took was already in use
+    if (superBlock->firstFreeBlock >= blockNum) {
+        superBlock->firstFreeBlock = blockNum + count;
+    }
+    
+    // Clear the allocated blocks (unwritten extents skip this: they read as zeros)
+    if (clear) {
+        memset(blockAt(blockNum), 0, static_cast<size_t>(count) * blockSize);
+        markDirty(blockNum, count);
+    }
+    
+    return blockNum;
+}
+
+bool FileSystem::allocateBlocks(unsigned int count, std::vector<unsigned int>& blocks, unsigned int goal, bool clear) {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    blocks.clear();
+    
+    if (superBlock->freeBlocks - superBlock->reservedBlocks < count) {
+        return false;
+    }
+    
+    // Take the largest runs we can find, halving the request when the
+    // free space is too fragmented for one run
+    unsigned int remaining = count;
+    unsigned int request = count;
+    while (remaining > 0) {
+        unsigned int runStart = allocateBlockRun(std::min(request, remaining), goal, clear);
+        if (runStart == 0) {
+            if (request == 1) {
+                deallocateBlocks(blocks);
+                blocks.clear();
+                return false;
+            }
+            request /= 2;
+            continue;
+        }
+        
+        unsigned int runLength = std::min(request, remaining);
+        for (unsigned int i = 0; i < runLength; i++) {
+            blocks.push_back(runStart + i);
+        }
+        remaining -= runLength;
+        goal = runStart + runLength;
+    }
+    
+    return true;
+}
+
+void FileSystem::deallocateBlock(unsigned int blockNum) {
+    deallocateBlockRun(blockNum, 1);
+}
+
+void FileSystem::deallocateBlockRun(unsigned int start, unsigned int count) {
+    if (start < firstDataBlock || start >= totalBlocks || count > totalBlocks - start) {
+        return; // Invalid block number
+    }
+    if (deferFrees) {
+        deferredFrees.push_back({start, count});
+        return;
+    }
+    
+    if (refcountStart == 0) {
+        releaseBlockRun(start, count);
+        return;
+    }
+    
+    // A shared block only loses a reference; the unshared stretches between
+    // them are freed as runs
+    uint16_t* refs = blockRefs();
+    unsigned int i = 0;
+    while (i < count) {
+        unsigned int j = i;
+        while (j < count && refs[start + j] == 0) {
+            j++;
+        }
+        if (j > i) {
+            releaseBlockRun(start + i, j - i);
+        }
+        if (j < count) {
+            refs[start + j]--;
+        }
+        i = j + 1;
+    }
+}
+
+void FileSystem::releaseBlockRun(unsigned int start, unsigned int count) {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    
+    unsigned int freed = markBlocks(start, count, false);
+    if (freed != count) {
+        std::cout << "Debug: " << (count - freed) << " block(s) freed twice near block " << start << std::endl;
+    }
+    
+    // Give the run back to the buddy index, merging buddies; after a double
+    // free the index is rebuilt so nothing is listed twice
+    if (features & FEATURE_BUDDY) {
+        if (freed == count) {
+            buddyInsert(start, count);
+        } else {
+            buildBuddyIndex();
+        }
+    }
+    
+    superBlock->freeBlocks += freed;
+    if (start < superBlock->firstFreeBlock) {
+        superBlock->firstFreeBlock = start;
+    }
+    
+    // Freed blocks leave the dedup index
+    if (!dedupHashes.empty()) {
+        for (unsigned int block = start; block < start + count; block++) {
+            auto indexed = dedupHashes.find(block);
+            if (indexed == dedupHashes.end()) {
+                continue;
+            }
+            auto entry = dedupIndex.find(indexed->second);
+            if (entry != dedupIndex.end() && entry->second == block) {
+                dedupIndex.erase(entry);
+            }
+            dedupHashes.erase(indexed);
+        }
+    }
+    
+    // Freed metadata blocks may hold file data next: the journal revokes
+    // them rather than logging what they held
+    for (auto logged = journalBlocks.lower_bound(start); logged != journalBlocks.end() && logged->first < start + count; ++logged) {
+        journalRevokes.insert(logged->first);
+    }
+    for (auto logged = loggedBlocks.lower_bound(start); logged != loggedBlocks.end() && *logged < start + count; ++logged) {
+        journalRevokes.insert(*logged);
+    }
+}
+
+void FileSystem::releaseDeferredFrees() {
+    // Free what compact or defrag left behind, once its moves are written
+    std::vector<std::pair<unsigned int, unsigned int>> runs;
+    runs.swap(deferredFrees);
+    for (const auto& run : runs) {
+        deallocateBlockRun(run.first, run.second);
+    }
+}
+
+void FileSystem::deallocateBlocks(const std::vector<unsigned int>& blocks) {
+    // Free consecutive block numbers as a single run
+    size_t i = 0;
+    while (i < blocks.size()) {
+        size_t j = i + 1;
+        while (j < blocks.size() && blocks[j] == blocks[j - 1] + 1) {
+            j++;
+        }
+        deallocateBlockRun(blocks[i], static_cast<unsigned int>(j - i));
+        i = j;
+    }
+}
+
+bool FileSystem::addInodeChunk(unsigned int block, unsigned int offset) {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    unsigned int chunk = superBlock->inodeChunks;
+    
+    // Start a new map block when the last one is full
+    if (chunk == inodeMapBlocks.size() * chunksPerMapBlock()) {
+        unsigned int mapBlock = allocateBlock();
+        if (mapBlock == 0) {
+            return false;
+        }
+        journalBlock(mapBlock, true);
+        
+        if (inodeMapBlocks.empty()) {
+            superBlock->inodeMapStart = mapBlock;
+        } else {
+            journalBlock(inodeMapBlocks.back());
+            reinterpret_cast<ChainBlockHeader*>(blockAt(inodeMapBlocks.back()))->nextBlock = mapBlock;
+        }
+        inodeMapBlocks.push_back(mapBlock);
+    }
+    
+    journalBlock(inodeMapBlocks.back());
+    InodeChunk* entry = inodeChunk(chunk);
+    entry->usedMask = 0;
+    entry->block = block;
+    entry->offset = offset;
+    reinterpret_cast<ChainBlockHeader*>(blockAt(inodeMapBlocks.back()))->count++;
+    
+    inodeChunkOffsets.push_back(static_cast<unsigned long long>(block) * blockSize + offset);
+    if (chunk / BITS_PER_WORD >= fullChunkWords.size()) {
+        fullChunkWords.push_back(0);
+    }
+    groupChunks[block / blocksPerGroup].push_back(chunk);
+    groupDescriptor(block / blocksPerGroup)->freeInodes += INODES_PER_CHUNK;
+    
+    superBlock->inodeChunks++;
+    superBlock->maxInodes += INODES_PER_CHUNK;
+    superBlock->freeInodes += INODES_PER_CHUNK;
+    maxInodes = superBlock->maxInodes;
+    return true;
+}
+
+bool FileSystem::growInodeTable(unsigned int group) {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    
+    // Allocate at least one whole block; large blocks hold several chunks
+    unsigned int bytes = std::max(INODE_CHUNK_SIZE, blockSize);
+    unsigned int newChunks = bytes / INODE_CHUNK_SIZE;
+    if (superBlock->maxInodes > SNAPSHOT_INODE_BASE - newChunks * INODES_PER_CHUNK) {
+        return false; // Inode numbers above are taken by the snapshots
+    }
+    
+    // New chunks come zeroed from the allocator, inside the group when it has room
+    unsigned int start = allocateBlockRun(bytes / blockSize, groupStart(group));
+    if (start == 0) {
+        return false;
+    }
+    for (unsigned int i = 0; i < bytes / blockSize; i++) {
+        journalBlock(start + i, true);
+    }
+    
+    for (unsigned int i = 0; i < newChunks; i++) {
+        if (!addInodeChunk(start, i * INODE_CHUNK_SIZE)) {
+            if (i == 0) {
+                deallocateBlockRun(start, bytes / blockSize);
+                return false;
+            }
+            break; // Keep the chunks already added
+        }
+    }
+    
+    return true;
+}
+
+bool FileSystem::loadInodeMap() {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    unsigned int chunks = superBlock->inodeChunks;
+    
+    inodeMapBlocks.clear();
+    inodeChunkOffsets.clear();
+    fullChunkWords.assign((chunks + BITS_PER_WORD - 1) / BITS_PER_WORD, 0);
+    groupChunks.assign(groupCount, std::vector<unsigned int>());
+    
+    unsigned int mapBlock = superBlock->inodeMapStart;
+    while (inodeMapBlocks.size() * chunksPerMapBlock() < chunks) {
+        if (mapBlock < firstDataBlock || mapBlock >= totalBlocks) {
+            return false;
+        }
+        inodeMapBlocks.push_back(mapBlock);
+        mapBlock = reinterpret_cast<ChainBlockHeader*>(blockAt(mapBlock))->nextBlock;
+    }
+    
+    unsigned int usedInodes = 0;
+    for (unsigned int chunk = 0; chunk < chunks; chunk++) {
+        const InodeChunk* entry = inodeChunk(chunk);
+        unsigned long long offset = static_cast<unsigned long long>(entry->block) * blockSize + entry->offset;
+        if (entry->block == 0 || offset + INODE_CHUNK_SIZE > imageSize) {
+            return false;
+        }
+        
+        inodeChunkOffsets.push_back(offset);
+        groupChunks[entry->block / blocksPerGroup].push_back(chunk);
+        usedInodes += popCount(entry->usedMask);
+        if (entry->usedMask == ~0ULL) {
+            fullChunkWords[chunk / BITS_PER_WORD] |= 1ULL << (chunk % BITS_PER_WORD);
+        }
+    }
+    
+    return superBlock->maxInodes == chunks * INODES_PER_CHUNK &&
+           superBlock->freeInodes == superBlock->maxInodes - usedInodes;
+}
+
+unsigned int FileSystem::findFreeChunk(unsigned int group) {
+    if (groupDescriptor(group)->freeInodes == 0) {
+        return INVALID_INODE;
+    }
+    
+    for (unsigned int chunk : groupChunks[group]) {
+        if ((fullChunkWords[chunk / BITS_PER_WORD] & (1ULL << (chunk % BITS_PER_WORD))) == 0) {
+            return chunk;
+        }
+    }
+    
+    return INVALID_INODE;
+}
+
+unsigned int FileSystem::findDirectoryGroup(unsigned int parentInodeNum) {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    unsigned int parentGroup = inodeGroup(parentInodeNum);
+    unsigned int averageFree = superBlock->freeBlocks / groupCount;
+    
+    // Subdirectories stay with their parent while its group has room
+    if (parentInodeNum != 0 && groupDescriptor(parentGroup)->freeBlocks >= averageFree) {
+        return parentGroup;
+    }
+    
+    // Spread top-level directories: pick the group with the fewest
+    // directories among those with at least the average free space
+    unsigned int best = parentGroup;
+    unsigned int bestDirectories = 0xFFFFFFFF;
+    for (unsigned int i = 0; i < groupCount; i++) {
+        unsigned int group = (parentGroup + i) % groupCount;
+        GroupDescriptor* descriptor = groupDescriptor(group);
+        if (descriptor->freeBlocks >= averageFree && descriptor->directories < bestDirectories) {
+            best = group;
+            bestDirectories = descriptor->directories;
+        }
+    }
+    
+    return best;
+}
+
+unsigned int FileSystem::allocateInode(unsigned int group, bool directory) {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    
+    // Prefer an inode in the requested group, adding a chunk there if it has
+    // none free but has room for one
+    unsigned int chunk = findFreeChunk(group);
+    if (chunk == INVALID_INODE && static_cast<unsigned long long>(groupDescriptor(group)->freeBlocks) * blockSize >= INODE_CHUNK_SIZE &&
+        growInodeTable(group)) {
+        chunk = findFreeChunk(group);
+    }
+    
+    if (chunk == INVALID_INODE) {
+        if (superBlock->freeInodes == 0 && !growInodeTable(group)) {
+            return INVALID_INODE; // No free inodes
+        }
+        
+        // Fall back to the first chunk with a free inode, starting at the hint
+        size_t word = superBlock->firstFreeInode / INODES_PER_CHUNK / BITS_PER_WORD;
+        uint64_t candidates = ~fullChunkWords[word] & ~bitRange(0, superBlock->firstFreeInode / INODES_PER_CHUNK % BITS_PER_WORD);
+        while (candidates == 0) {
+            candidates = ~fullChunkWords[++word];
+        }
+        chunk = static_cast<unsigned int>(word * BITS_PER_WORD + countTrailingZeros(candidates));
+    }
+    if (!preserveChunk(chunk)) {
+        return INVALID_INODE;
+    }
+    
+    journalBlock(inodeMapBlocks[chunk / chunksPerMapBlock()]);
+    InodeChunk* entry = inodeChunk(chunk);
+    unsigned int bit = countTrailingZeros(~entry->usedMask);
+    entry->usedMask |= 1ULL << bit;
+    if (entry->usedMask == ~0ULL) {
+        fullChunkWords[chunk / BITS_PER_WORD] |= 1ULL << (chunk % BITS_PER_WORD);
+    }
+    
+    unsigned int inodeNum = chunk * INODES_PER_CHUNK + bit;
+    if (superBlock->firstFreeInode == inodeNum) {
+        superBlock->firstFreeInode = inodeNum + 1; // Every inode below is in use
+    }
+    superBlock->freeInodes--;
+    
+    GroupDescriptor* descriptor = groupDescriptor(inodeGroup(inodeNum));
+    descriptor->freeInodes--;
+    if (directory) {
+        descriptor->directories++;
+    }
+    
+    journalBlock(static_cast<unsigned int>((inodeSlot(inodeNum) - memory) / blockSize));
+    Inode* inode = reinterpret_cast<Inode*>(inodeSlot(inodeNum));
+    
+    // Initialize the allocated inode
+    inode->type = directory ? 1 : 0;
+    inode->flags = 0;
+    inode->size = 0;
+    inode->creationTime = time(nullptr);
+    inode->modificationTime = inode->creationTime;
+    memset(inode->blockAddresses, 0, sizeof(inode->blockAddresses));
+    inode->indirectBlock = 0;
+    inode->doubleIndirectBlock = 0;
+    inode->tripleIndirectBlock = 0;
+    
+    return inodeNum;
+}
+
+void FileSystem::deallocateInode(unsigned int inodeNum) {
+    if (inodeNum >= maxInodes) {
+        return; // Invalid inode number
+    }
+    
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    unsigned int chunk = inodeNum / INODES_PER_CHUNK;
+    uint64_t bit = 1ULL << (inodeNum % INODES_PER_CHUNK);
+    
+    InodeChunk* entry = inodeChunk(chunk);
+    if ((entry->usedMask & bit) == 0) {
+        std::cout << "Debug: Inode " << inodeNum << " is already free\n";
+        return;
+    }
+    if (!preserveChunk(chunk)) {
+        return;
+    }
+    
+    // Clear its bit in the inode map
+    journalBlock(inodeMapBlocks[chunk / chunksPerMapBlock()]);
+    entry->usedMask &= ~bit;
+    fullChunkWords[chunk / BITS_PER_WORD] &= ~(1ULL << (chunk % BITS_PER_WORD));
+    superBlock->freeInodes++;
+    
+    GroupDescriptor* descriptor = groupDescriptor(inodeGroup(inodeNum));
+    descriptor->freeInodes++;
+    if (reinterpret_cast<Inode*>(inodeSlot(inodeNum))->type == 1) {
+        descriptor->directories--;
+    }
+    if (inodeNum < superBlock->firstFreeInode) {
+        superBlock->firstFreeInode = inodeNum;
+    }
+}
+
+Inode FileSystem::readInode(unsigned int inodeNum) {
+    Inode inode;
+    
+    if (!validInode(inodeNum)) {
+        // Return empty inode for invalid inode number
+        memset(&inode, 0, sizeof(Inode));
+        return inode;
+    }
+    
+    // Read inode from memory
+    memcpy(&inode, inodeSlot(inodeNum), sizeof(Inode));
+    
+    return inode;
+}
+
+void FileSystem::writeInode(unsigned int inodeNum, const Inode& inode) {
+    if (inodeNum >= maxInodes || !preserveInode(inodeNum)) {
+        return; // Invalid inode number, or snapshots could not keep their copy
+    }
+    
+    // Write inode to memory
+    journalBlock(static_cast<unsigned int>((inodeSlot(inodeNum) - memory) / blockSize));
+    memcpy(inodeSlot(inodeNum), &inode, sizeof(Inode));
+}
+
+std::vector<DirectoryEntry> FileSystem::readDirectoryEntries(unsigned int inodeNum, bool stored) {
+    std::vector<DirectoryEntry> entries;
+    
+    Inode inode = readInode(inodeNum);
+    if (inode.type != 1) {
+        return entries; // Not a directory
+    }
+    
+    // Read directory entries from direct blocks
+    for (unsigned int i = 0; i < directBlocks; i++) {
+        if (inode.blockAddresses[i] == 0) {
+            continue;
+        }
+        
+        char* blockData = blockAt(inode.blockAddresses[i]);
+        unsigned int entriesPerBlock = blockSize / sizeof(DirectoryEntry);
+        
+        for (unsigned int j = 0; j < entriesPerBlock; j++) {
+            DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
+            
+            if (entry->inodeNumber != 0) {
+                entries.push_back(*entry);
+            }
+        }
+    }
+    
+    // Read directory entries from indirect blocks
+    if (inode.indirectBlock != 0) {
+        unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(blockAt(inode.indirectBlock));
+        
+        for (unsigned int i = 0; i < blockSize / sizeof(unsigned int); i++) {
+            if (indirectBlockData[i] == 0) {
+                continue;
+            }
+            
+            char* blockData = blockAt(indirectBlockData[i]);
+            unsigned int entriesPerBlock = blockSize / sizeof(DirectoryEntry);
+            
+            for (unsigned int j = 0; j < entriesPerBlock; j++) {
+                DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
+                
+                if (entry->inodeNumber != 0) {
+                    entries.push_back(*entry);
+                }
+            }
+        }
+    }
+    
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    if (stored) {
+        return entries;
+    } else if (inodeNum >= SNAPSHOT_INODE_BASE) {
+        // Entries in a snapshot hold its own inode numbers
+        unsigned int base = std::prev(snapshotViews.upper_bound(inodeNum))->first;
+        for (DirectoryEntry& entry : entries) {
+            entry.inodeNumber += base;
+        }
+    } else if (inodeNum == superBlock->snapshotDir && inodeNum != 0) {
+        // Snapshot entries hold the first block of the snapshot's inode map;
+        // each one leads to the root of its view
+        std::vector<DirectoryEntry> roots;
+        for (DirectoryEntry entry : entries) {
+            if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+                continue;
+            }
+            for (const auto& view : snapshotViews) {
+                if (view.second.mapStart == entry.inodeNumber) {
+                    entry.inodeNumber = view.first;
+                    roots.push_back(entry);
+                    break;
+                }
+            }
+        }
+        return roots;
+    }
+    
+    return entries;
+}
+
+bool FileSystem::addDirectoryEntry(unsigned int dirInodeNum, const std::string& name, unsigned int inodeNum) {
+    if (name.length() >= MAX_FILENAME_LENGTH) {
+        return false; // Name too long
+    }
+    
+    Inode dirInode = readInode(dirInodeNum);
+    if (dirInode.type != 1 || !preserveInode(dirInodeNum)) {
+        return false; // Not a directory, or a snapshot could not keep its copy
+    }
+    
+    // Create new directory entry
+    DirectoryEntry newEntry;
+    strncpy(newEntry.name, name.c_str(), MAX_FILENAME_LENGTH - 1);
+    newEntry.name[MAX_FILENAME_LENGTH - 1] = '\0';
+    newEntry.inodeNumber = inodeNum;
+    
+    // Directory blocks are placed in the directory's group
+    unsigned int goal = groupStart(inodeGroup(dirInodeNum));
+    
+    // Find a free slot in direct blocks
+    for (unsigned int i = 0; i < directBlocks; i++) {
+        if (dirInode.blockAddresses[i] == 0) {
+            // Allocate a new block
+            unsigned int newBlock = allocateBlockRun(1, goal);
+            if (newBlock == 0) {
+                std::cout << "Debug: Failed to allocate block for directory entry" << std::endl;
+                return false; // No free blocks
+            }
+            
+            journalBlock(newBlock, true);
+            dirInode.blockAddresses[i] = newBlock;
+            writeInode(dirInodeNum, dirInode);
+        }
+        
+        char* blockData = blockAt(dirInode.blockAddresses[i]);
+        unsigned int entriesPerBlock = blockSize / sizeof(DirectoryEntry);
+        
+        for (unsigned int j = 0; j < entriesPerBlock; j++) {
+            DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
+            
+            if (entry->inodeNumber == 0) {
+                // Found a free slot
+                journalBlock(dirInode.blockAddresses[i]);
+                *entry = newEntry;
+                
+                // Update directory size
+                dirInode.size += sizeof(DirectoryEntry);
+                dirInode.modificationTime = time(nullptr);
+                writeInode(dirInodeNum, dirInode);
+                
+                return true;
+            }
+        }
+    }
+    
+    // No free slots in direct blocks, try indirect block
+    if (dirInode.indirectBlock == 0) {
+        // Allocate indirect block
+        unsigned int indirectBlock = allocateBlockRun(1, goal);
+        if (indirectBlock == 0) {
+            std::cout << "Debug: Failed to allocate indirect block for directory" << std::endl;
+            return false; // No free blocks
+        }
+        
+        journalBlock(indirectBlock, true);
+        dirInode.indirectBlock = indirectBlock;
+        writeInode(dirInodeNum, dirInode);
+    }
+    
+    unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(blockAt(dirInode.indirectBlock));
+    
+    for (unsigned int i = 0; i < blockSize / sizeof(unsigned int); i++) {
+        if (indirectBlockData[i] == 0) {
+            // Allocate a new block
+            unsigned int newBlock = allocateBlockRun(1, goal);
+            if (newBlock == 0) {
+                std::cout << "Debug: Failed to allocate block for directory entry (indirect)" << std::endl;
+                return false; // No free blocks
+            }
+            
+            journalBlock(newBlock, true);
+            journalBlock(dirInode.indirectBlock);
+            indirectBlockData[i] = newBlock;
+        }
+        
+        char* blockData = blockAt(indirectBlockData[i]);
+        unsigned int entriesPerBlock = blockSize / sizeof(DirectoryEntry);
+        
+        for (unsigned int j = 0; j < entriesPerBlock; j++) {
+            DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
+            
+            if (entry->inodeNumber == 0) {
+                // Found a free slot
+                journalBlock(indirectBlockData[i]);
+                *entry = newEntry;
+                
+                // Update directory size
+                dirInode.size += sizeof(DirectoryEntry);
+                dirInode.modificationTime = time(nullptr);
+                writeInode(dirInodeNum, dirInode);
+                
+                return true;
+            }
+        }
+    }
+    
+    std::cout << "Debug: No free slots for directory entry" << std::endl;
+    return false; // No free slots
+}
+
+bool FileSystem::removeDirectoryEntry(unsigned int dirInodeNum, const std::string& name) {
+    Inode dirInode = readInode(dirInodeNum);
+    if (dirInode.type != 1 || !preserveInode(dirInodeNum)) {
+        return false; // Not a directory, or a snapshot could not keep its copy
+    }
+    
+    // Search in direct blocks
+    for (unsigned int i = 0; i < directBlocks; i++) {
+        if (dirInode.blockAddresses[i] == 0) {
+            continue;
+        }
+        
+        char* blockData = blockAt(dirInode.blockAddresses[i]);
+        unsigned int entriesPerBlock = blockSize / sizeof(DirectoryEntry);
+        
+        for (unsigned int j = 0; j < entriesPerBlock; j++) {
+            DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
+            
+            if (entry->inodeNumber != 0 && strcmp(entry->name, name.c_str()) == 0) {
+                // Found the entry to remove
+                journalBlock(dirInode.blockAddresses[i]);
+                entry->inodeNumber = 0;
+                
+                // Update directory size
+                dirInode.size -= sizeof(DirectoryEntry);
+                dirInode.modificationTime = time(nullptr);
+                writeInode(dirInodeNum, dirInode);
+                
+                return true;
+            }
+        }
+    }
+    
+    // Search in indirect blocks
+    if (dirInode.indirectBlock != 0) {
+        unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(blockAt(dirInode.indirectBlock));
+        
+        for (unsigned int i = 0; i < blockSize / sizeof(unsigned int); i++) {
+            if (indirectBlockData[i] == 0) {
+                continue;
+            }
+            
+            char* blockData = blockAt(indirectBlockData[i]);
+            unsigned int entriesPerBlock = blockSize / sizeof(DirectoryEntry);
+            
+            for (unsigned int j = 0; j < entriesPerBlock; j++) {
+                DirectoryEntry* entry = reinterpret_cast<DirectoryEntry*>(blockData + j * sizeof(DirectoryEntry));
+                
+                if (entry->inodeNumber != 0 && strcmp(entry->name, name.c_str()) == 0) {
+                    // Found the entry to remove
+                    journalBlock(indirectBlockData[i]);
+                    entry->inodeNumber = 0;
+                    
+                    // Update directory size
+                    dirInode.size -= sizeof(DirectoryEntry);
+                    dirInode.modificationTime = time(nullptr);
+                    writeInode(dirInodeNum, dirInode);
+                    
+                    return true;
+                }
+            }
+        }
+    }
+    
+    return false; // Entry not found
+}
+
+int FileSystem::findDirectoryEntry(unsigned int dirInodeNum, const std::string& name) {
+    std::vector<DirectoryEntry> entries = readDirectoryEntries(dirInodeNum);
+    
+    for (const DirectoryEntry& entry : entries) {
         if (strcmp(entry.name, name.c_str()) == 0) {
             return entry.inodeNumber;
         }
     }
     
-    return -1; // Entry not found
+    return -1; // Entry not found
+}
+
+void FileSystem::initializeDirectory(unsigned int dirInodeNum, unsigned int parentInodeNum) {
+    // Add . entry (self)
+    addDirectoryEntry(dirInodeNum, ".", dirInodeNum);
+    
+    // Add .. entry (parent)
+    addDirectoryEntry(dirInodeNum, "..", parentInodeNum);
+}
+
+std::vector<Extent> FileSystem::readExtents(const Inode& inode) {
+    std::vector<Extent> extents;
+    
+    // Extents stored in the inode itself
+    const Extent* inlineExtents = reinterpret_cast<const Extent*>(inode.blockAddresses);
+    for (unsigned int i = 0; i < INLINE_EXTENTS && inlineExtents[i].length != 0; i++) {
+        extents.push_back(inlineExtents[i]);
+    }
+    
+    // Extents stored in the extent block chain
+    unsigned int block = inode.indirectBlock;
+    while (block != 0) {
+        const ChainBlockHeader* header = reinterpret_cast<const ChainBlockHeader*>(blockAt(block));
+        const Extent* blockExtents = reinterpret_cast<const Extent*>(header + 1);
+        
+        for (unsigned int i = 0; i < header->count; i++) {
+            extents.push_back(blockExtents[i]);
+        }
+        block = header->nextBlock;
+    }
+    
+    return extents;
+}
+
+bool FileSystem::writeExtents(Inode& inode, const std::vector<Extent>& extents) {
+    // Allocate the new chain before releasing the old one so a failure
+    // leaves the inode untouched
+    size_t overflow = extents.size() > INLINE_EXTENTS ? extents.size() - INLINE_EXTENTS : 0;
+    unsigned int chainLength = static_cast<unsigned int>((overflow + extentsPerBlock() - 1) / extentsPerBlock());
+    
+    std::vector<unsigned int> chain;
+    if (chainLength > 0 && !allocateBlocks(chainLength, chain)) {
+        return false;
+    }
+    
+    std::vector<unsigned int> oldChain = getMappingBlocks(inode);
+    deallocateBlocks(oldChain);
+    
+    Extent* inlineExtents = reinterpret_cast<Extent*>(inode.blockAddresses);
+    memset(inode.blockAddresses, 0, sizeof(inode.blockAddresses));
+    for (size_t i = 0; i < extents.size() && i < INLINE_EXTENTS; i++) {
+        inlineExtents[i] = extents[i];
+    }
+    
+    size_t next = INLINE_EXTENTS;
+    for (unsigned int c = 0; c < chainLength; c++) {
+        journalBlock(chain[c], true);
+        ChainBlockHeader* header = reinterpret_cast<ChainBlockHeader*>(blockAt(chain[c]));
+        Extent* blockExtents = reinterpret_cast<Extent*>(header + 1);
+        
+        header->nextBlock = (c + 1 < chainLength) ? chain[c + 1] : 0;
+        header->count = 0;
+        while (next < extents.size() && header->count < extentsPerBlock()) {
+            blockExtents[header->count++] = extents[next++];
+        }
+    }
+    
+    inode.flags |= INODE_EXTENTS;
+    inode.indirectBlock = chainLength > 0 ? chain[0] : 0;
+    return true;
+}
+
+std::vector<Extent> FileSystem::extentsFromBlocks(const std::vector<unsigned int>& blocks, unsigned int firstLogical) {
+    std::vector<Extent> extents;
+    
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (!extents.empty() && extents.back().physicalBlock + extents.back().length == blocks[i]) {
+            extents.back().length++;
+            continue;
+        }
+        
+        Extent extent;
+        extent.logicalBlock = firstLogical + static_cast<unsigned int>(i);
+        extent.physicalBlock = blocks[i];
+        extent.length = 1;
+        extent.flags = 0;
+        extents.push_back(extent);
+    }
+    
+    return extents;
+}
+
+std::vector<BlockRun> FileSystem::getFileRuns(const Inode& inode, unsigned int firstBlock, unsigned int lastBlock) {
+    std::vector<BlockRun> runs;
+    
+    if (inode.flags & INODE_INLINE) {
+        return runs; // No blocks mapped
+    }
+    
+    if (inode.flags & INODE_EXTENTS) {
+        for (const Extent& extent : readExtents(inode)) {
+            if (extent.logicalBlock <= lastBlock && extent.logicalBlock + extent.length - 1 >= firstBlock) {
+                runs.push_back({extent.logicalBlock, extent.physicalBlock, extent.length, extent.flags});
+            }
+        }
+        return runs;
+    }
+    
+    // Block-mapped: merge consecutive pointers into runs
+    for (unsigned int i = firstBlock; i < directBlocks && i <= lastBlock; i++) {
+        if (inode.blockAddresses[i] != 0) {
+            appendRun(runs, i, inode.blockAddresses[i]);
+        }
+    }
+    
+    // Each indirect tree is walked once, visiting every pointer block a single time
+    unsigned long long firstLogical = directBlocks;
+    unsigned long long span = 1;
+    const unsigned int roots[3] = {inode.indirectBlock, inode.doubleIndirectBlock, inode.tripleIndirectBlock};
+    for (int depth = 1; depth <= 3; depth++) {
+        span *= pointersPerBlock();
+        if (roots[depth - 1] != 0 && firstLogical <= lastBlock && firstLogical + span - 1 >= firstBlock) {
+            walkIndirectTree(roots[depth - 1], depth, firstLogical, &runs, nullptr, firstBlock, lastBlock);
+        }
+        firstLogical += span;
+    }
+    
+    return runs;
+}
+
+std::vector<unsigned int> FileSystem::getMappingBlocks(const Inode& inode) {
+    std::vector<unsigned int> blocks;
+    
+    if (inode.flags & INODE_INLINE) {
+        return blocks;
+    }
+    
+    if (!(inode.flags & INODE_EXTENTS)) {
+        const unsigned int roots[3] = {inode.indirectBlock, inode.doubleIndirectBlock, inode.tripleIndirectBlock};
+        for (int depth = 1; depth <= 3; depth++) {
+            if (roots[depth - 1] != 0) {
+                walkIndirectTree(roots[depth - 1], depth, 0, nullptr, &blocks);
+            }
+        }
+        return blocks;
+    }
+    
+    for (unsigned int block = inode.indirectBlock; block != 0;
+         block = reinterpret_cast<const ChainBlockHeader*>(blockAt(block))->nextBlock) {
+        blocks.push_back(block);
+    }
+    
+    return blocks;
+}
+
+void FileSystem::appendRun(std::vector<BlockRun>& runs, unsigned int logical, unsigned int physical,
+                           unsigned int length, unsigned int flags) {
+    if (!runs.empty() && runs.back().logicalBlock + runs.back().length == logical &&
+        runs.back().physicalBlock + runs.back().length == physical && runs.back().flags == flags) {
+        runs.back().length += length;
+    } else {
+        runs.push_back({logical, physical, length, flags});
+    }
+}
+
+void FileSystem::walkIndirectTree(unsigned int block, int depth, unsigned long long firstLogical,
+                                  std::vector<BlockRun>* runs, std::vector<unsigned int>* mappingBlocks,
+                                  unsigned int firstBlock, unsigned int lastBlock) {
+    const unsigned int* entries = reinterpret_cast<const unsigned int*>(blockAt(block));
+    unsigned int count = pointersPerBlock();
+    
+    if (mappingBlocks != nullptr) {
+        mappingBlocks->push_back(block);
+    }
+    
+    // Logical blocks covered by each entry of this pointer block
+    unsigned long long span = 1;
+    for (int level = 1; level < depth; level++) {
+        span *= count;
+    }
+    
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned long long logical = firstLogical + i * span;
+        if (entries[i] == 0 || logical > lastBlock || logical + span - 1 < firstBlock) {
+            continue;
+        }
+        
+        if (depth == 1) {
+            if (runs != nullptr) {
+                appendRun(*runs, static_cast<unsigned int>(logical), entries[i]);
+            }
+        } else {
+            walkIndirectTree(entries[i], depth - 1, logical, runs, mappingBlocks, firstBlock, lastBlock);
+        }
+    }
+}
+
+int FileSystem::locateBlock(unsigned int logical, unsigned long long& offset) const {
+    // Returns the indirect tree depth holding the block (0 if out of range)
+    offset = static_cast<unsigned long long>(logical) - directBlocks;
+    unsigned long long span = 1;
+    
+    for (int depth = 1; depth <= 3; depth++) {
+        span *= pointersPerBlock();
+        if (offset < span) {
+            return depth;
+        }
+        offset -= span;
+    }
+    
+    return 0;
+}
+
+unsigned int* FileSystem::findTreeSlot(unsigned int& root, int depth, unsigned long long offset, BlockMapCursor& cursor,
+                                       const std::function<unsigned int()>* newMappingBlock) {
+    unsigned int count = pointersPerBlock();
+    
+    if (root == 0) {
+        if (newMappingBlock == nullptr || (root = (*newMappingBlock)()) == 0) {
+            return nullptr;
+        }
+        journalBlock(root, true);
+    }
+    
+    // Forget the cached path if it belongs to another tree
+    if (cursor.depth != depth || cursor.root != root) {
+        cursor.depth = depth;
+        cursor.root = root;
+        for (int level = 0; level < 3; level++) {
+            cursor.key[level] = ~0ULL;
+            cursor.block[level] = 0;
+        }
+    }
+    
+    // Entries covered by a pointer block at the current level
+    unsigned long long span = 1;
+    for (int level = 0; level < depth; level++) {
+        span *= count;
+    }
+    
+    unsigned int blockNum = root;
+    for (int level = 0; level < depth; level++) {
+        unsigned long long key = offset / span;
+        
+        if (cursor.key[level] == key && cursor.block[level] != 0) {
+            // Cached: no need to read the parent entry again
+            blockNum = cursor.block[level];
+        } else {
+            if (level > 0) {
+                unsigned int* parent = reinterpret_cast<unsigned int*>(blockAt(cursor.block[level - 1]));
+                unsigned int& entry = parent[key % count];
+                if (entry == 0) {
+                    if (newMappingBlock == nullptr) {
+                        return nullptr;
+                    }
+                    journalBlock(cursor.block[level - 1]);
+                    if ((entry = (*newMappingBlock)()) == 0) {
+                        return nullptr;
+                    }
+                    journalBlock(entry, true);
+                }
+                blockNum = entry;
+            }
+            
+            cursor.key[level] = key;
+            cursor.block[level] = blockNum;
+            for (int deeper = level + 1; deeper < 3; deeper++) {
+                cursor.key[deeper] = ~0ULL;
+                cursor.block[deeper] = 0;
+            }
+        }
+        
+        span /= count;
+    }
+    
+    // Callers passing newMappingBlock write the slot
+    if (newMappingBlock != nullptr) {
+        journalBlock(blockNum);
+    }
+    return reinterpret_cast<unsigned int*>(blockAt(blockNum)) + offset % count;
+}
+
+unsigned int FileSystem::lookupBlock(const Inode& inode, unsigned int logical, BlockMapCursor& cursor) {
+    if (logical < directBlocks) {
+        return inode.blockAddresses[logical];
+    }
+    
+    unsigned long long offset;
+    int depth = locateBlock(logical, offset);
+    if (depth == 0) {
+        return 0;
+    }
+    
+    unsigned int root = depth == 1 ? inode.indirectBlock
+                      : depth == 2 ? inode.doubleIndirectBlock : inode.tripleIndirectBlock;
+    unsigned int* slot = findTreeSlot(root, depth, offset, cursor, nullptr);
+    return slot != nullptr ? *slot : 0;
+}
+
+unsigned int* FileSystem::getBlockSlot(Inode& inode, unsigned int logical, BlockMapCursor& cursor,
+                                       const std::function<unsigned int()>& newMappingBlock) {
+    if (logical < directBlocks) {
+        return &inode.blockAddresses[logical];
+    }
+    
+    unsigned long long offset;
+    int depth = locateBlock(logical, offset);
+    if (depth == 0) {
+        return nullptr;
+    }
+    
+    unsigned int& root = depth == 1 ? inode.indirectBlock
+                       : depth == 2 ? inode.doubleIndirectBlock : inode.tripleIndirectBlock;
+    return findTreeSlot(root, depth, offset, cursor, &newMappingBlock);
+}
+
+unsigned int FileSystem::mappingBlocksFor(unsigned long long blockCount) const {
+    // Pointer blocks needed to map logical blocks [0, blockCount)
+    unsigned long long total = 0;
+    if (blockCount <= directBlocks) {
+        return 0;
+    }
+    blockCount -= directBlocks;
+    
+    unsigned long long span = 1;
+    for (int depth = 1; depth <= 3 && blockCount > 0; depth++) {
+        span *= pointersPerBlock();
+        unsigned long long inTree = std::min(blockCount, span);
+        
+        unsigned long long levelSpan = span;
+        for (int level = 0; level < depth; level++) {
+            total += (inTree + levelSpan - 1) / levelSpan;
+            levelSpan /= pointersPerBlock();
+        }
+        blockCount -= inTree;
+    }
+    
+    return static_cast<unsigned int>(total);
+}
+
+unsigned long long FileSystem::maxMappedBlocks() const {
+    unsigned long long count = pointersPerBlock();
+    unsigned long long total = directBlocks + count + count * count + count * count * count;
+    return std::min(total, 0xFFFFFFFFULL);
+}
+
+void FileSystem::freeInodeBlocks(const Inode& inode) {
+    // Data runs are released whole, then the blocks holding the mapping
+    for (const BlockRun& run : getFileRuns(inode)) {
+        deallocateBlockRun(run.physicalBlock, run.length);
+    }
+    deallocateBlocks(getMappingBlocks(inode));
+}
+
+void FileSystem::mergeExtents(std::vector<Extent>& extents) {
+    // Keep the list sorted and merge runs that continue one another
+    std::sort(extents.begin(), extents.end(), [](const Extent& a, const Extent& b) {
+        return a.logicalBlock < b.logicalBlock;
+    });
+    
+    std::vector<Extent> merged;
+    for (const Extent& extent : extents) {
+        if (!merged.empty()) {
+            Extent& last = merged.back();
+            if (last.logicalBlock + last.length == extent.logicalBlock &&
+                last.physicalBlock + last.length == extent.physicalBlock && last.flags == extent.flags &&
+                !(extent.flags & EXTENT_COMPRESSED)) {
+                last.length += extent.length;
+                continue;
+            }
+        }
+        merged.push_back(extent);
+    }
+    
+    extents.swap(merged);
+}
+
+bool FileSystem::allocateRange(Inode& inode, unsigned int firstBlock, unsigned int lastBlock, unsigned int goal,
+                               unsigned int extentFlags, std::vector<BlockRun>* fresh) {
+    // Map fresh zeroed blocks for the holes in logical blocks [firstBlock,
+    // lastBlock], placed after the mapped block before them or at goal.
+    // Extent-mapped files may get unwritten extents instead, left uncleared.
+    // When fresh is given the data blocks are not cleared either: the new
+    // runs are listed there and the caller must fill them.
+    bool clear = (extentFlags & EXTENT_UNWRITTEN) == 0 && fresh == nullptr;
+    if (inode.flags & INODE_EXTENTS) {
+        std::vector<Extent> extents = readExtents(inode);
+        
+        // Collect the holes in the range
+        std::vector<BlockRun> holes;
+        unsigned long long next = firstBlock;
+        for (const Extent& extent : extents) {
+            unsigned long long extentEnd = static_cast<unsigned long long>(extent.logicalBlock) + extent.length;
+            if (extentEnd <= next) {
+                continue;
+            }
+            if (extent.logicalBlock > lastBlock) {
+                break;
+            }
+            if (extent.logicalBlock > next) {
+                holes.push_back({static_cast<unsigned int>(next), 0, static_cast<unsigned int>(extent.logicalBlock - next), 0});
+            }
+            next = extentEnd;
+        }
+        if (next <= lastBlock) {
+            holes.push_back({static_cast<unsigned int>(next), 0, static_cast<unsigned int>(lastBlock - next + 1), 0});
+        }
+        
+        unsigned int count = 0;
+        for (const BlockRun& hole : holes) {
+            count += hole.length;
+        }
+        if (count == 0) {
+            return true;
+        }
+        
+        // Continue after the extent preceding the first hole
+        for (const Extent& extent : extents) {
+            if (extent.logicalBlock < holes[0].logicalBlock) {
+                goal = extent.physicalBlock + extent.length;
+            }
+        }
+        
+        std::vector<unsigned int> blocks;
+        if (!allocateBlocks(count, blocks, goal, clear)) {
+            return false;
+        }
+        
+        size_t taken = 0;
+        for (const BlockRun& hole : holes) {
+            std::vector<unsigned int> holeBlocks(blocks.begin() + taken, blocks.begin() + taken + hole.length);
+            for (Extent extent : extentsFromBlocks(holeBlocks, hole.logicalBlock)) {
+                extent.flags = extentFlags;
+                extents.push_back(extent);
+                if (fresh != nullptr) {
+                    appendRun(*fresh, extent.logicalBlock, extent.physicalBlock, extent.length);
+                }
+            }
+            taken += hole.length;
+        }
+        
+        mergeExtents(extents);
+        if (!writeExtents(inode, extents)) {
+            deallocateBlocks(blocks);
+            return false;
+        }
+        return true;
+    }
+    
+    if (lastBlock >= maxMappedBlocks() || extentFlags != 0) {
+        return false; // Block pointers have no room for flags
+    }
+    
+    // Count the holes, continuing after the last mapped block before them
+    BlockMapCursor cursor;
+    unsigned int count = 0;
+    unsigned int previous = firstBlock > 0 ? lookupBlock(inode, firstBlock - 1, cursor) : 0;
+    for (unsigned int i = firstBlock; i <= lastBlock; i++) {
+        unsigned int block = lookupBlock(inode, i, cursor);
+        if (block != 0) {
+            previous = block;
+        } else {
+            if (count == 0 && previous != 0) {
+                goal = previous + 1;
+            }
+            count++;
+        }
+    }
+    if (count == 0) {
+        return true;
+    }
+    
+    // Data and the pointer blocks a dense file would need come from one
+    // allocation; pointer blocks are taken as the walk first needs them, so
+    // each one sits just before the data it maps. Any left over are freed.
+    unsigned int mappingNeeded = mappingBlocksFor(static_cast<unsigned long long>(lastBlock) + 1) - mappingBlocksFor(firstBlock);
+    std::vector<unsigned int> blocks;
+    if (!allocateBlocks(count + mappingNeeded, blocks, goal, clear) && !allocateBlocks(count, blocks, goal, clear)) {
+        return false;
+    }
+    
+    // Pointer blocks must start out empty even when data blocks are not cleared
+    size_t next = 0;
+    std::function<unsigned int()> takeBlock = [this, &blocks, &next]() {
+        return next < blocks.size() ? blocks[next++] : allocateBlockRun(1, blocks.back() + 1);
+    };
+    std::function<unsigned int()> takeMappingBlock = [this, &takeBlock, clear]() {
+        unsigned int block = takeBlock();
+        if (block != 0 && !clear) {
+            memset(blockAt(block), 0, blockSize);
+        }
+        return block;
+    };
+    
+    bool mapped = true;
+    for (unsigned int i = firstBlock; i <= lastBlock && mapped; i++) {
+        unsigned int* slot = getBlockSlot(inode, i, cursor, takeMappingBlock);
+        if (slot == nullptr) {
+            mapped = false;
+        } else if (*slot == 0) {
+            unsigned int block = takeBlock();
+            if (block == 0) {
+                mapped = false;
+            } else {
+                *slot = block;
+                if (fresh != nullptr) {
+                    appendRun(*fresh, i, block);
+                }
+            }
+        }
+    }
+    
+    if (next < blocks.size()) {
+        deallocateBlocks(std::vector<unsigned int>(blocks.begin() + next, blocks.end()));
+    }
+    return mapped;
+}
+
+bool FileSystem::convertToExtents(Inode& inode) {
+    // Re-map a block-mapped file by extents; writeExtents frees the pointer blocks
+    std::vector<Extent> extents;
+    for (const BlockRun& run : getFileRuns(inode)) {
+        extents.push_back({run.logicalBlock, run.physicalBlock, run.length, 0});
+    }
+    
+    if (!writeExtents(inode, extents)) {
+        return false;
+    }
+    inode.doubleIndirectBlock = 0;
+    inode.tripleIndirectBlock = 0;
+    return true;
+}
+
+bool FileSystem::markWritten(Inode& inode, unsigned int firstBlock, unsigned int lastBlock) {
+    // Split unwritten extents so that [firstBlock, lastBlock] reads its data
+    std::vector<Extent> extents;
+    bool changed = false;
+    
+    for (const Extent& extent : readExtents(inode)) {
+        unsigned long long extentLast = static_cast<unsigned long long>(extent.logicalBlock) + extent.length - 1;
+        if (!(extent.flags & EXTENT_UNWRITTEN) || extent.logicalBlock > lastBlock || extentLast < firstBlock) {
+            extents.push_back(extent);
+            continue;
+        }
+        
+        unsigned int from = std::max(extent.logicalBlock, firstBlock);
+        unsigned int to = static_cast<unsigned int>(std::min<unsigned long long>(extentLast, lastBlock));
+        if (from > extent.logicalBlock) {
+            extents.push_back({extent.logicalBlock, extent.physicalBlock, from - extent.logicalBlock, extent.flags});
+        }
+        extents.push_back({from, extent.physicalBlock + (from - extent.logicalBlock), to - from + 1,
+                           extent.flags & ~EXTENT_UNWRITTEN});
+        if (to < extentLast) {
+            extents.push_back({to + 1, extent.physicalBlock + (to + 1 - extent.logicalBlock),
+                               static_cast<unsigned int>(extentLast - to), extent.flags});
+        }
+        changed = true;
+    }
+    
+    if (!changed) {
+        return true;
+    }
+    mergeExtents(extents);
+    return writeExtents(inode, extents);
+}
+
+bool FileSystem::preallocateFile(unsigned int inodeNum, unsigned long long offset, unsigned long long length) {
+    if (length == 0) {
+        return true;
+    }
+    unsigned long long lastBlock = (offset + length - 1) / blockSize;
+    if (lastBlock > 0xFFFFFFFFULL) {
+        return false;
+    }
+    
+    // Buffered writes take their blocks first so they are not preallocated over
+    flushFile(inodeNum);
+    Inode inode = readInode(inodeNum);
+    if (inode.flags & INODE_COMPRESSED) {
+        return false; // Clusters are packed when written; there is nothing to reserve
+    }
+    
+    if (inode.flags & INODE_INLINE) {
+        if (!moveInlineToBlocks(inodeNum, inode) || !flushFile(inodeNum)) {
+            return false;
+        }
+        inode = readInode(inodeNum);
+    }
+    
+    // Only extents can mark blocks unwritten
+    if (!(inode.flags & INODE_EXTENTS) && !convertToExtents(inode)) {
+        return false;
+    }
+    
+    bool allocated = allocateRange(inode, static_cast<unsigned int>(offset / blockSize), static_cast<unsigned int>(lastBlock),
+                                   groupStart(inodeGroup(inodeNum)), EXTENT_UNWRITTEN);
+    writeInode(inodeNum, inode);
+    return allocated;
+}
+
+unsigned int FileSystem::countFragments(const Inode& inode) {
+    // Runs that are not physically contiguous with the one before
+    unsigned int fragments = 0;
+    unsigned long long nextPhysical = 0;
+    for (const BlockRun& run : getFileRuns(inode)) {
+        if (fragments == 0 || run.physicalBlock != nextPhysical) {
+            fragments++;
+        }
+        nextPhysical = static_cast<unsigned long long>(run.physicalBlock) + run.length;
+    }
+    return fragments;
+}
+
+bool FileSystem::defragFile(unsigned int inodeNum, unsigned int& blocksMoved) {
+    // Buffered writes take their blocks first so the whole file is moved
+    flushFile(inodeNum);
+    Inode inode = readInode(inodeNum);
+    if (inode.type != 0 || countFragments(inode) <= 1 || inodeShared(inodeNum)) {
+        return false; // Nothing to gain, or a snapshot maps the same blocks through this inode
+    }
+    
+    std::vector<BlockRun> runs = getFileRuns(inode);
+    unsigned int count = 0;
+    for (const BlockRun& run : runs) {
+        count += run.length;
+        
+        // Shared blocks stay where they are: a private copy would undo the sharing
+        for (unsigned int i = 0; refcountStart != 0 && i < run.length; i++) {
+            if (blockRefs()[run.physicalBlock + i] != 0) {
+                return false;
+            }
+        }
+    }
+    
+    // One run for all the data, near the inode; it is copied over whole
+    unsigned int start = 0;
+    if (availableBlocks() >= count) {
+        start = allocateBlockRun(count, groupStart(inodeGroup(inodeNum)), false);
+    }
+    if (start == 0) {
+        return false; // No contiguous space large enough
+    }
+    
+    unsigned int next = start;
+    for (const BlockRun& run : runs) {
+        // Unwritten blocks hold no data and stay unwritten
+        if (!(run.flags & EXTENT_UNWRITTEN)) {
+            memcpy(blockAt(next), blockAt(run.physicalBlock), static_cast<size_t>(run.length) * blockSize);
+            markCopied(next, run.physicalBlock, run.length);
+        }
+        next += run.length;
+    }
+    
+    if (inode.flags & INODE_EXTENTS) {
+        std::vector<Extent> extents;
+        next = start;
+        for (const BlockRun& run : runs) {
+            extents.push_back({run.logicalBlock, next, run.length, run.flags});
+            next += run.length;
+        }
+        
+        mergeExtents(extents);
+        if (!writeExtents(inode, extents)) {
+            deallocateBlockRun(start, count);
+            return false;
+        }
+    } else {
+        // Point the existing slots at the new blocks; the pointer blocks stay put
+        BlockMapCursor cursor;
+        std::function<unsigned int()> noNewBlocks = []() { return 0U; };
+        next = start;
+        for (const BlockRun& run : runs) {
+            for (unsigned int i = 0; i < run.length; i++) {
+                *getBlockSlot(inode, run.logicalBlock + i, cursor, noNewBlocks) = next++;
+            }
+        }
+    }
+    
+    for (const BlockRun& run : runs) {
+        deallocateBlockRun(run.physicalBlock, run.length);
+    }
+    writeInode(inodeNum, inode);
+    
+    blocksMoved += count;
+    return true;
+}
+
+void FileSystem::collectFiles(unsigned int dirInodeNum, std::vector<unsigned int>& files) {
+    for (const DirectoryEntry& entry : readDirectoryEntries(dirInodeNum)) {
+        if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+            continue;
+        }
+        
+        Inode inode = readInode(entry.inodeNumber);
+        if (inode.type == 0) {
+            files.push_back(entry.inodeNumber);
+        } else if (inode.type == 1) {
+            collectFiles(entry.inodeNumber, files);
+        }
+    }
+}
+
+bool FileSystem::moveTreeBlocks(unsigned int& block, int depth, unsigned int limit) {
+    // Move the pointer blocks of one tree that lie at or past limit
+    if (block == 0) {
+        return true;
+    }
+    
+    if (block >= limit) {
+        unsigned int moved = allocateBlockRun(1, 0, false);
+        if (moved == 0) {
+            return false;
+        }
+        journalBlock(moved, true);
+        memcpy(blockAt(moved), blockAt(block), blockSize);
+        deallocateBlock(block);
+        block = moved;
+    }
+    
+    if (depth > 1) {
+        journalBlock(block);
+        unsigned int* entries = reinterpret_cast<unsigned int*>(blockAt(block));
+        for (unsigned int i = 0; i < pointersPerBlock(); i++) {
+            if (!moveTreeBlocks(entries[i], depth - 1, limit)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool FileSystem::relocateInode(unsigned int inodeNum, unsigned int limit) {
+    // Move the data and mapping blocks of one file or directory that lie at
+    // or past limit to free blocks below it
+    Inode inode = readInode(inodeNum);
+    if (inode.flags & INODE_INLINE) {
+        return true;
+    }
+    
+    std::vector<BlockRun> above;
+    unsigned int count = 0;
+    for (const BlockRun& run : getFileRuns(inode)) {
+        if (static_cast<unsigned long long>(run.physicalBlock) + run.length <= limit) {
+            continue;
+        }
+        unsigned int skip = (run.physicalBlock >= limit || (run.flags & EXTENT_COMPRESSED)) ? 0 : limit - run.physicalBlock;
+        
+        // Shared blocks stay put, since other files point at them too
+        unsigned int first = skip;
+        for (unsigned int i = skip; i <= run.length; i++) {
+            if (i == run.length || (refcountStart != 0 && blockRefs()[run.physicalBlock + i] != 0)) {
+                if (i > first) {
+                    above.push_back({run.logicalBlock + first, run.physicalBlock + first, i - first, run.flags});
+                    count += i - first;
+                }
+                first = i + 1;
+            }
+        }
+    }
+    
+    bool mappingAbove = false;
+    for (unsigned int block : getMappingBlocks(inode)) {
+        mappingAbove = mappingAbove || block >= limit;
+    }
+    if (above.empty() && !mappingAbove) {
+        return true;
+    }
+    
+    std::vector<unsigned int> blocks;
+    if (inode.flags & INODE_COMPRESSED) {
+        // A cluster is read back in one piece, so each run moves as a whole
+        for (const BlockRun& run : above) {
+            unsigned int start = allocateBlockRun(run.length, 0, false);
+            if (start == 0) {
+                deallocateBlocks(blocks);
+                return false;
+            }
+            for (unsigned int i = 0; i < run.length; i++) {
+                blocks.push_back(start + i);
+            }
+        }
+    } else if (count > 0 && !allocateBlocks(count, blocks, 0, false)) {
+        return false;
+    }
+    
+    // Copy the data down; unwritten blocks hold none
+    size_t next = 0;
+    for (const BlockRun& run : above) {
+        for (unsigned int i = 0; i < run.length; i++, next++) {
+            if (!(run.flags & EXTENT_UNWRITTEN)) {
+                memcpy(blockAt(blocks[next]), blockAt(run.physicalBlock + i), blockSize);
+                markCopied(blocks[next], run.physicalBlock + i, 1);
+            }
+        }
+    }
+    
+    bool moved = true;
+    if (inode.flags & INODE_EXTENTS) {
+        // Keep the parts below the limit; writeExtents also rebuilds the chain below it
+        std::vector<Extent> extents;
+        for (const Extent& extent : readExtents(inode)) {
+            unsigned int keep = extent.physicalBlock >= limit ? 0 : std::min(extent.length, limit - extent.physicalBlock);
+            if (keep < extent.length && (extent.flags & EXTENT_COMPRESSED)) {
+                // Moved whole, or left whole when its blocks are shared
+                bool shared = refcountStart != 0 && blockRefs()[extent.physicalBlock] != 0;
+                keep = shared ? extent.length : 0;
+            }
+            if (keep > 0) {
+                extents.push_back({extent.logicalBlock, extent.physicalBlock, keep, extent.flags});
+            }
+            for (unsigned int i = keep; refcountStart != 0 && i < extent.length; i++) {
+                if (blockRefs()[extent.physicalBlock + i] != 0) {
+                    extents.push_back({extent.logicalBlock + i, extent.physicalBlock + i, 1, extent.flags});
+                }
+            }
+        }
+        next = 0;
+        for (const BlockRun& run : above) {
+            std::vector<unsigned int> runBlocks(blocks.begin() + next, blocks.begin() + next + run.length);
+            for (Extent extent : extentsFromBlocks(runBlocks, run.logicalBlock)) {
+                extent.flags = run.flags;
+                extents.push_back(extent);
+            }
+            next += run.length;
+        }
+        
+        mergeExtents(extents);
+        if (!writeExtents(inode, extents)) {
+            deallocateBlocks(blocks);
+            return false;
+        }
+    } else {
+        // Repoint the data slots, then move the pointer blocks themselves
+        BlockMapCursor cursor;
+        std::function<unsigned int()> noNewBlocks = []() { return 0U; };
+        next = 0;
+        for (const BlockRun& run : above) {
+            for (unsigned int i = 0; i < run.length; i++) {
+                *getBlockSlot(inode, run.logicalBlock + i, cursor, noNewBlocks) = blocks[next++];
+            }
+        }
+        moved = moveTreeBlocks(inode.indirectBlock, 1, limit) && moveTreeBlocks(inode.doubleIndirectBlock, 2, limit) &&
+                moveTreeBlocks(inode.tripleIndirectBlock, 3, limit);
+    }
+    
+    for (const BlockRun& run : above) {
+        deallocateBlockRun(run.physicalBlock, run.length);
+    }
+    writeInode(inodeNum, inode);
+    return moved;
+}
+
+void FileSystem::relocateInodeTable(unsigned int limit) {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    
+    // Inode map blocks: relink the chain around each moved block
+    for (size_t i = 0; i < inodeMapBlocks.size(); i++) {
+        if (inodeMapBlocks[i] < limit) {
+            continue;
+        }
+        unsigned int moved = allocateBlockRun(1, 0, false);
+        if (moved == 0) {
+            continue;
+        }
+        journalBlock(moved, true);
+        memcpy(blockAt(moved), blockAt(inodeMapBlocks[i]), blockSize);
+        if (i == 0) {
+            superBlock->inodeMapStart = moved;
+        } else {
+            journalBlock(inodeMapBlocks[i - 1]);
+            reinterpret_cast<ChainBlockHeader*>(blockAt(inodeMapBlocks[i - 1]))->nextBlock = moved;
+        }
+        deallocateBlock(inodeMapBlocks[i]);
+        inodeMapBlocks[i] = moved;
+    }
+    
+    // Added inode table chunks move with the blocks they were allocated in;
+    // inode numbers stay the same, only the map entries change
+    unsigned int runBlocks = std::max(INODE_CHUNK_SIZE, blockSize) / blockSize;
+    for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+        unsigned int oldStart = inodeChunk(chunk)->block;
+        if (oldStart < limit) {
+            continue;
+        }
+        
+        // Chunks that snapshots share stay where their maps point
+        bool shared = false;
+        for (unsigned int other = chunk; other < superBlock->inodeChunks; other++) {
+            shared = shared || (inodeChunk(other)->block == oldStart && inodeShared(other * INODES_PER_CHUNK));
+        }
+        if (shared) {
+            continue;
+        }
+        unsigned int moved = allocateBlockRun(runBlocks, 0, false);
+        if (moved == 0) {
+            continue;
+        }
+        for (unsigned int i = 0; i < runBlocks; i++) {
+            journalBlock(moved + i, true);
+        }
+        memcpy(blockAt(moved), blockAt(oldStart), static_cast<size_t>(runBlocks) * blockSize);
+        for (unsigned int other = chunk; other < superBlock->inodeChunks; other++) {
+            InodeChunk* entry = inodeChunk(other);
+            if (entry->block == oldStart) {
+                journalBlock(inodeMapBlocks[other / chunksPerMapBlock()]);
+                entry->block = moved;
+                inodeChunkOffsets[other] = static_cast<unsigned long long>(moved) * blockSize + entry->offset;
+            }
+        }
+        deallocateBlockRun(oldStart, runBlocks);
+    }
+}
+
+void FileSystem::recountGroups() {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    const uint64_t* words = bitmapWords();
+    size_t wordsPerGroup = blocksPerGroup / BITS_PER_WORD;
+    
+    // Free blocks from each group's slice of the bitmap
+    for (unsigned int group = 0; group < groupCount; group++) {
+        GroupDescriptor* descriptor = groupDescriptor(group);
+        size_t last = std::min((group + 1) * wordsPerGroup, bitmapWordCount());
+        unsigned int freeBlocks = 0;
+        for (size_t word = group * wordsPerGroup; word < last; word++) {
+            freeBlocks += BITS_PER_WORD - popCount(words[word]);
+        }
+        
+        descriptor->freeBlocks = freeBlocks;
+        descriptor->freeInodes = 0;
+        descriptor->directories = 0;
+        descriptor->flags = freeBlocks == std::min(blocksPerGroup, totalBlocks - groupStart(group)) ? GROUP_BLOCKS_UNINIT : 0;
+    }
+    
+    // Free inodes and directories from the chunks each group now holds
+    for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+        GroupDescriptor* descriptor = groupDescriptor(inodeChunk(chunk)->block / blocksPerGroup);
+        uint64_t used = inodeChunk(chunk)->usedMask;
+        descriptor->freeInodes += INODES_PER_CHUNK - popCount(used);
+        while (used != 0) {
+            unsigned int inodeNum = chunk * INODES_PER_CHUNK + countTrailingZeros(used);
+            used &= used - 1;
+            if (readInode(inodeNum).type == 1) {
+                descriptor->directories++;
+            }
+        }
+    }
+}
+
+bool FileSystem::remapBlocks(Inode& inode, const std::vector<std::pair<unsigned int, unsigned int>>& moves) {
+    // Point single logical blocks at other physical blocks; moves are sorted
+    // by logical block, and the old blocks are left to the caller
+    if (!(inode.flags & INODE_EXTENTS)) {
+        BlockMapCursor cursor;
+        std::function<unsigned int()> noNewBlocks = []() { return 0U; };
+        for (const auto& move : moves) {
+            *getBlockSlot(inode, move.first, cursor, noNewBlocks) = move.second;
+        }
+        return true;
+    }
+    
+    // Cut each extent around the moved blocks
+    std::vector<Extent> extents;
+    for (const Extent& extent : readExtents(inode)) {
+        unsigned long long next = extent.logicalBlock; // First block not yet emitted
+        unsigned long long end = static_cast<unsigned long long>(extent.logicalBlock) + extent.length;
+        auto move = std::lower_bound(moves.begin(), moves.end(), std::make_pair(extent.logicalBlock, 0U));
+        for (; move != moves.end() && move->first < end; ++move) {
+            if (move->first > next) {
+                extents.push_back({static_cast<unsigned int>(next), extent.physicalBlock + static_cast<unsigned int>(next - extent.logicalBlock),
+                                   static_cast<unsigned int>(move->first - next), extent.flags});
+            }
+            extents.push_back({move->first, move->second, 1, extent.flags});
+            next = static_cast<unsigned long long>(move->first) + 1;
+        }
+        if (next < end) {
+            extents.push_back({static_cast<unsigned int>(next), extent.physicalBlock + static_cast<unsigned int>(next - extent.logicalBlock),
+                               static_cast<unsigned int>(end - next), extent.flags});
+        }
+    }
+    
+    mergeExtents(extents);
+    return writeExtents(inode, extents);
+}
+
+bool FileSystem::unshareBlocks(unsigned int inodeNum, Inode& inode, unsigned int firstBlock, unsigned int lastBlock) {
+    // Shared blocks in [firstBlock, lastBlock] are about to be written in
+    // place: give the file its own copies first
+    if (refcountStart == 0) {
+        return true;
+    }
+    
+    const uint16_t* refs = blockRefs();
+    std::vector<std::pair<unsigned int, unsigned int>> moves;
+    std::vector<unsigned int> shared;
+    for (const BlockRun& run : getFileRuns(inode, firstBlock, lastBlock)) {
+        unsigned long long from = std::max(run.logicalBlock, firstBlock);
+        unsigned long long to = std::min(static_cast<unsigned long long>(run.logicalBlock) + run.length - 1,
+                                         static_cast<unsigned long long>(lastBlock));
+        for (unsigned long long logical = from; logical <= to; logical++) {
+            unsigned int physical = run.physicalBlock + static_cast<unsigned int>(logical - run.logicalBlock);
+            if (refs[physical] == 0) {
+                continue;
+            }
+            
+            unsigned int copy = allocateBlockRun(1, physical, false);
+            if (copy == 0) {
+                for (const auto& move : moves) {
+                    deallocateBlock(move.second);
+                }
+                return false;
+            }
+            memcpy(blockAt(copy), blockAt(physical), blockSize);
+            markCopied(copy, physical, 1);
+            moves.push_back({static_cast<unsigned int>(logical), copy});
+            shared.push_back(physical);
+        }
+    }
+    if (moves.empty()) {
+        return true;
+    }
+    
+    if (!remapBlocks(inode, moves)) {
+        for (const auto& move : moves) {
+            deallocateBlock(move.second);
+        }
+        return false;
+    }
+    deallocateBlocks(shared); // Drops this file's reference
+    writeInode(inodeNum, inode);
+    return true;
+}
+
+void FileSystem::dedupBlocks(unsigned int inodeNum, Inode& inode, unsigned int firstBlock, unsigned int lastBlock) {
+    // Blocks in [firstBlock, lastBlock] whose contents are stored already
+    // become references to that block; the rest are entered in the index
+    if (!(features & FEATURE_DEDUP) || (inode.flags & (INODE_INLINE | INODE_COMPRESSED))) {
+        return;
+    }
+    if (!dedupIndexBuilt) {
+        buildDedupIndex();
+    }
+    
+    uint16_t* refs = blockRefs();
+    std::vector<std::pair<unsigned int, unsigned int>> moves;
+    std::vector<unsigned int> duplicates;
+    for (const BlockRun& run : getFileRuns(inode, firstBlock, lastBlock)) {
+        if (run.flags & EXTENT_UNWRITTEN) {
+            continue;
+        }
+        unsigned long long from = std::max(run.logicalBlock, firstBlock);
+        unsigned long long to = std::min(static_cast<unsigned long long>(run.logicalBlock) + run.length - 1,
+                                         static_cast<unsigned long long>(lastBlock));
+        for (unsigned long long logical = from; logical <= to; logical++) {
+            unsigned int physical = run.physicalBlock + static_cast<unsigned int>(logical - run.logicalBlock);
+            if (refs[physical] != 0) {
+                continue; // Already shared
+            }
+            
+            uint64_t hash = hashBlock(blockAt(physical), blockSize);
+            auto found = dedupIndex.find(hash);
+            if (found != dedupIndex.end() && found->second != physical && refs[found->second] < 0xFFFF &&
+                memcmp(blockAt(found->second), blockAt(physical), blockSize) == 0) {
+                refs[found->second]++;
+                moves.push_back({static_cast<unsigned int>(logical), found->second});
+                duplicates.push_back(physical);
+            } else {
+                indexBlock(physical, hash);
+            }
+        }
+    }
+    if (moves.empty()) {
+        return;
+    }
+    
+    if (!remapBlocks(inode, moves)) {
+        for (const auto& move : moves) {
+            refs[move.second]--;
+        }
+        return;
+    }
+    deallocateBlocks(duplicates);
+    writeInode(inodeNum, inode);
+}
+
+void FileSystem::indexBlock(unsigned int block, uint64_t hash) {
+    // A block rewritten in place drops the entry for its old contents
+    auto indexed = dedupHashes.find(block);
+    if (indexed != dedupHashes.end() && indexed->second != hash) {
+        auto entry = dedupIndex.find(indexed->second);
+        if (entry != dedupIndex.end() && entry->second == block) {
+            dedupIndex.erase(entry);
+        }
+    }
+    dedupIndex[hash] = block;
+    dedupHashes[block] = hash;
+}
+
+void FileSystem::buildDedupIndex() {
+    // Hash the data blocks of every file already in the image
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    dedupIndexBuilt = true;
+    
+    for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+        uint64_t used = inodeChunk(chunk)->usedMask;
+        while (used != 0) {
+            unsigned int inodeNum = chunk * INODES_PER_CHUNK + countTrailingZeros(used);
+            used &= used - 1;
+            
+            Inode inode = readInode(inodeNum);
+            if (inode.type != 0 || (inode.flags & INODE_COMPRESSED)) {
+                continue;
+            }
+            for (const BlockRun& run : getFileRuns(inode)) {
+                if (run.flags & EXTENT_UNWRITTEN) {
+                    continue;
+                }
+                for (unsigned int i = 0; i < run.length; i++) {
+                    indexBlock(run.physicalBlock + i, hashBlock(blockAt(run.physicalBlock + i), blockSize));
+                }
+            }
+        }
+    }
+}
+
+bool FileSystem::canReflink(const Inode& inode) {
+    // Every block the file maps must be able to take one more reference
+    if (refcountStart == 0 || (inode.flags & INODE_INLINE)) {
+        return false;
+    }
+    
+    const uint16_t* refs = blockRefs();
+    for (const BlockRun& run : getFileRuns(inode)) {
+        for (unsigned int i = 0; i < run.length; i++) {
+            if (refs[run.physicalBlock + i] == 0xFFFF) {
+                return false;
+            }
+        }
+    }
+    for (unsigned int block : getMappingBlocks(inode)) {
+        if (refs[block] == 0xFFFF) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FileSystem::reflinkFile(const Inode& srcInode, Inode& destInode) {
+    // The copy maps the source's blocks, each of which gains a reference;
+    // nothing is copied until one of the files writes a block
+    uint16_t* refs = blockRefs();
+    std::vector<BlockRun> runs = getFileRuns(srcInode);
+    
+    if (srcInode.flags & INODE_EXTENTS) {
+        // Extent blocks are never changed in place (writeExtents builds a new
+        // chain), so the whole mapping is shared too
+        memcpy(destInode.blockAddresses, srcInode.blockAddresses, sizeof(destInode.blockAddresses));
+        destInode.indirectBlock = srcInode.indirectBlock;
+        destInode.flags |= srcInode.flags & (INODE_EXTENTS | INODE_COMPRESSED);
+        for (unsigned int block : getMappingBlocks(srcInode)) {
+            refs[block]++;
+        }
+    } else {
+        // Pointer blocks are updated in place, so the copy gets its own
+        BlockMapCursor cursor;
+        std::function<unsigned int()> takeBlock = [this]() { return allocateBlockRun(1); };
+        for (const BlockRun& run : runs) {
+            for (unsigned int i = 0; i < run.length; i++) {
+                unsigned int* slot = getBlockSlot(destInode, run.logicalBlock + i, cursor, takeBlock);
+                if (slot == nullptr) {
+                    deallocateBlocks(getMappingBlocks(destInode));
+                    return false;
+                }
+                *slot = run.physicalBlock + i;
+            }
+        }
+    }
+    
+    for (const BlockRun& run : runs) {
+        for (unsigned int i = 0; i < run.length; i++) {
+            refs[run.physicalBlock + i]++;
+        }
+    }
+    return true;
+}
+
+unsigned int FileSystem::createDirectory(unsigned int parentInodeNum) {
+    // An empty directory with its own block, not yet linked into the parent
+    unsigned int newInode = allocateInode(findDirectoryGroup(parentInodeNum), true);
+    if (newInode == INVALID_INODE) {
+        return INVALID_INODE;
+    }
+    
+    unsigned int newBlock = allocateBlockRun(1, groupStart(inodeGroup(newInode)));
+    if (newBlock == 0) {
+        deallocateInode(newInode);
+        return INVALID_INODE;
+    }
+    
+    journalBlock(newBlock, true);
+    Inode inode = readInode(newInode);
+    inode.blockAddresses[0] = newBlock;
+    writeInode(newInode, inode);
+    initializeDirectory(newInode, parentInodeNum);
+    return newInode;
+}
+
+bool FileSystem::loadSnapshots() {
+    // Each entry of the snapshot directory names the first block of a
+    // snapshot's inode map
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    snapshotViews.clear();
+    chunkSharers.clear();
+    if (superBlock->snapshotDir == 0) {
+        return true;
+    }
+    if (superBlock->snapshotDir >= maxInodes) {
+        return false;
+    }
+    
+    for (const DirectoryEntry& entry : readDirectoryEntries(superBlock->snapshotDir, true)) {
+        if (strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0) {
+            continue;
+        }
+        if (addSnapshotView(entry.inodeNumber) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+unsigned int FileSystem::addSnapshotView(unsigned int mapStart) {
+    // Read a snapshot's inode map chain and give its inodes a range of
+    // numbers; returns the first of them, or 0 when the chain is damaged or
+    // no range is left
+    SnapshotView view;
+    view.mapStart = mapStart;
+    for (unsigned int mapBlock = mapStart; mapBlock != 0;) {
+        if (mapBlock < firstDataBlock || mapBlock >= totalBlocks || view.mapBlocks.size() >= totalBlocks) {
+            return 0;
+        }
+        const ChainBlockHeader* header = reinterpret_cast<const ChainBlockHeader*>(blockAt(mapBlock));
+        if (header->count > chunksPerMapBlock() || (header->nextBlock != 0 && header->count < chunksPerMapBlock())) {
+            return 0; // Only the last block may be partly filled
+        }
+        view.mapBlocks.push_back(mapBlock);
+        
+        const InodeChunk* entries = reinterpret_cast<const InodeChunk*>(header + 1);
+        for (unsigned int i = 0; i < header->count; i++) {
+            unsigned long long offset = static_cast<unsigned long long>(entries[i].block) * blockSize + entries[i].offset;
+            if (entries[i].block == 0 || offset + INODE_CHUNK_SIZE > imageSize) {
+                return 0;
+            }
+            view.chunkOffsets.push_back(offset);
+        }
+        mapBlock = header->nextBlock;
+    }
+    if (view.chunkOffsets.empty()) {
+        return 0;
+    }
+    
+    // First gap between the loaded views that is large enough
+    unsigned long long size = static_cast<unsigned long long>(view.chunkOffsets.size()) * INODES_PER_CHUNK;
+    unsigned long long base = SNAPSHOT_INODE_BASE;
+    for (const auto& other : snapshotViews) {
+        if (base + size <= other.first) {
+            break;
+        }
+        base = other.first + static_cast<unsigned long long>(other.second.chunkOffsets.size()) * INODES_PER_CHUNK;
+    }
+    if (base + size > 0x7FFFFFFF) {
+        return 0;
+    }
+    
+    for (unsigned long long offset : view.chunkOffsets) {
+        chunkSharers[offset]++;
+    }
+    snapshotViews[static_cast<unsigned int>(base)] = std::move(view);
+    return static_cast<unsigned int>(base);
+}
+
+void FileSystem::removeSnapshotView(unsigned int base) {
+    for (unsigned long long offset : snapshotViews[base].chunkOffsets) {
+        auto sharers = chunkSharers.find(offset);
+        if (--sharers->second == 0) {
+            chunkSharers.erase(sharers);
+        }
+    }
+    snapshotViews.erase(base);
+}
+
+bool FileSystem::shareInode(Inode& inode) {
+    // Give a copied inode its own hold on what it maps: directories get
+    // their own blocks, files one more reference on each of theirs
+    if (inode.flags & INODE_INLINE) {
+        return true;
+    }
+    
+    Inode source = inode;
+    memset(inode.blockAddresses, 0, sizeof(inode.blockAddresses));
+    inode.indirectBlock = 0;
+    inode.doubleIndirectBlock = 0;
+    inode.tripleIndirectBlock = 0;
+    if (inode.type != 1) {
+        return reflinkFile(source, inode);
+    }
+    
+    // Directories are changed in place, so they cannot share blocks
+    std::vector<unsigned int> copies;
+    auto copyBlock = [&](unsigned int block) {
+        unsigned int copy = allocateBlockRun(1, block, false);
+        if (copy != 0) {
+            journalBlock(copy, true);
+            memcpy(blockAt(copy), blockAt(block), blockSize);
+            copies.push_back(copy);
+        }
+        return copy;
+    };
+    for (unsigned int i = 0; i < directBlocks; i++) {
+        if (source.blockAddresses[i] != 0 && (inode.blockAddresses[i] = copyBlock(source.blockAddresses[i])) == 0) {
+            deallocateBlocks(copies);
+            return false;
+        }
+    }
+    if (source.indirectBlock != 0) {
+        if ((inode.indirectBlock = copyBlock(source.indirectBlock)) == 0) {
+            deallocateBlocks(copies);
+            return false;
+        }
+        unsigned int* pointers = reinterpret_cast<unsigned int*>(blockAt(inode.indirectBlock));
+        for (unsigned int i = 0; i < blockSize / sizeof(unsigned int); i++) {
+            if (pointers[i] != 0 && (pointers[i] = copyBlock(pointers[i])) == 0) {
+                deallocateBlocks(copies);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool FileSystem::preserveChunk(unsigned int chunk) {
+    // Before live changes a chunk of the inode table that snapshots share,
+    // they get their own copy of it; live keeps the original location
+    auto sharers = chunkSharers.find(inodeChunkOffsets[chunk]);
+    if (sharers == chunkSharers.end()) {
+        return true;
+    }
+    unsigned long long offset = sharers->first;
+    
+    uint64_t used = 0;
+    for (auto& view : snapshotViews) {
+        if (chunk < view.second.chunkOffsets.size() && view.second.chunkOffsets[chunk] == offset) {
+            used = viewChunk(view.second, chunk)->usedMask;
+            break;
+        }
+    }
+    
+    // Files take one more reference on every block, which must have room for it
+    for (uint64_t mask = used; mask != 0; mask &= mask - 1) {
+        Inode inode;
+        memcpy(&inode, memory + offset + countTrailingZeros(mask) * INODE_SIZE, sizeof(Inode));
+        if (inode.type == 0 && !(inode.flags & INODE_INLINE) && !canReflink(inode)) {
+            std::cout << "Error: Block reference count limit reached; a snapshot cannot keep its own copy of these inodes\n";
+            return false;
+        }
+    }
+    
+    unsigned int runBlocks = std::max(INODE_CHUNK_SIZE, blockSize) / blockSize;
+    unsigned int start = allocateBlockRun(runBlocks, static_cast<unsigned int>(offset / blockSize));
+    if (start == 0) {
+        std::cout << "Error: Not enough free blocks to copy inodes a snapshot shares\n";
+        return false;
+    }
+    for (unsigned int i = 0; i < runBlocks; i++) {
+        journalBlock(start + i, true);
+    }
+    memcpy(blockAt(start), memory + offset, INODE_CHUNK_SIZE);
+    
+    auto copyAt = [&](uint64_t mask) {
+        return reinterpret_cast<Inode*>(blockAt(start) + countTrailingZeros(mask) * INODE_SIZE);
+    };
+    for (uint64_t mask = used; mask != 0; mask &= mask - 1) {
+        if (!shareInode(*copyAt(mask))) {
+            for (uint64_t done = used & ~mask; done != 0; done &= done - 1) {
+                freeInodeBlocks(*copyAt(done));
+            }
+            deallocateBlockRun(start, runBlocks);
+            std::cout << "Error: Not enough free blocks to copy inodes a snapshot shares\n";
+            return false;
+        }
+    }
+    
+    // Every snapshot sharing the chunk moves to the copy
+    unsigned long long copyOffset = static_cast<unsigned long long>(start) * blockSize;
+    for (auto& view : snapshotViews) {
+        if (chunk < view.second.chunkOffsets.size() && view.second.chunkOffsets[chunk] == offset) {
+            journalBlock(view.second.mapBlocks[chunk / chunksPerMapBlock()]);
+            InodeChunk* entry = viewChunk(view.second, chunk);
+            entry->block = start;
+            entry->offset = 0;
+            view.second.chunkOffsets[chunk] = copyOffset;
+        }
+    }
+    unsigned int count = sharers->second;
+    chunkSharers.erase(sharers);
+    chunkSharers[copyOffset] = count;
+    return true;
+}
+
+bool FileSystem::preserveInode(unsigned int inodeNum) {
+    // Snapshots never include the snapshot directory, so it changes freely
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    if (inodeNum >= maxInodes) {
+        return false;
+    }
+    if (superBlock->snapshotDir != 0 && inodeNum == superBlock->snapshotDir) {
+        return true;
+    }
+    return preserveChunk(inodeNum / INODES_PER_CHUNK);
+}
+
+std::vector<std::pair<unsigned int, unsigned int>> FileSystem::snapshotOnlyChunks() {
+    // Chunks that live no longer uses, each listed once, as the base of a
+    // view holding it and its index there
+    std::set<unsigned long long> seen(inodeChunkOffsets.begin(), inodeChunkOffsets.end());
+    std::vector<std::pair<unsigned int, unsigned int>> chunks;
+    for (const auto& view : snapshotViews) {
+        for (unsigned int chunk = 0; chunk < view.second.chunkOffsets.size(); chunk++) {
+            if (seen.insert(view.second.chunkOffsets[chunk]).second) {
+                chunks.push_back({view.first, chunk});
+            }
+        }
+    }
+    return chunks;
+}
+
+bool FileSystem::readCluster(const std::vector<Extent>& extents, unsigned int firstBlock, char* buffer) {
+    // Unpack the cluster starting at firstBlock of a compressed file; extents
+    // are sorted, and stored clusters or raw runs may cover it
+    size_t clusterBytes = static_cast<size_t>(CLUSTER_BLOCKS) * blockSize;
+    unsigned long long clusterEnd = static_cast<unsigned long long>(firstBlock) + CLUSTER_BLOCKS;
+    memset(buffer, 0, clusterBytes);
+    
+    auto extentEnd = [](const Extent& extent) {
+        return static_cast<unsigned long long>(extent.logicalBlock) +
+               ((extent.flags & EXTENT_COMPRESSED) ? CLUSTER_BLOCKS : extent.length);
+    };
+    auto extent = std::partition_point(extents.begin(), extents.end(), [&](const Extent& candidate) {
+        return extentEnd(candidate) <= firstBlock;
+    });
+    
+    unsigned int badBlock = 0;
+    for (; extent != extents.end() && extent->logicalBlock < clusterEnd; ++extent) {
+        if (extent->flags & EXTENT_COMPRESSED) {
+            const ClusterHeader* header = reinterpret_cast<const ClusterHeader*>(blockAt(extent->physicalBlock));
+            size_t room = static_cast<size_t>(extent->length) * blockSize - sizeof(ClusterHeader);
+            if (!verifyBlocks(extent->physicalBlock, extent->length, badBlock) ||
+                header->packedBytes > room || header->rawBytes > clusterBytes ||
+                !lzDecompress(reinterpret_cast<const char*>(header + 1), header->packedBytes, buffer, header->rawBytes)) {
+                return false;
+            }
+        } else if (!(extent->flags & EXTENT_UNWRITTEN)) {
+            // Raw blocks: copy the part inside the cluster
+            unsigned long long from = std::max<unsigned long long>(extent->logicalBlock, firstBlock);
+            unsigned long long to = std::min(extentEnd(*extent), clusterEnd);
+            if (!verifyBlocks(extent->physicalBlock + static_cast<unsigned int>(from - extent->logicalBlock),
+                              static_cast<unsigned int>(to - from), badBlock)) {
+                return false;
+            }
+            memcpy(buffer + (from - firstBlock) * blockSize, blockAt(extent->physicalBlock + static_cast<unsigned int>(from - extent->logicalBlock)),
+                   static_cast<size_t>(to - from) * blockSize);
+        }
+    }
+    return true;
+}
+
+bool FileSystem::storeCluster(const char* buffer, unsigned int firstBlock, unsigned int blocks, unsigned int goal,
+                              std::vector<Extent>& extents) {
+    // Store the first blocks of a cluster and add its extent; a cluster of
+    // zeros stays a hole
+    size_t rawBytes = static_cast<size_t>(blocks) * blockSize;
+    if (buffer[0] == 0 && memcmp(buffer, buffer + 1, rawBytes - 1) == 0) {
+        return true;
+    }
+    
+    std::vector<char> packed;
+    size_t packedBytes = lzCompress(buffer, rawBytes, packed);
+    unsigned int packedBlocks = static_cast<unsigned int>((sizeof(ClusterHeader) + packedBytes + blockSize - 1) / blockSize);
+    
+    if (packedBlocks < blocks) {
+        unsigned int start = allocateBlockRun(packedBlocks, goal, false);
+        if (start == 0) {
+            return false;
+        }
+        
+        // A cluster cannot be read without its header, so packed blocks
+        // go through the journal like metadata; they are few by design
+        for (unsigned int i = 0; i < packedBlocks; i++) {
+            journalBlock(start + i, true);
+        }
+        
+        ClusterHeader header = {static_cast<unsigned int>(packedBytes), static_cast<unsigned int>(rawBytes)};
+        char* target = blockAt(start);
+        memcpy(target, &header, sizeof(header));
+        memcpy(target + sizeof(header), packed.data(), packedBytes);
+        memset(target + sizeof(header) + packedBytes, 0, static_cast<size_t>(packedBlocks) * blockSize - sizeof(header) - packedBytes);
+        extents.push_back({firstBlock, start, packedBlocks, EXTENT_COMPRESSED});
+        return true;
+    }
+    
+    // Data that does not shrink by a block is kept as it is
+    unsigned int start = allocateBlockRun(blocks, goal, false);
+    if (start == 0) {
+        return false;
+    }
+    memcpy(blockAt(start), buffer, rawBytes);
+    markDirty(start, blocks);
+    extents.push_back({firstBlock, start, blocks, 0});
+    return true;
+}
+
+bool FileSystem::writeCompressed(unsigned int inodeNum, Inode& inode, unsigned long long offset, const char* data, size_t length) {
+    // Each cluster the write touches is unpacked, patched and packed again
+    // into new blocks. The old blocks are freed once the new extents are in.
+    unsigned long long end = offset + length;
+    unsigned long long fileBlocks = (std::max(inode.size, end) + blockSize - 1) / blockSize;
+    unsigned long long clusterBytes = static_cast<unsigned long long>(CLUSTER_BLOCKS) * blockSize;
+    unsigned int goal = groupStart(inodeGroup(inodeNum));
+    
+    std::vector<Extent> extents = readExtents(inode);
+    std::vector<Extent> added;
+    std::vector<Extent> replaced;
+    std::vector<char> buffer(static_cast<size_t>(clusterBytes));
+    auto release = [this](const std::vector<Extent>& list) {
+        for (const Extent& extent : list) {
+            deallocateBlockRun(extent.physicalBlock, extent.length);
+        }
+    };
+    
+    for (unsigned long long cluster = offset / clusterBytes; cluster <= (end - 1) / clusterBytes; cluster++) {
+        unsigned int firstBlock = static_cast<unsigned int>(cluster * CLUSTER_BLOCKS);
+        unsigned long long clusterStart = cluster * clusterBytes;
+        if (!readCluster(extents, firstBlock, buffer.data())) {
+            release(added);
+            return false;
+        }
+        
+        unsigned long long from = std::max(clusterStart, offset);
+        unsigned long long to = std::min(clusterStart + clusterBytes, end);
+        memcpy(buffer.data() + (from - clusterStart), data + (from - offset), static_cast<size_t>(to - from));
+        
+        // Take the cluster's old extents out of the list; raw runs reaching
+        // past it keep their outside parts
+        std::vector<Extent> kept;
+        unsigned long long clusterEnd = static_cast<unsigned long long>(firstBlock) + CLUSTER_BLOCKS;
+        for (const Extent& extent : extents) {
+            unsigned long long extentEnd = static_cast<unsigned long long>(extent.logicalBlock) + extent.length;
+            if (extent.flags & EXTENT_COMPRESSED) {
+                if (extent.logicalBlock == firstBlock) {
+                    replaced.push_back(extent);
+                } else {
+                    kept.push_back(extent);
+                }
+                continue;
+            }
+            if (extentEnd <= firstBlock || extent.logicalBlock >= clusterEnd) {
+                kept.push_back(extent);
+                continue;
+            }
+            
+            unsigned int inside = static_cast<unsigned int>(std::max<unsigned long long>(extent.logicalBlock, firstBlock));
+            unsigned int insideEnd = static_cast<unsigned int>(std::min(extentEnd, clusterEnd));
+            unsigned int physical = extent.physicalBlock + (inside - extent.logicalBlock);
+            if (extent.logicalBlock < inside) {
+                kept.push_back({extent.logicalBlock, extent.physicalBlock, inside - extent.logicalBlock, extent.flags});
+            }
+            replaced.push_back({inside, physical, insideEnd - inside, extent.flags});
+            if (insideEnd < extentEnd) {
+                kept.push_back({insideEnd, physical + (insideEnd - inside), static_cast<unsigned int>(extentEnd - insideEnd), extent.flags});
+            }
+        }
+        
+        unsigned int blocks = static_cast<unsigned int>(std::min<unsigned long long>(CLUSTER_BLOCKS, fileBlocks - firstBlock));
+        size_t before = kept.size();
+        if (!storeCluster(buffer.data(), firstBlock, blocks, goal, kept)) {
+            release(added);
+            return false;
+        }
+        added.insert(added.end(), kept.begin() + before, kept.end());
+        extents.swap(kept);
+    }
+    
+    mergeExtents(extents);
+    if (!writeExtents(inode, extents)) {
+        release(added);
+        return false;
+    }
+    release(replaced);
+    return true;
+}
+
+bool FileSystem::compressFile(unsigned int inodeNum) {
+    // Buffered writes reach their blocks first so they are packed too
+    flushFile(inodeNum);
+    Inode inode = readInode(inodeNum);
+    if (inode.flags & INODE_COMPRESSED) {
+        return true;
+    }
+    
+    // Inline data stays in the inode until it outgrows it
+    if (inode.flags & INODE_INLINE) {
+        inode.flags |= INODE_COMPRESSED;
+        writeInode(inodeNum, inode);
+        return true;
+    }
+    
+    // Pack every cluster that has data; clusters without any stay holes
+    std::vector<BlockRun> runs = getFileRuns(inode);
+    std::vector<Extent> oldExtents;
+    for (const BlockRun& run : runs) {
+        oldExtents.push_back({run.logicalBlock, run.physicalBlock, run.length, run.flags});
+    }
+    mergeExtents(oldExtents);
+    
+    unsigned long long fileBlocks = (inode.size + blockSize - 1) / blockSize;
+    unsigned int goal = groupStart(inodeGroup(inodeNum));
+    std::vector<Extent> extents;
+    std::vector<char> buffer(static_cast<size_t>(CLUSTER_BLOCKS) * blockSize);
+    auto release = [this, &extents]() {
+        for (const Extent& extent : extents) {
+            deallocateBlockRun(extent.physicalBlock, extent.length);
+        }
+    };
+    
+    unsigned long long nextCluster = 0;
+    for (const Extent& old : oldExtents) {
+        unsigned long long first = std::max<unsigned long long>(old.logicalBlock / CLUSTER_BLOCKS, nextCluster);
+        unsigned long long last = (static_cast<unsigned long long>(old.logicalBlock) + old.length - 1) / CLUSTER_BLOCKS;
+        for (unsigned long long cluster = first; cluster <= last && cluster * CLUSTER_BLOCKS < fileBlocks; cluster++) {
+            unsigned int firstBlock = static_cast<unsigned int>(cluster * CLUSTER_BLOCKS);
+            unsigned int blocks = static_cast<unsigned int>(std::min<unsigned long long>(CLUSTER_BLOCKS, fileBlocks - firstBlock));
+            if (!readCluster(oldExtents, firstBlock, buffer.data()) ||
+                !storeCluster(buffer.data(), firstBlock, blocks, goal, extents)) {
+                release();
+                return false;
+            }
+        }
+        nextCluster = std::max(nextCluster, last + 1);
+    }
+    
+    // Swap in the new mapping; writeExtents frees the old mapping blocks
+    if (!writeExtents(inode, extents)) {
+        release();
+        return false;
+    }
+    inode.doubleIndirectBlock = 0;
+    inode.tripleIndirectBlock = 0;
+    inode.flags |= INODE_COMPRESSED;
+    for (const BlockRun& run : runs) {
+        deallocateBlockRun(run.physicalBlock, run.length);
+    }
+    writeInode(inodeNum, inode);
+    return true;
+}
+
+bool FileSystem::copyClusters(const Inode& srcInode, Inode& destInode, unsigned int goal) {
+    // Packed clusters are copied as they are, each into one run of its own
+    std::vector<Extent> extents;
+    auto release = [this, &extents]() {
+        for (const Extent& extent : extents) {
+            deallocateBlockRun(extent.physicalBlock, extent.length);
+        }
+    };
+    
+    for (const Extent& extent : readExtents(srcInode)) {
+        unsigned int start = allocateBlockRun(extent.length, goal, false);
+        if (start == 0) {
+            release();
+            return false;
+        }
+        memcpy(blockAt(start), blockAt(extent.physicalBlock), static_cast<size_t>(extent.length) * blockSize);
+        markCopied(start, extent.physicalBlock, extent.length);
+        extents.push_back({extent.logicalBlock, start, extent.length, extent.flags});
+        goal = start + extent.length;
+    }
+    
+    if (!writeExtents(destInode, extents)) {
+        release();
+        return false;
+    }
+    return true;
+}
+
+bool FileSystem::moveInlineToBlocks(unsigned int inodeNum, Inode& inode) {
+    char data[INLINE_DATA_SIZE];
+    memcpy(data, inode.blockAddresses, sizeof(data));
+    Inode original = inode;
+    
+    // Clear the inline area so it can hold block pointers or extents, then
+    // write the bytes back through the normal block path
+    inode.flags &= ~INODE_INLINE;
+    if ((features & FEATURE_EXTENTS) || (inode.flags & INODE_COMPRESSED)) {
+        inode.flags |= INODE_EXTENTS;
+    }
+    memset(inode.blockAddresses, 0, sizeof(inode.blockAddresses));
+    inode.indirectBlock = 0;
+    inode.doubleIndirectBlock = 0;
+    inode.tripleIndirectBlock = 0;
+    inode.size = 0;
+    writeInode(inodeNum, inode);
+    
+    if (!writeFile(inodeNum, 0, data, static_cast<size_t>(original.size))) {
+        discardDelayed(inodeNum);
+        freeInodeBlocks(readInode(inodeNum));
+        inode = original;
+        writeInode(inodeNum, inode);
+        return false;
+    }
+    
+    inode = readInode(inodeNum);
+    inode.size = original.size;
+    return true;
+}
+
+bool FileSystem::writeFile(unsigned int inodeNum, unsigned long long offset, const char* data, size_t length) {
+    Inode inode = readInode(inodeNum);
+    unsigned long long end = offset + length;
+    unsigned long long newSize = std::max(inode.size, end);
+    
+    if (inode.flags & INODE_INLINE) {
+        if (newSize <= INLINE_DATA_SIZE) {
+            memcpy(reinterpret_cast<char*>(inode.blockAddresses) + offset, data, length);
+            inode.size = newSize;
+            inode.modificationTime = time(nullptr);
+            writeInode(inodeNum, inode);
+            return true;
+        }
+        
+        // Grown past the inode: move the bytes out to a block first
+        if (!moveInlineToBlocks(inodeNum, inode)) {
+            return false;
+        }
+    }
+    
+    unsigned long long maxBlocks = (inode.flags & INODE_EXTENTS) ? 0xFFFFFFFFULL : maxMappedBlocks();
+    if ((newSize + blockSize - 1) / blockSize > maxBlocks) {
+        return false;
+    }
+    
+    // Shared blocks that are written in place get private copies first
+    if (length > 0 && !(inode.flags & INODE_COMPRESSED) &&
+        !unshareBlocks(inodeNum, inode, static_cast<unsigned int>(offset / blockSize), static_cast<unsigned int>((end - 1) / blockSize))) {
+        return false;
+    }
+    
+    // Only the blocks being written are allocated; a gap before them stays a hole
+    if (length > 0 && (inode.flags & INODE_COMPRESSED)) {
+        // Clusters are repacked as they are written, never buffered
+        if (!writeCompressed(inodeNum, inode, offset, data, length)) {
+            return false;
+        }
+    } else if (length > 0 && (features & FEATURE_DELALLOC)) {
+        if (!bufferWrite(inodeNum, inode, offset, data, length)) {
+            return false;
+        }
+    } else if (length > 0) {
+        unsigned int firstBlock = static_cast<unsigned int>(offset / blockSize);
+        unsigned int lastBlock = static_cast<unsigned int>((end - 1) / blockSize);
+        
+        // New blocks are not cleared up front: the copy below overwrites them
+        std::vector<BlockRun> fresh;
+        if (!allocateRange(inode, firstBlock, lastBlock, groupStart(inodeGroup(inodeNum)), 0, &fresh)) {
+            writeInode(inodeNum, inode);
+            return false;
+        }
+        
+        // Fresh and unwritten blocks hold stale data; only the first and last
+        // block can be partly covered, so only their uncovered bytes are cleared
+        auto stale = [&fresh](const BlockRun& run, unsigned int block) {
+            if (run.flags & EXTENT_UNWRITTEN) {
+                return true;
+            }
+            for (const BlockRun& hole : fresh) {
+                if (block >= hole.logicalBlock && block - hole.logicalBlock < hole.length) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        
+        // Copy into the runs covering [offset, end)
+        for (const BlockRun& run : getFileRuns(inode, firstBlock, lastBlock)) {
+            unsigned long long runStart = static_cast<unsigned long long>(run.logicalBlock) * blockSize;
+            unsigned long long runEnd = runStart + static_cast<unsigned long long>(run.length) * blockSize;
+            unsigned long long from = std::max(runStart, offset);
+            unsigned long long to = std::min(runEnd, end);
+            
+            if (from < to) {
+                char* runData = blockAt(run.physicalBlock);
+                unsigned long long headStart = from / blockSize * blockSize;
+                unsigned long long tailEnd = std::min(runEnd, (to + blockSize - 1) / blockSize * blockSize);
+                if (headStart < from && stale(run, static_cast<unsigned int>(from / blockSize))) {
+                    memset(runData + (headStart - runStart), 0, static_cast<size_t>(from - headStart));
+                }
+                if (to < tailEnd && stale(run, static_cast<unsigned int>((to - 1) / blockSize))) {
+                    memset(runData + (to - runStart), 0, static_cast<size_t>(tailEnd - to));
+                }
+                memcpy(runData + (from - runStart), data + (from - offset), static_cast<size_t>(to - from));
+                markDirty(run.physicalBlock + static_cast<unsigned int>((from - runStart) / blockSize),
+                          static_cast<unsigned int>((to - 1) / blockSize - from / blockSize + 1));
+            }
+        }
+    }
+    
+    // Written blocks no longer read as zeros
+    if (length > 0 && (inode.flags & INODE_EXTENTS) &&
+        !markWritten(inode, static_cast<unsigned int>(offset / blockSize), static_cast<unsigned int>((end - 1) / blockSize))) {
+        writeInode(inodeNum, inode);
+        return false;
+    }
+    
+    // Written blocks that duplicate stored ones are shared instead
+    if (length > 0) {
+        dedupBlocks(inodeNum, inode, static_cast<unsigned int>(offset / blockSize), static_cast<unsigned int>((end - 1) / blockSize));
+    }
+    
+    inode.size = newSize;
+    inode.modificationTime = time(nullptr);
+    writeInode(inodeNum, inode);
+    
+    if (delayedBytes > DELALLOC_LIMIT) {
+        flushDelayed();
+    }
+    return true;
+}
+
+unsigned int FileSystem::delayedReservation(const Inode& inode, const DelayedFile& file) const {
+    // Buffered blocks plus the most mapping blocks placing them could need
+    unsigned int pending = static_cast<unsigned int>(file.blocks.size());
+    if (pending == 0) {
+        return 0;
+    }
+    
+    if (inode.flags & INODE_EXTENTS) {
+        // writeExtents builds the whole new chain before freeing the old one
+        return pending + (file.baseExtents + pending + extentsPerBlock() - 1) / extentsPerBlock();
+    }
+    return pending + mappingBlocksFor(static_cast<unsigned long long>(file.blocks.rbegin()->first) + 1);
+}
+
+bool FileSystem::bufferWrite(unsigned int inodeNum, const Inode& inode, unsigned long long offset,
+                             const char* data, size_t length) {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    unsigned long long end = offset + length;
+    unsigned int firstBlock = static_cast<unsigned int>(offset / blockSize);
+    unsigned int lastBlock = static_cast<unsigned int>((end - 1) / blockSize);
+    std::vector<BlockRun> runs = getFileRuns(inode, firstBlock, lastBlock);
+    
+    bool newFile = delayedFiles.find(inodeNum) == delayedFiles.end();
+    DelayedFile& file = delayedFiles[inodeNum];
+    if (newFile && (inode.flags & INODE_EXTENTS)) {
+        file.baseExtents = static_cast<unsigned int>(readExtents(inode).size());
+    }
+    
+    // Mapped blocks are written in place; holes go to the buffer. Work out
+    // which holes are new and reserve space for them before buffering.
+    std::vector<char*> targets;
+    std::vector<unsigned int> newHoles;
+    size_t runIndex = 0;
+    for (unsigned int block = firstBlock; ; block++) {
+        while (runIndex < runs.size() && runs[runIndex].logicalBlock + runs[runIndex].length <= block) {
+            runIndex++;
+        }
+        
+        if (runIndex < runs.size() && runs[runIndex].logicalBlock <= block) {
+            unsigned int physical = runs[runIndex].physicalBlock + (block - runs[runIndex].logicalBlock);
+            char* target = blockAt(physical);
+            markDirty(physical);
+            unsigned long long blockStart = static_cast<unsigned long long>(block) * blockSize;
+            if ((runs[runIndex].flags & EXTENT_UNWRITTEN) && (blockStart < offset || blockStart + blockSize > end)) {
+                memset(target, 0, blockSize); // Stale until its first write; a whole-block write needs no clearing
+            }
+            targets.push_back(target);
+        } else {
+            auto buffered = file.blocks.find(block);
+            targets.push_back(buffered != file.blocks.end() ? buffered->second.data() : nullptr);
+            if (buffered == file.blocks.end()) {
+                newHoles.push_back(block);
+            }
+        }
+        
+        if (block == lastBlock) {
+            break; // lastBlock may be the largest block number
+        }
+    }
+    
+    if (!newHoles.empty()) {
+        DelayedFile grown;
+        grown.baseExtents = file.baseExtents;
+        for (const auto& entry : file.blocks) {
+            grown.blocks[entry.first];
+        }
+        for (unsigned int block : newHoles) {
+            grown.blocks[block];
+        }
+        
+        unsigned int needed = delayedReservation(inode, grown);
+        if (needed > file.reserved) {
+            if (availableBlocks() < needed - file.reserved) {
+                if (newFile) {
+                    delayedFiles.erase(inodeNum);
+                }
+                return false;
+            }
+            superBlock->reservedBlocks += needed - file.reserved;
+            file.reserved = needed;
+        }
+        
+        for (unsigned int block : newHoles) {
+            std::vector<char>& buffer = file.blocks[block];
+            buffer.assign(blockSize, 0);
+            targets[block - firstBlock] = buffer.data();
+        }
+        delayedBytes += static_cast<unsigned long long>(newHoles.size()) * blockSize;
+    }
+    
+    for (size_t i = 0; i < targets.size(); i++) {
+        unsigned long long blockStart = static_cast<unsigned long long>(firstBlock + i) * blockSize;
+        unsigned long long from = std::max(blockStart, offset);
+        unsigned long long to = std::min(blockStart + blockSize, end);
+        memcpy(targets[i] + (from - blockStart), data + (from - offset), static_cast<size_t>(to - from));
+    }
+    
+    if (file.blocks.empty()) {
+        delayedFiles.erase(inodeNum);
+    }
+    return true;
 }
 
-void FileSystem::initializeDirectory(unsigned int dirInodeNum, unsigned int parentInodeNum) {
-    // Add . entry (self)
-    addDirectoryEntry(dirInodeNum, ".", dirInodeNum);
+bool FileSystem::flushFile(unsigned int inodeNum) {
+    auto it = delayedFiles.find(inodeNum);
+    if (it == delayedFiles.end()) {
+        return true;
+    }
     
-    // Add .. entry (parent)
-    addDirectoryEntry(dirInodeNum, "..", parentInodeNum);
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    DelayedFile& file = it->second;
+    Inode inode = readInode(inodeNum);
+    unsigned int count = static_cast<unsigned int>(file.blocks.size());
+    unsigned int firstPending = file.blocks.begin()->first;
+    unsigned int lastPending = file.blocks.rbegin()->first;
+    
+    // Continue after the mapped block before the first pending one, or
+    // start in the inode's group
+    unsigned int goal = groupStart(inodeGroup(inodeNum));
+    for (const BlockRun& run : getFileRuns(inode, 0, firstPending)) {
+        if (run.logicalBlock < firstPending) {
+            goal = run.physicalBlock + run.length;
+        }
+    }
+    
+    // The reservation covers this allocation: release it, then take all of
+    // the file's pending blocks as one run where possible
+    superBlock->reservedBlocks -= file.reserved;
+    delayedBytes -= static_cast<unsigned long long>(count) * blockSize;
+    
+    // The buffers fill whole blocks, so the data blocks are not cleared
+    std::vector<unsigned int> blocks;
+    size_t placed = 0;
+    if (allocateBlocks(count, blocks, goal, false)) {
+        if (inode.flags & INODE_EXTENTS) {
+            std::vector<Extent> extents = readExtents(inode);
+            for (const auto& entry : file.blocks) {
+                extents.push_back({entry.first, blocks[placed++], 1, 0});
+            }
+            mergeExtents(extents);
+            if (!writeExtents(inode, extents)) {
+                placed = 0;
+            }
+        } else {
+            // Pointer blocks go right after the data run
+            BlockMapCursor cursor;
+            std::function<unsigned int()> takeBlock = [this, &blocks]() { return allocateBlockRun(1, blocks.back() + 1); };
+            for (const auto& entry : file.blocks) {
+                unsigned int* slot = getBlockSlot(inode, entry.first, cursor, takeBlock);
+                if (slot == nullptr) {
+                    break;
+                }
+                *slot = blocks[placed++];
+            }
+        }
+        
+        if (placed < blocks.size()) {
+            deallocateBlocks(std::vector<unsigned int>(blocks.begin() + placed, blocks.end()));
+        }
+    }
+    
+    // Copy the buffers into the blocks that were mapped
+    size_t next = 0;
+    for (const auto& entry : file.blocks) {
+        if (next == placed) {
+            break;
+        }
+        markDirty(blocks[next]);
+        memcpy(blockAt(blocks[next++]), entry.second.data(), blockSize);
+    }
+    writeInode(inodeNum, inode);
+    dedupBlocks(inodeNum, inode, firstPending, lastPending);
+    
+    delayedFiles.erase(it);
+    return placed == count;
+}
+
+bool FileSystem::flushDelayed() {
+    bool flushed = true;
+    while (!delayedFiles.empty()) {
+        unsigned int inodeNum = delayedFiles.begin()->first;
+        if (!flushFile(inodeNum)) {
+            std::cout << "Error: Could not allocate delayed blocks for inode " << inodeNum << "\n";
+            flushed = false;
+        }
+    }
+    return flushed;
+}
+
+void FileSystem::discardDelayed(unsigned int inodeNum) {
+    auto it = delayedFiles.find(inodeNum);
+    if (it == delayedFiles.end()) {
+        return;
+    }
+    
+    reinterpret_cast<SuperBlock*>(memory)->reservedBlocks -= it->second.reserved;
+    delayedBytes -= static_cast<unsigned long long>(it->second.blocks.size()) * blockSize;
+    delayedFiles.erase(it);
 }
 
 std::vector<std::string> FileSystem::parsePath(const std::string& path) {
@@ -559,14 +5496,24 @@ int FileSystem::getInodeFromPath(const std::string& path) {
     }
     
     std::vector<std::string> components = parsePath(path);
+    unsigned int snapshotDir = reinterpret_cast<SuperBlock*>(memory)->snapshotDir;
     
     for (const std::string& component : components) {
         if (component == ".") {
             continue;
+        } else if (inodeNum == 0 && component == SNAPSHOT_PREFIX && snapshotDir != 0) {
+            // The snapshots hang off the root without an entry in it
+            inodeNum = snapshotDir;
         } else if (component == "..") {
             // Go up one directory
             if (inodeNum == 0) {
                 continue; // Already at root
+            } else if (snapshotViews.count(inodeNum) != 0) {
+                inodeNum = snapshotDir; // Out of a snapshot's root
+                continue;
+            } else if (static_cast<unsigned int>(inodeNum) == snapshotDir) {
+                inodeNum = 0;
+                continue;
             }
             
             std::vector<DirectoryEntry> entries = readDirectoryEntries(inodeNum);
@@ -620,9 +5567,18 @@ std::pair<int, std::string> FileSystem::getParentInodeAndFilename(const std::str
     return std::make_pair(parentInode, basename);
 }
 
-void FileSystem::run() {
+void FileSystem::run(unsigned int flushSeconds, bool verify) {
     std::string command;
     
+    // The flusher writes the image back while the shell waits for input
+    flushInterval = flushSeconds;
+    if (flushInterval > 0) {
+        flusher = std::thread(&FileSystem::flushLoop, this);
+    }
+    if (verify) {
+        checker = std::thread(&FileSystem::checkLoop, this);
+    }
+    
     while (true) {
         std::cout << "fs:" << currentPath << "> ";
         std::getline(std::cin, command);
@@ -631,11 +5587,16 @@ void FileSystem::run() {
         std::string cmd;
         ss >> cmd;
         
+        // Held until the command is committed, so a writeback never sees
+        // one half done; commandActive covers the times a command lets go
+        // of it to wait for a writeback
+        std::unique_lock<std::mutex> lock(stateMutex);
+        commandActive = true;
         if (cmd == "exit") {
             break;
         } else if (cmd == "touch") {
             std::string filename;
-            unsigned int size = 0;
+            unsigned long long size = 0;
             ss >> filename;
             ss >> size;
             cmdTouch(filename, size);
@@ -672,741 +5633,1784 @@ void FileSystem::run() {
             std::string filename;
             ss >> filename;
             cmdCat(filename);
+        } else if (cmd == "write") {
+            std::string filename, text;
+            unsigned long long offset = 0;
+            ss >> filename >> offset;
+            std::getline(ss, text);
+            if (!text.empty() && text[0] == ' ') {
+                text = text.substr(1);
+            }
+            cmdWrite(filename, offset, text);
+        } else if (cmd == "prealloc") {
+            std::string filename;
+            unsigned long long bytes = 0;
+            ss >> filename >> bytes;
+            cmdPrealloc(filename, bytes);
+        } else if (cmd == "defrag") {
+            std::string path;
+            unsigned int budgetMs = DEFRAG_BUDGET_MS;
+            ss >> path >> budgetMs;
+            cmdDefrag(path, budgetMs);
+        } else if (cmd == "compact") {
+            cmdCompact();
+        } else if (cmd == "compress") {
+            std::string filename;
+            ss >> filename;
+            cmdCompress(filename);
+        } else if (cmd == "snapshot") {
+            std::string action, name;
+            ss >> action >> name;
+            cmdSnapshot(action, name);
+        } else if (cmd == "sync") {
+            cmdSync();
         } else if (cmd == "debug") {
             // Added debug command
             cmdDebug();
         } else {
             std::cout << "Unknown command: " << cmd << "\n";
-            std::cout << "Available commands: exit, touch, rm, mkdir, rmdir, cd, ls, cp, sum, cat, debug\n";
+            std::cout << "Available commands: exit, touch, rm, mkdir, rmdir, cd, ls, cp, sum, cat, write, prealloc, defrag, compact, compress, snapshot, sync, debug\n";
+        }
+        
+        // Each command is one journal transaction, checksums included
+        updateChecksums();
+        commitJournal();
+        commandActive = false;
+        commandDone.notify_all();
+        
+        // Enough waiting data wakes the flusher early, as does a writeback
+        // put off while the command ran
+        if (flusher.joinable() && dirtyBlockCount() + delayedBytes / blockSize >= FLUSH_DIRTY_BLOCKS) {
+            flushRequested = true;
+        }
+        if (flushRequested) {
+            flushWake.notify_one();
+        }
+        
+        if (!checkReport.empty()) {
+            std::cout << checkReport << "\n";
+            checkReport.clear();
+        }
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        stopThreads = true;
+    }
+    commandDone.notify_all();
+    if (flusher.joinable()) {
+        flushWake.notify_one();
+        flusher.join();
+    }
+    if (checker.joinable()) {
+        checker.join();
+    }
+}
+
+void FileSystem::cmdCompact() {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    
+    // Delayed writes get their blocks first so they are moved like the rest
+    flushDelayed();
+    
+    // Empty the tail of the image: first down to the live size plus some
+    // slack, then once more without it to close the remaining gaps. Whatever
+    // cannot move (no room below the cut) just keeps the image larger.
+    unsigned int used = totalBlocks - superBlock->freeBlocks;
+    unsigned int cuts[2] = {static_cast<unsigned int>(std::min<unsigned long long>(totalBlocks, used + used / 16ULL + 16)), used};
+    deferFrees = journalFd >= 0;
+    for (unsigned int cut : cuts) {
+        allocationLimit = cut;
+        relocateInodeTable(cut);
+        for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+            // Inodes that snapshots share map the same blocks for them too
+            uint64_t mask = inodeShared(chunk * INODES_PER_CHUNK) ? 0 : inodeChunk(chunk)->usedMask;
+            while (mask != 0) {
+                unsigned int inodeNum = chunk * INODES_PER_CHUNK + countTrailingZeros(mask);
+                mask &= mask - 1;
+                relocateInode(inodeNum, cut);
+            }
+        }
+    }
+    allocationLimit = 0;
+    deferFrees = false;
+    
+    // Chunks and blocks changed groups: rebuild the in-memory indexes and
+    // the group counters
+    loadInodeMap();
+    buildAllocatorSummary();
+    recountGroups();
+    
+    // Data blocks moved too, which the journal does not carry; the blocks
+    // they left are freed once the checkpoint has written them
+    checkpoint();
+    
+    // The image file is cut after the last block in use when it is saved
+    unsigned long long fileSize = liveImageSize();
+    std::cout << "Compacted: live data ends at block " << fileSize / blockSize << " of " << totalBlocks
+              << "; the image file shrinks to " << fileSize << " of " << imageSize << " bytes on save\n";
+}
+
+std::vector<unsigned int> FileSystem::checksummedBlocks() {
+    // Every block in use with defined contents, in order: the metadata
+    // before the table, the inode maps and added inode chunks, and each
+    // inode's written data and mapping blocks. Snapshots add their maps and
+    // the chunks live no longer uses.
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    std::vector<unsigned int> blocks;
+    for (unsigned int block = 0; block < checksumStart; block++) {
+        blocks.push_back(block);
+    }
+    auto addChunk = [&](unsigned long long offset, uint64_t mask, unsigned int firstInode) {
+        unsigned long long first = offset / blockSize;
+        unsigned long long last = (offset + INODE_CHUNK_SIZE - 1) / blockSize;
+        for (unsigned long long block = first; block <= last && block >= firstDataBlock; block++) {
+            blocks.push_back(static_cast<unsigned int>(block));
+        }
+        
+        while (mask != 0) {
+            Inode inode = readInode(firstInode + countTrailingZeros(mask));
+            mask &= mask - 1;
+            for (const BlockRun& run : getFileRuns(inode)) {
+                for (unsigned int i = 0; i < run.length && !(run.flags & EXTENT_UNWRITTEN); i++) {
+                    blocks.push_back(run.physicalBlock + i);
+                }
+            }
+            for (unsigned int block : getMappingBlocks(inode)) {
+                blocks.push_back(block);
+            }
+        }
+    };
+    blocks.insert(blocks.end(), inodeMapBlocks.begin(), inodeMapBlocks.end());
+    for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+        addChunk(inodeChunkOffsets[chunk], inodeChunk(chunk)->usedMask, chunk * INODES_PER_CHUNK);
+    }
+    for (const auto& view : snapshotViews) {
+        blocks.insert(blocks.end(), view.second.mapBlocks.begin(), view.second.mapBlocks.end());
+    }
+    for (const auto& held : snapshotOnlyChunks()) {
+        SnapshotView& view = snapshotViews[held.first];
+        addChunk(view.chunkOffsets[held.second], viewChunk(view, held.second)->usedMask,
+                 held.first + held.second * INODES_PER_CHUNK);
+    }
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    return blocks;
+}
+
+void FileSystem::checkLoop() {
+    // Body of the checker thread: the group counters against the bitmap,
+    // one group per lock, then the block checksums, a slice per lock.
+    // Blocks freed in the meantime are passed over.
+    const size_t wordsPerGroup = blocksPerGroup / BITS_PER_WORD;
+    const size_t sliceBlocks = 1024;
+    unsigned int checkedGroups = 0;
+    unsigned int badGroups = 0;
+    
+    for (unsigned int group = 0; group < groupCount; group++) {
+        std::unique_lock<std::mutex> lock = lockBetweenCommands();
+        if (stopThreads) {
+            return;
+        }
+        GroupDescriptor* descriptor = groupDescriptor(group);
+        if (descriptor->flags & GROUP_BLOCKS_UNINIT) {
+            continue;
+        }
+        
+        const uint64_t* words = bitmapWords();
+        size_t last = std::min((group + 1) * wordsPerGroup, bitmapWordCount());
+        unsigned int freeBlocks = 0;
+        for (size_t word = group * wordsPerGroup; word < last; word++) {
+            freeBlocks += BITS_PER_WORD - popCount(words[word]);
+        }
+        checkedGroups++;
+        if (freeBlocks != descriptor->freeBlocks) {
+            badGroups++;
+        }
+    }
+    
+    std::vector<unsigned int> blocks;
+    if (checksumStart != 0) {
+        std::unique_lock<std::mutex> lock = lockBetweenCommands();
+        blocks = checksummedBlocks();
+    }
+    size_t checkedBlocks = 0;
+    unsigned int badBlocks = 0;
+    for (size_t start = 0; start < blocks.size(); start += sliceBlocks) {
+        std::unique_lock<std::mutex> lock = lockBetweenCommands();
+        if (stopThreads) {
+            return;
+        }
+        for (size_t i = start; i < std::min(start + sliceBlocks, blocks.size()); i++) {
+            unsigned int block = blocks[i];
+            unsigned int badBlock = 0;
+            if ((bitmapWords()[block / BITS_PER_WORD] & (1ULL << (block % BITS_PER_WORD))) == 0) {
+                continue;
+            }
+            checkedBlocks++;
+            if (!verifyBlocks(block, 1, badBlock)) {
+                badBlocks++;
+            }
+        }
+    }
+    
+    std::unique_lock<std::mutex> lock = lockBetweenCommands();
+    std::ostringstream report;
+    report << "Background check: " << checkedGroups << " block group(s)";
+    if (checksumStart != 0) {
+        report << " and " << checkedBlocks << " block checksum(s)";
+    }
+    if (badGroups + badBlocks == 0) {
+        report << " verified, no problems found";
+    } else {
+        report << " verified; " << badGroups << " group count mismatch(es), " << badBlocks
+               << " checksum mismatch(es), run debug for details";
+    }
+    checkReport = report.str();
+}
+
+void FileSystem::cmdSync() {
+    // Write everything back now instead of waiting for the flusher
+    unsigned long long bytesBefore = writebackBytes;
+    unsigned long long countBefore = writebackCount;
+    if (!writeBack()) {
+        return; // The error was printed
+    }
+    
+    if (writebackCount == countBefore) {
+        std::cout << "Synced: the image was already up to date\n";
+    } else {
+        std::cout << "Synced: wrote " << writebackBytes - bytesBefore << " bytes in " << writebackLastUs << " us\n";
+    }
+    if (writebackCount > 0) {
+        std::cout << "Writeback: " << writebackCount << " writeback(s), average " << writebackTotalUs / writebackCount
+                  << " us, max " << writebackMaxUs << " us; " << writebackBytes << " bytes written to the image\n";
+    }
+}
+
+// Added debug command implementation
+void FileSystem::cmdDebug() {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+    
+    std::cout << "=== File System Debug Information ===" << std::endl;
+    std::cout << "Block size: " << superBlock->blockSize << " bytes" << std::endl;
+    std::cout << "Total blocks: " << superBlock->totalBlocks << std::endl;
+    std::cout << "Free blocks: " << superBlock->freeBlocks << std::endl;
+    std::cout << "First free block: " << superBlock->firstFreeBlock << std::endl;
+    std::cout << "Direct blocks per inode: " << superBlock->directBlocks << std::endl;
+    std::cout << "First data block: " << superBlock->firstDataBlock << std::endl;
+    std::cout << "Total inodes: " << superBlock->maxInodes << std::endl;
+    std::cout << "Free inodes: " << superBlock->freeInodes << std::endl;
+    std::cout << "First free inode: " << superBlock->firstFreeInode << std::endl;
+    
+    std::cout << "Features:" << ((superBlock->features & FEATURE_EXTENTS) ? " extents" : "")
+              << ((superBlock->features & FEATURE_DELALLOC) ? " delalloc" : "")
+              << ((superBlock->features & FEATURE_BUDDY) ? " buddy" : "")
+              << ((superBlock->features & FEATURE_DEDUP) ? " dedup" : "")
+              << ((superBlock->features & FEATURE_REFLINK) ? " reflink" : "")
+              << ((superBlock->features & FEATURE_CHECKSUMS) ? " checksums" : "") << std::endl;
+    std::cout << "Format version: " << superBlock->version << std::endl;
+    std::cout << "Reserved blocks: " << superBlock->reservedBlocks << std::endl;
+    std::cout << "Bitmap: " << superBlock->bitmapBlocks << " block(s) starting at " << superBlock->bitmapStart << std::endl;
+    std::cout << "Block groups: " << superBlock->groupCount << " of " << superBlock->blocksPerGroup
+              << " blocks, descriptors at block " << superBlock->groupTableStart << std::endl;
+    std::cout << "Inode table: " << superBlock->inodeChunks << " chunk(s) of " << INODES_PER_CHUNK
+              << " inodes, inode map in " << inodeMapBlocks.size() << " block(s) starting at "
+              << superBlock->inodeMapStart << std::endl;
+    std::cout << "Writeback: " << dirtyBlockCount() << " data block(s) waiting, " << writebackCount
+              << " writeback(s) (last " << writebackLastUs << " us, max " << writebackMaxUs << " us), "
+              << writebackBytes << " bytes written to the image" << std::endl;
+    if (journalFd >= 0) {
+        std::cout << "Journal: " << journalSize << " bytes since the checkpoint at transaction "
+                  << superBlock->journalSequence << ", last transaction " << journalSequence << std::endl;
+    }
+    
+    // Check block bitmap integrity
+    std::cout << "\nChecking block bitmap integrity..." << std::endl;
+    const uint64_t* words = bitmapWords();
+    unsigned long long used = 0;
+    for (size_t i = 0; i < bitmapWordCount(); i++) {
+        used += popCount(words[i]);
+    }
+    
+    // Padding bits past the last block are always marked used
+    unsigned int padding = static_cast<unsigned int>(bitmapWordCount() * BITS_PER_WORD - totalBlocks);
+    unsigned long long count = totalBlocks + static_cast<unsigned long long>(padding) - used;
+    
+    for (unsigned int block = 0; block < firstDataBlock; block++) {
+        if ((words[block / BITS_PER_WORD] & (1ULL << (block % BITS_PER_WORD))) == 0) {
+            std::cout << "ERROR: Metadata block " << block << " is marked free" << std::endl;
+            break;
+        }
+    }
+    
+    std::cout << "Counted " << count << " free blocks in bitmap (should be " << superBlock->freeBlocks << ")" << std::endl;
+    
+    if (count != superBlock->freeBlocks) {
+        std::cout << "WARNING: Free block count mismatch!" << std::endl;
+    }
+
+    // The buddy index must list exactly the free blocks
+    if (features & FEATURE_BUDDY) {
+        unsigned long long indexed = 0;
+        std::cout << "Buddy free blocks by order:";
+        for (unsigned int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+            std::cout << " " << buddyFree[order].size();
+            indexed += static_cast<unsigned long long>(buddyFree[order].size()) << order;
+            for (unsigned int block : buddyFree[order]) {
+                for (unsigned int i = 0; i < (1U << order); i++) {
+                    if (words[(block + i) / BITS_PER_WORD] & (1ULL << ((block + i) % BITS_PER_WORD))) {
+                        std::cout << std::endl << "ERROR: Buddy block " << block << " lists used block " << (block + i);
+                        break;
+                    }
+                }
+            }
+        }
+        std::cout << std::endl;
+        std::cout << "Counted " << indexed << " free blocks in buddy index (should be " << superBlock->freeBlocks << ")" << std::endl;
+        if (indexed != superBlock->freeBlocks) {
+            std::cout << "WARNING: Buddy index mismatch!" << std::endl;
+        }
+    }
+
+    // Every extra reference to a block must come from another file using it
+    if (refcountStart != 0) {
+        std::unordered_map<unsigned int, unsigned int> uses;
+        auto countUses = [&](uint64_t mask, unsigned int firstInode) {
+            while (mask != 0) {
+                unsigned int inodeNum = firstInode + countTrailingZeros(mask);
+                mask &= mask - 1;
+                Inode inode = readInode(inodeNum);
+                for (const BlockRun& run : getFileRuns(inode)) {
+                    for (unsigned int i = 0; i < run.length; i++) {
+                        uses[run.physicalBlock + i]++;
+                    }
+                }
+                for (unsigned int block : getMappingBlocks(inode)) {
+                    uses[block]++;
+                }
+            }
+        };
+        for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+            countUses(inodeChunk(chunk)->usedMask, chunk * INODES_PER_CHUNK);
+        }
+        // Chunks shared with live are counted once, through live
+        for (const auto& held : snapshotOnlyChunks()) {
+            countUses(viewChunk(snapshotViews[held.first], held.second)->usedMask, held.first + held.second * INODES_PER_CHUNK);
+        }
+        
+        const uint16_t* refs = blockRefs();
+        unsigned long long shared = 0;
+        unsigned long long extra = 0;
+        unsigned int wrong = 0;
+        for (unsigned int block = firstDataBlock; block < totalBlocks; block++) {
+            auto use = uses.find(block);
+            unsigned int expected = (use == uses.end()) ? 0 : use->second - 1;
+            if (refs[block] != 0) {
+                shared++;
+                extra += refs[block];
+            }
+            if (refs[block] != expected && wrong++ < 5) {
+                std::cout << "ERROR: Block " << block << " has " << refs[block] << " extra reference(s), "
+                          << expected << " expected" << std::endl;
+            }
+        }
+        std::cout << "Counted " << shared << " shared block(s) with " << extra << " extra reference(s)" << std::endl;
+        if (wrong > 0) {
+            std::cout << "WARNING: " << wrong << " reference count mismatch(es)!" << std::endl;
+        }
+    }
+    
+    // Every block in use with defined contents must match its checksum:
+    // the metadata before the table, the inode map and added inode chunks,
+    // and each inode's written data and mapping blocks
+    if (checksumStart != 0) {
+        std::cout << "\nChecking block checksums..." << std::endl;
+        std::vector<unsigned int> blocks = checksummedBlocks();
+        
+        unsigned int bad = 0;
+        for (unsigned int block : blocks) {
+            unsigned int badBlock = 0;
+            if (!verifyBlocks(block, 1, badBlock) && bad++ < 5) {
+                std::cout << "ERROR: Block " << block << " does not match its checksum" << std::endl;
+            }
+        }
+        std::cout << "Verified " << blocks.size() - bad << " of " << blocks.size() << " block checksum(s), table of "
+                  << firstDataBlock - checksumStart << " block(s) at block " << checksumStart << std::endl;
+        if (bad > 0) {
+            std::cout << "WARNING: " << bad << " checksum mismatch(es)!" << std::endl;
+        }
+    }
+    
+    // Check inode map integrity
+    unsigned int usedInodes = 0;
+    for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+        usedInodes += popCount(inodeChunk(chunk)->usedMask);
+    }
+    unsigned int freeInodes = superBlock->maxInodes - usedInodes;
+    std::cout << "Counted " << freeInodes << " free inodes in inode map (should be " << superBlock->freeInodes << ")" << std::endl;
+    
+    if (freeInodes != superBlock->freeInodes) {
+        std::cout << "WARNING: Free inode count mismatch!" << std::endl;
+    }
+    
+    // Check each group's counters against its slice of the bitmap and its chunks
+    std::cout << "\nChecking block group counters..." << std::endl;
+    size_t wordsPerGroup = blocksPerGroup / BITS_PER_WORD;
+    for (unsigned int group = 0; group < groupCount; group++) {
+        GroupDescriptor* descriptor = groupDescriptor(group);
+        
+        unsigned int groupFreeBlocks = 0;
+        size_t last = std::min((group + 1) * wordsPerGroup, bitmapWordCount());
+        for (size_t word = group * wordsPerGroup; word < last; word++) {
+            groupFreeBlocks += BITS_PER_WORD - popCount(words[word]);
+        }
+        
+        unsigned int groupFreeInodes = 0;
+        for (unsigned int chunk : groupChunks[group]) {
+            groupFreeInodes += INODES_PER_CHUNK - popCount(inodeChunk(chunk)->usedMask);
+        }
+        
+        // Small images list every group; large ones only report mismatches
+        bool uninit = (descriptor->flags & GROUP_BLOCKS_UNINIT) != 0;
+        if (groupCount <= 16) {
+            std::cout << "Group " << group << ": " << descriptor->freeBlocks << " free blocks, "
+                      << descriptor->freeInodes << " free inodes, " << descriptor->directories << " directories"
+                      << (uninit ? " (never allocated from)" : "") << std::endl;
+        }
+        if (uninit && groupFreeBlocks != std::min(blocksPerGroup, totalBlocks - groupStart(group))) {
+            std::cout << "WARNING: Group " << group << " is marked never allocated from but has blocks in use" << std::endl;
         }
+        if (groupFreeBlocks != descriptor->freeBlocks || groupFreeInodes != descriptor->freeInodes) {
+            std::cout << "WARNING: Group " << group << " counts " << groupFreeBlocks << " free blocks and "
+                      << groupFreeInodes << " free inodes" << std::endl;
+        }
+    }
+}
+
+void FileSystem::cmdTouch(const std::string& filename, unsigned long long size) {
+    // Get parent directory and filename
+    auto [parentInode, name] = getParentInodeAndFilename(filename);
+    
+    if (parentInode == -1) {
+        std::cout << "Error: Invalid path\n";
+        return;
+    }
+    
+    if (isSnapshot(parentInode)) {
+        std::cout << "Error: Snapshots are read-only\n";
+        return;
+    }
+    
+    // Check if file already exists
+    if (findDirectoryEntry(parentInode, name) != -1) {
+        std::cout << "Error: File already exists\n";
+        return;
+    }
+    
+    // FIXED: Check if file size is too large
+    bool useExtents = (features & FEATURE_EXTENTS) != 0;
+    unsigned long long maxBlocks = useExtents ? 0xFFFFFFFFULL : maxMappedBlocks();
+    
+    if ((size + blockSize - 1) / blockSize > maxBlocks) {
+        std::cout << "Error: File size too large. Maximum size is " 
+                  << maxBlocks * blockSize << " bytes\n";
+        return;
+    }
+    
+    // Allocate inode for the new file, in its directory's group
+    unsigned int newInode = allocateInode(inodeGroup(parentInode));
+    if (newInode == INVALID_INODE) {
+        std::cout << "Error: No free inodes\n";
+        return;
+    }
+    
+    // Initialize the file inode
+    Inode inode = readInode(newInode);
+    inode.type = 0; // File
+    inode.size = size;
+    
+    // The file starts as one hole: blocks are allocated only when written.
+    // Tiny files live in the inode itself.
+    if (size <= INLINE_DATA_SIZE) {
+        inode.flags |= INODE_INLINE;
+    } else if (useExtents) {
+        inode.flags |= INODE_EXTENTS;
+    }
+    
+    // Write the inode
+    writeInode(newInode, inode);
+    
+    // Add entry to parent directory
+    if (!addDirectoryEntry(parentInode, name, newInode)) {
+        freeInodeBlocks(inode);
+        deallocateInode(newInode);
+        std::cout << "Error: Could not add directory entry\n";
+        return;
+    }
+    
+    std::cout << "Created file: " << filename << " (size: " << size << " bytes)\n";
+}
+
+void FileSystem::cmdRm(const std::string& filename) {
+    // Get parent directory and filename
+    auto [parentInode, name] = getParentInodeAndFilename(filename);
+    
+    if (parentInode == -1) {
+        std::cout << "Error: Invalid path\n";
+        return;
+    }
+    
+    if (isSnapshot(parentInode)) {
+        std::cout << "Error: Snapshots are read-only\n";
+        return;
+    }
+    
+    // Find the file
+    int fileInode = findDirectoryEntry(parentInode, name);
+    if (fileInode == -1) {
+        std::cout << "Error: File not found\n";
+        return;
+    }
+    
+    // Check if it's a file
+    Inode inode = readInode(fileInode);
+    if (inode.type != 0) {
+        std::cout << "Error: Not a file\n";
+        return;
+    }
+    
+    // Snapshots sharing the inode keep their own copy before its blocks go
+    if (!preserveInode(fileInode)) {
+        return;
+    }
+    
+    // Remove directory entry
+    if (!removeDirectoryEntry(parentInode, name)) {
+        std::cout << "Error: Could not remove directory entry\n";
+        return;
     }
+    
+    // Drop buffered writes, then free data runs and mapping blocks
+    discardDelayed(fileInode);
+    freeInodeBlocks(inode);
+    
+    // Free inode
+    deallocateInode(fileInode);
+    
+    std::cout << "Removed file: " << filename << "\n";
 }
 
-// Added debug command implementation
-void FileSystem::cmdDebug() {
-    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
+void FileSystem::cmdMkdir(const std::string& dirname) {
+    // Get parent directory and dirname
+    auto [parentInode, name] = getParentInodeAndFilename(dirname);
     
-    std::cout << "=== File System Debug Information ===" << std::endl;
-    std::cout << "Block size: " << superBlock->blockSize << " bytes" << std::endl;
-    std::cout << "Total blocks: " << superBlock->totalBlocks << std::endl;
-    std::cout << "Free blocks: " << superBlock->freeBlocks << std::endl;
-    std::cout << "First free block: " << superBlock->firstFreeBlock << std::endl;
-    std::cout << "Total inodes: " << superBlock->maxInodes << std::endl;
-    std::cout << "Free inodes: " << superBlock->freeInodes << std::endl;
-    std::cout << "First free inode: " << superBlock->firstFreeInode << std::endl;
+    if (parentInode == -1) {
+        std::cout << "Error: Invalid path\n";
+        return;
+    }
     
-    // Check free block list integrity
-    std::cout << "\nChecking free block list integrity..." << std::endl;
-    unsigned int count = 0;
-    unsigned int block = superBlock->firstFreeBlock;
+    if (isSnapshot(parentInode)) {
+        std::cout << "Error: Snapshots are read-only\n";
+        return;
+    }
     
-    while (block != 0 && count < superBlock->freeBlocks) {
-        if (block >= TOTAL_BLOCKS) {
-            std::cout << "ERROR: Invalid block in free list: " << block << std::endl;
-            break;
-        }
-        
-        unsigned int* nextBlock = reinterpret_cast<unsigned int*>(memory + block * BLOCK_SIZE);
-        block = *nextBlock;
-        count++;
-        
-        if (count > superBlock->totalBlocks) {
-            std::cout << "ERROR: Possible cycle in free block list" << std::endl;
-            break;
-        }
+    // Check if directory already exists
+    if (findDirectoryEntry(parentInode, name) != -1) {
+        std::cout << "Error: Directory already exists\n";
+        return;
     }
     
-    std::cout << "Counted " << count << " blocks in free list (should be " << superBlock->freeBlocks << ")" << std::endl;
+    // Check if we have enough free blocks
+    if (availableBlocks() < 1) {
+        std::cout << "Error: Not enough free blocks\n";
+        return;
+    }
     
-    if (count != superBlock->freeBlocks) {
-        std::cout << "WARNING: Free block count mismatch!" << std::endl;
+    // Allocate inode for the new directory
+    unsigned int newInode = allocateInode(findDirectoryGroup(parentInode), true);
+    if (newInode == INVALID_INODE) {
+        std::cout << "Error: No free inodes\n";
+        return;
+    }
+    
+    // Initialize the directory inode
+    Inode inode = readInode(newInode);
+    inode.type = 1; // Directory
+    inode.size = 0;
+    
+    // Allocate a block for the directory
+    unsigned int newBlock = allocateBlockRun(1, groupStart(inodeGroup(newInode)));
+    if (newBlock == 0) {
+        deallocateInode(newInode);
+        std::cout << "Error: Not enough free blocks\n";
+        return;
+    }
+    
+    journalBlock(newBlock, true);
+    inode.blockAddresses[0] = newBlock;
+    writeInode(newInode, inode);
+    
+    // Initialize directory with . and .. entries
+    initializeDirectory(newInode, parentInode);
+    
+    // Add entry to parent directory
+    if (!addDirectoryEntry(parentInode, name, newInode)) {
+        // Cleanup
+        deallocateBlock(newBlock);
+        deallocateInode(newInode);
+        std::cout << "Error: Could not add directory entry\n";
+        return;
     }
+    
+    std::cout << "Created directory: " << dirname << "\n";
 }
 
-void FileSystem::cmdTouch(const std::string& filename, unsigned int size) {
-    // Get parent directory and filename
-    auto [parentInode, name] = getParentInodeAndFilename(filename);
+void FileSystem::cmdRmdir(const std::string& dirname) {
+    // Get parent directory and dirname
+    auto [parentInode, name] = getParentInodeAndFilename(dirname);
     
     if (parentInode == -1) {
         std::cout << "Error: Invalid path\n";
         return;
     }
     
-    // Check if file already exists
-    if (findDirectoryEntry(parentInode, name) != -1) {
-        std::cout << "Error: File already exists\n";
+    if (isSnapshot(parentInode)) {
+        std::cout << "Error: Snapshots are read-only\n";
         return;
     }
     
-    // FIXED: Check if file size is too large
-    unsigned int blocksNeeded = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    unsigned int maxBlocks = DIRECT_BLOCKS + (BLOCK_SIZE / sizeof(unsigned int));
+    // Find the directory
+    int dirInode = findDirectoryEntry(parentInode, name);
+    if (dirInode == -1) {
+        std::cout << "Error: Directory not found\n";
+        return;
+    }
     
-    if (blocksNeeded > maxBlocks) {
-        std::cout << "Error: File size too large. Maximum size is " 
-                  << maxBlocks * BLOCK_SIZE << " bytes\n";
+    // Check if it's a directory
+    Inode inode = readInode(dirInode);
+    if (inode.type != 1) {
+        std::cout << "Error: Not a directory\n";
         return;
     }
     
-    // Check if we have enough free blocks
-    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
-    unsigned int indirectBlockNeeded = (blocksNeeded > DIRECT_BLOCKS) ? 1 : 0;
-    if (superBlock->freeBlocks < blocksNeeded + indirectBlockNeeded) {
-        std::cout << "Error: Not enough free blocks. Need " << blocksNeeded + indirectBlockNeeded
-                  << ", have " << superBlock->freeBlocks << "\n";
+    // Check if directory is empty (only . and .. entries)
+    std::vector<DirectoryEntry> entries = readDirectoryEntries(dirInode);
+    if (entries.size() > 2) {
+        std::cout << "Error: Directory not empty\n";
+        return;
+    }
+    if (!preserveInode(dirInode)) {
         return;
     }
     
-    // Allocate inode for the new file
-    unsigned int newInode = allocateInode();
-    if (newInode == MAX_INODES) {
-        std::cout << "Error: No free inodes\n";
+    // Remove directory entry from parent
+    if (!removeDirectoryEntry(parentInode, name)) {
+        std::cout << "Error: Could not remove directory entry\n";
         return;
     }
     
-    // Initialize the file inode
-    Inode inode = readInode(newInode);
-    inode.type = 0; // File
-    inode.size = size;
+    // Free data runs and mapping blocks
+    freeInodeBlocks(inode);
     
-    // Calculate number of blocks needed
-    unsigned int directBlocks = std::min<unsigned int>(blocksNeeded, DIRECT_BLOCKS);
+    // Free inode
+    deallocateInode(dirInode);
     
-    // Allocate direct blocks with better error handling
-    bool allocationFailed = false;
-    for (unsigned int i = 0; i < directBlocks; i++) {
-        unsigned int newBlock = allocateBlock();
-        if (newBlock == 0) {
-            allocationFailed = true;
-            std::cout << "Debug: Failed to allocate direct block " << i << std::endl;
-            break;
-        }
-        
-        inode.blockAddresses[i] = newBlock;
+    std::cout << "Removed directory: " << dirname << "\n";
+}
+
+void FileSystem::cmdCd(const std::string& path) {
+    if (path.empty()) {
+        return;
     }
     
-    // If direct block allocation failed, clean up and return
-    if (allocationFailed) {
-        for (unsigned int i = 0; i < directBlocks; i++) {
-            if (inode.blockAddresses[i] != 0) {
-                deallocateBlock(inode.blockAddresses[i]);
-            }
-        }
-        deallocateInode(newInode);
-        std::cout << "Error: Failed to allocate blocks for file\n";
+    int inodeNum = getInodeFromPath(path);
+    if (inodeNum == -1) {
+        std::cout << "Error: Invalid path\n";
         return;
     }
     
-    // Allocate indirect blocks if needed
-    if (blocksNeeded > DIRECT_BLOCKS) {
-        // Allocate indirect block
-        unsigned int indirectBlock = allocateBlock();
-        if (indirectBlock == 0) {
-            // Cleanup allocated blocks
-            for (unsigned int i = 0; i < directBlocks; i++) {
-                deallocateBlock(inode.blockAddresses[i]);
-            }
-            deallocateInode(newInode);
-            std::cout << "Error: Failed to allocate indirect block\n";
-            return;
-        }
-        
-        inode.indirectBlock = indirectBlock;
-        
-        // Allocate blocks pointed to by indirect block
-        unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(memory + indirectBlock * BLOCK_SIZE);
-        unsigned int indirectBlocks = blocksNeeded - DIRECT_BLOCKS;
-        
-        for (unsigned int i = 0; i < indirectBlocks; i++) {
-            unsigned int newBlock = allocateBlock();
-            if (newBlock == 0) {
-                // Cleanup allocated blocks
-                for (unsigned int j = 0; j < i; j++) {
-                    deallocateBlock(indirectBlockData[j]);
-                }
-                deallocateBlock(indirectBlock);
-                for (unsigned int j = 0; j < directBlocks; j++) {
-                    deallocateBlock(inode.blockAddresses[j]);
-                }
-                deallocateInode(newInode);
-                std::cout << "Error: Failed to allocate indirect data block\n";
-                return;
-            }
-            
-            indirectBlockData[i] = newBlock;
-        }
+    // Check if it's a directory
+    Inode inode = readInode(inodeNum);
+    if (inode.type != 1) {
+        std::cout << "Error: Not a directory\n";
+        return;
     }
     
-    // Write the inode
-    writeInode(newInode, inode);
+    // Update current directory
+    currentInodeNumber = inodeNum;
     
-    // Add entry to parent directory
-    if (!addDirectoryEntry(parentInode, name, newInode)) {
-        // Cleanup allocated blocks
-        for (unsigned int i = 0; i < directBlocks; i++) {
-            deallocateBlock(inode.blockAddresses[i]);
+    // Update current path
+    if (path[0] == '/') {
+        // Absolute path
+        currentPath = path;
+    } else {
+        // Relative path
+        if (currentPath == "/") {
+            currentPath += path;
+        } else {
+            currentPath += "/" + path;
         }
-        
-        if (inode.indirectBlock != 0) {
-            unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(memory + inode.indirectBlock * BLOCK_SIZE);
-            unsigned int indirectBlocks = blocksNeeded - DIRECT_BLOCKS;
-            
-            for (unsigned int i = 0; i < indirectBlocks; i++) {
-                if (indirectBlockData[i] != 0) {
-                    deallocateBlock(indirectBlockData[i]);
-                }
+    }
+    
+    // Normalize path (remove . and ..)
+    std::vector<std::string> components = parsePath(currentPath);
+    std::vector<std::string> normalizedComponents;
+    
+    for (const std::string& component : components) {
+        if (component == ".") {
+            continue;
+        } else if (component == "..") {
+            if (!normalizedComponents.empty()) {
+                normalizedComponents.pop_back();
             }
-            deallocateBlock(inode.indirectBlock);
+        } else {
+            normalizedComponents.push_back(component);
         }
-        
-        deallocateInode(newInode);
-        std::cout << "Error: Could not add directory entry\n";
+    }
+    
+    currentPath = "/";
+    for (const std::string& component : normalizedComponents) {
+        if (!component.empty()) {
+            currentPath += component + "/";
+        }
+    }
+    
+    // Remove trailing slash except for root
+    if (currentPath.length() > 1 && currentPath.back() == '/') {
+        currentPath.pop_back();
+    }
+}
+
+void FileSystem::cmdLs(const std::string& path) {
+    int inodeNum;
+    
+    if (path.empty()) {
+        inodeNum = currentInodeNumber;
+    } else {
+        inodeNum = getInodeFromPath(path);
+    }
+    
+    if (inodeNum == -1) {
+        std::cout << "Error: Invalid path\n";
+        return;
+    }
+    
+    // Check if it's a directory
+    Inode inode = readInode(inodeNum);
+    if (inode.type != 1) {
+        std::cout << "Error: Not a directory\n";
         return;
     }
     
-    std::cout << "Created file: " << filename << " (size: " << size << " bytes, blocks: " << blocksNeeded << ")\n";
+    // Read directory entries
+    std::vector<DirectoryEntry> entries = readDirectoryEntries(inodeNum);
+    
+    // Sort entries by name
+    std::sort(entries.begin(), entries.end(), [](const DirectoryEntry& a, const DirectoryEntry& b) {
+        return strcmp(a.name, b.name) < 0;
+    });
+    
+    // Print directory entries
+    std::cout << "Contents of " << (path.empty() ? currentPath : path) << ":\n";
+    std::cout << "Name                           Type       Size       Modified\n";
+    std::cout << "------------------------------------------------------------\n";
+    
+    for (const DirectoryEntry& entry : entries) {
+        Inode entryInode = readInode(entry.inodeNumber);
+        
+        // Format modification time
+        char timeStr[20];
+        struct tm* timeInfo = localtime(&entryInode.modificationTime);
+        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeInfo);
+        
+        std::cout << std::left << std::setw(30) << entry.name;
+        std::cout << std::left << std::setw(10) << (entryInode.type == 0 ? "File" : "Directory");
+        std::cout << std::right << std::setw(10) << entryInode.size;
+        std::cout << "  " << timeStr << "\n";
+    }
 }
 
-void FileSystem::cmdRm(const std::string& filename) {
-    // Get parent directory and filename
-    auto [parentInode, name] = getParentInodeAndFilename(filename);
+void FileSystem::cmdCopyFile(const std::string& src, const std::string& dest) {
+    // Get source file inode
+    int srcInodeNum = getInodeFromPath(src);
+    if (srcInodeNum == -1) {
+        std::cout << "Error: Source file not found\n";
+        return;
+    }
     
-    if (parentInode == -1) {
-        std::cout << "Error: Invalid path\n";
+    // Buffered writes must reach their blocks before they can be copied
+    flushFile(srcInodeNum);
+    
+    // Check if source is a file
+    Inode srcInode = readInode(srcInodeNum);
+    if (srcInode.type != 0) {
+        std::cout << "Error: Source is not a file\n";
         return;
     }
     
-    // Find the file
-    int fileInode = findDirectoryEntry(parentInode, name);
-    if (fileInode == -1) {
-        std::cout << "Error: File not found\n";
+    // Get destination parent directory and filename
+    auto [destParentInode, destName] = getParentInodeAndFilename(dest);
+    if (destParentInode == -1) {
+        std::cout << "Error: Invalid destination path\n";
         return;
     }
     
-    // Check if it's a file
-    Inode inode = readInode(fileInode);
-    if (inode.type != 0) {
-        std::cout << "Error: Not a file\n";
+    if (isSnapshot(destParentInode)) {
+        std::cout << "Error: Snapshots are read-only\n";
         return;
     }
     
-    // Remove directory entry
-    if (!removeDirectoryEntry(parentInode, name)) {
-        std::cout << "Error: Could not remove directory entry\n";
+    // Check if destination already exists
+    if (findDirectoryEntry(destParentInode, destName) != -1) {
+        std::cout << "Error: Destination file already exists\n";
         return;
     }
     
-    // Free blocks
-    for (unsigned int i = 0; i < DIRECT_BLOCKS; i++) {
-        if (inode.blockAddresses[i] != 0) {
-            deallocateBlock(inode.blockAddresses[i]);
+    // Count the source blocks and where they sit in the file. Unwritten
+    // blocks read as zeros, so the copy leaves them as holes. Reflinked
+    // files and compressed clusters are copied separately below.
+    bool useExtents = (features & FEATURE_EXTENTS) != 0;
+    bool reflink = canReflink(srcInode);
+    bool packed = (srcInode.flags & INODE_COMPRESSED) && !(srcInode.flags & INODE_INLINE);
+    std::vector<BlockRun> srcRuns;
+    for (const BlockRun& run : getFileRuns(srcInode)) {
+        if (!(run.flags & EXTENT_UNWRITTEN) && !packed && !reflink) {
+            srcRuns.push_back(run);
         }
     }
     
-    // Free indirect blocks
-    if (inode.indirectBlock != 0) {
-        unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(memory + inode.indirectBlock * BLOCK_SIZE);
-        
-        for (unsigned int i = 0; i < BLOCK_SIZE / sizeof(unsigned int); i++) {
-            if (indirectBlockData[i] != 0) {
-                deallocateBlock(indirectBlockData[i]);
+    // Damaged source blocks are not copied on under a fresh checksum
+    if (!reflink) {
+        for (const BlockRun& run : getFileRuns(srcInode)) {
+            unsigned int badBlock = 0;
+            if (!(run.flags & EXTENT_UNWRITTEN) && !verifyBlocks(run.physicalBlock, run.length, badBlock)) {
+                std::cout << "Error: Checksum mismatch in block " << badBlock << " of the source file\n";
+                return;
             }
         }
-        
-        deallocateBlock(inode.indirectBlock);
     }
     
-    // Free inode
-    deallocateInode(fileInode);
-    
-    std::cout << "Removed file: " << filename << "\n";
-}
-
-void FileSystem::cmdMkdir(const std::string& dirname) {
-    // Get parent directory and dirname
-    auto [parentInode, name] = getParentInodeAndFilename(dirname);
+    unsigned int blocksNeeded = 0;
+    unsigned long long lastLogical = 0;
+    for (const BlockRun& run : srcRuns) {
+        blocksNeeded += run.length;
+        lastLogical = static_cast<unsigned long long>(run.logicalBlock) + run.length - 1;
+    }
     
-    if (parentInode == -1) {
-        std::cout << "Error: Invalid path\n";
+    if (!useExtents && blocksNeeded > 0 && lastLogical >= maxMappedBlocks()) {
+        std::cout << "Error: Source file is too large for a block-mapped copy\n";
         return;
     }
     
-    // Check if directory already exists
-    if (findDirectoryEntry(parentInode, name) != -1) {
-        std::cout << "Error: Directory already exists\n";
-        return;
+    // A block-mapped source needs exactly as many pointer blocks as it has
+    unsigned int indirectBlockNeeded = 0;
+    if (!useExtents) {
+        indirectBlockNeeded = (srcInode.flags & INODE_EXTENTS)
+            ? mappingBlocksFor(blocksNeeded > 0 ? lastLogical + 1 : 0)
+            : static_cast<unsigned int>(getMappingBlocks(srcInode).size());
     }
     
     // Check if we have enough free blocks
-    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
-    if (superBlock->freeBlocks < 1) {
-        std::cout << "Error: Not enough free blocks\n";
+    if (availableBlocks() < blocksNeeded + indirectBlockNeeded) {
+        std::cout << "Error: Not enough free blocks. Need " << blocksNeeded + indirectBlockNeeded 
+                  << ", have " << availableBlocks() << "\n";
         return;
     }
     
-    // Allocate inode for the new directory
-    unsigned int newInode = allocateInode();
-    if (newInode == MAX_INODES) {
+    // Allocate inode for the destination file
+    unsigned int destInodeNum = allocateInode(inodeGroup(destParentInode));
+    if (destInodeNum == INVALID_INODE) {
         std::cout << "Error: No free inodes\n";
         return;
     }
     
-    // Initialize the directory inode
-    Inode inode = readInode(newInode);
-    inode.type = 1; // Directory
-    inode.size = 0;
+    // Initialize the destination file inode
+    Inode destInode = readInode(destInodeNum);
+    destInode.type = 0; // File
+    destInode.size = srcInode.size;
     
-    // Allocate a block for the directory
-    unsigned int newBlock = allocateBlock();
-    if (newBlock == 0) {
-        deallocateInode(newInode);
-        std::cout << "Error: Not enough free blocks\n";
+    // Inline data is copied along with the inode
+    if (srcInode.flags & INODE_INLINE) {
+        destInode.flags |= INODE_INLINE;
+        memcpy(destInode.blockAddresses, srcInode.blockAddresses, sizeof(destInode.blockAddresses));
+        useExtents = false;
+    }
+    
+    // A compressed file stays compressed
+    if (srcInode.flags & INODE_COMPRESSED) {
+        destInode.flags |= INODE_COMPRESSED;
+    }
+    
+    // With reference counts the copy shares the source's blocks
+    if (reflink) {
+        useExtents = false;
+        if (!reflinkFile(srcInode, destInode)) {
+            deallocateInode(destInodeNum);
+            std::cout << "Error: Failed to allocate blocks for file copy\n";
+            return;
+        }
+        indirectBlockNeeded = 0; // The copy's pointer blocks are in place already
+    } else if (packed) {
+        useExtents = false;
+        if (!copyClusters(srcInode, destInode, groupStart(inodeGroup(destInodeNum)))) {
+            deallocateInode(destInodeNum);
+            std::cout << "Error: Failed to allocate blocks for file copy\n";
+            return;
+        }
+    }
+    
+    // Allocate every destination block in one call, contiguous when possible.
+    // Data blocks are copied over whole, so they are not cleared first.
+    std::vector<unsigned int> blocks;
+    if (!allocateBlocks(blocksNeeded + indirectBlockNeeded, blocks, groupStart(inodeGroup(destInodeNum)), false)) {
+        deallocateInode(destInodeNum);
+        std::cout << "Error: Failed to allocate blocks for file copy\n";
         return;
     }
     
-    inode.blockAddresses[0] = newBlock;
-    writeInode(newInode, inode);
+    // Map the destination block by block; pointer blocks are taken from the
+    // allocation as the walk first needs them, and cleared
+    std::vector<BlockRun> destRuns;
+    size_t next = 0;
+    std::function<unsigned int()> takeBlock = [this, &blocks, &next]() {
+        memset(blockAt(blocks[next]), 0, blockSize);
+        return blocks[next++];
+    };
+    BlockMapCursor cursor;
+    
+    for (const BlockRun& run : srcRuns) {
+        for (unsigned int i = 0; i < run.length; i++) {
+            if (!useExtents) {
+                unsigned int* slot = getBlockSlot(destInode, run.logicalBlock + i, cursor, takeBlock);
+                *slot = blocks[next];
+            }
+            appendRun(destRuns, run.logicalBlock + i, blocks[next++]);
+        }
+    }
     
-    // Initialize directory with . and .. entries
-    initializeDirectory(newInode, parentInode);
+    // A sparse extent-mapped source may need fewer pointer blocks than estimated
+    if (next < blocks.size()) {
+        deallocateBlocks(std::vector<unsigned int>(blocks.begin() + next, blocks.end()));
+        blocks.resize(next);
+    }
+    
+    // Copy spans that are contiguous in both files with one memcpy each
+    size_t srcIndex = 0, destIndex = 0;
+    unsigned int srcDone = 0, destDone = 0;
+    while (srcIndex < srcRuns.size() && destIndex < destRuns.size()) {
+        const BlockRun& srcRun = srcRuns[srcIndex];
+        const BlockRun& destRun = destRuns[destIndex];
+        unsigned int span = std::min(srcRun.length - srcDone, destRun.length - destDone);
+        
+        memcpy(blockAt(destRun.physicalBlock + destDone), blockAt(srcRun.physicalBlock + srcDone),
+               static_cast<size_t>(span) * blockSize);
+        markCopied(destRun.physicalBlock + destDone, srcRun.physicalBlock + srcDone, span);
+        
+        srcDone += span;
+        destDone += span;
+        if (srcDone == srcRun.length) {
+            srcIndex++;
+            srcDone = 0;
+        }
+        if (destDone == destRun.length) {
+            destIndex++;
+            destDone = 0;
+        }
+    }
+    
+    if (useExtents) {
+        std::vector<Extent> extents;
+        for (const BlockRun& run : destRuns) {
+            extents.push_back({run.logicalBlock, run.physicalBlock, run.length, 0});
+        }
+        
+        if (!writeExtents(destInode, extents)) {
+            deallocateBlocks(blocks);
+            deallocateInode(destInodeNum);
+            std::cout << "Error: Failed to allocate extent blocks for file copy\n";
+            return;
+        }
+    }
+    
+    // Write the destination inode; its blocks are then shared with the source
+    writeInode(destInodeNum, destInode);
+    dedupBlocks(destInodeNum, destInode, 0, 0xFFFFFFFF);
     
     // Add entry to parent directory
-    if (!addDirectoryEntry(parentInode, name, newInode)) {
-        // Cleanup
-        deallocateBlock(newBlock);
-        deallocateInode(newInode);
+    if (!addDirectoryEntry(destParentInode, destName, destInodeNum)) {
+        freeInodeBlocks(destInode);
+        deallocateInode(destInodeNum);
         std::cout << "Error: Could not add directory entry\n";
         return;
     }
     
-    std::cout << "Created directory: " << dirname << "\n";
+    std::cout << "Copied file: " << src << " -> " << dest << "\n";
 }
 
-void FileSystem::cmdRmdir(const std::string& dirname) {
-    // Get parent directory and dirname
-    auto [parentInode, name] = getParentInodeAndFilename(dirname);
+void FileSystem::cmdSum() {
+    SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
     
-    if (parentInode == -1) {
-        std::cout << "Error: Invalid path\n";
-        return;
+    unsigned int totalBlocks = superBlock->totalBlocks;
+    unsigned int freeBlocks = superBlock->freeBlocks;
+    unsigned int usedBlocks = totalBlocks - freeBlocks;
+    
+    unsigned int totalInodes = superBlock->maxInodes;
+    unsigned int freeInodes = superBlock->freeInodes;
+    unsigned int usedInodes = totalInodes - freeInodes;
+    
+    unsigned long long totalSpace = static_cast<unsigned long long>(totalBlocks) * blockSize;
+    unsigned long long freeSpace = static_cast<unsigned long long>(freeBlocks) * blockSize;
+    unsigned long long usedSpace = static_cast<unsigned long long>(usedBlocks) * blockSize;
+    
+    std::cout << "File System Summary:\n";
+    std::cout << "-------------------\n";
+    std::cout << "Total space: " << totalSpace << " bytes (" << totalBlocks << " blocks)\n";
+    std::cout << "Used space: " << usedSpace << " bytes (" << usedBlocks << " blocks, " 
+              << std::fixed << std::setprecision(1) << (usedBlocks * 100.0 / totalBlocks) << "%)\n";
+    std::cout << "Free space: " << freeSpace << " bytes (" << freeBlocks << " blocks, " 
+              << std::fixed << std::setprecision(1) << (freeBlocks * 100.0 / totalBlocks) << "%)\n";
+    std::cout << "Inodes: " << usedInodes << " used, " << freeInodes << " free, " << totalInodes << " total\n";
+    if (refcountStart != 0) {
+        const uint16_t* refs = blockRefs();
+        unsigned int shared = 0;
+        unsigned long long saved = 0;
+        for (unsigned int block = firstDataBlock; block < totalBlocks; block++) {
+            if (refs[block] != 0) {
+                shared++;
+                saved += refs[block];
+            }
+        }
+        std::cout << "Shared blocks: " << shared << ", saving " << saved << " block(s)\n";
+    }
+    if (features & FEATURE_DELALLOC) {
+        std::cout << "Delayed allocation: " << superBlock->reservedBlocks << " blocks reserved for "
+                  << delayedBytes << " buffered bytes in " << delayedFiles.size() << " file(s)\n";
     }
     
-    // Find the directory
-    int dirInode = findDirectoryEntry(parentInode, name);
-    if (dirInode == -1) {
-        std::cout << "Error: Directory not found\n";
-        return;
+    // Logical size counts holes; physical size is the blocks actually mapped
+    unsigned int fileCount = 0;
+    unsigned long long logicalSize = 0;
+    unsigned long long physicalBlocks = 0;
+    unsigned int compressedFiles = 0;
+    unsigned long long unpackedBytes = 0;
+    unsigned long long packedBytes = 0;
+    for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+        uint64_t used = inodeChunk(chunk)->usedMask;
+        while (used != 0) {
+            unsigned int inodeNum = chunk * INODES_PER_CHUNK + countTrailingZeros(used);
+            used &= used - 1;
+            
+            Inode inode = readInode(inodeNum);
+            if (inode.type != 0) {
+                continue;
+            }
+            
+            fileCount++;
+            logicalSize += inode.size;
+            for (const BlockRun& run : getFileRuns(inode)) {
+                physicalBlocks += run.length;
+            }
+            physicalBlocks += getMappingBlocks(inode).size();
+            
+            // Data held by compressed files against the blocks storing it
+            if ((inode.flags & INODE_COMPRESSED) && !(inode.flags & INODE_INLINE)) {
+                compressedFiles++;
+                for (const Extent& extent : readExtents(inode)) {
+                    unsigned long long stored = static_cast<unsigned long long>(extent.length) * blockSize;
+                    packedBytes += stored;
+                    unpackedBytes += (extent.flags & EXTENT_COMPRESSED)
+                        ? reinterpret_cast<const ClusterHeader*>(blockAt(extent.physicalBlock))->rawBytes : stored;
+                }
+            }
+        }
     }
     
-    // Check if it's a directory
-    Inode inode = readInode(dirInode);
-    if (inode.type != 1) {
-        std::cout << "Error: Not a directory\n";
+    std::cout << "Files: " << fileCount << ", logical size " << logicalSize << " bytes, physical size "
+              << physicalBlocks * blockSize << " bytes (" << physicalBlocks << " blocks)\n";
+    if (compressedFiles > 0) {
+        std::cout << "Compressed files: " << compressedFiles << ", " << unpackedBytes << " bytes of data stored in "
+                  << packedBytes << " bytes (ratio " << std::fixed << std::setprecision(2)
+                  << (packedBytes > 0 ? static_cast<double>(unpackedBytes) / packedBytes : 1.0) << ":1)\n";
+    }
+    if (superBlock->snapshotDir != 0) {
+        // Each snapshot's files, whether or not it shares them with live
+        unsigned int snapshotFiles = 0;
+        for (const auto& view : snapshotViews) {
+            for (unsigned int chunk = 0; chunk < view.second.chunkOffsets.size(); chunk++) {
+                for (uint64_t used = viewChunk(view.second, chunk)->usedMask; used != 0; used &= used - 1) {
+                    if (readInode(view.first + chunk * INODES_PER_CHUNK + countTrailingZeros(used)).type == 0) {
+                        snapshotFiles++;
+                    }
+                }
+            }
+        }
+        std::cout << "Snapshots: " << snapshotViews.size() << ", holding " << snapshotFiles << " file(s)\n";
+    }
+}
+
+void FileSystem::cmdCat(const std::string& filename) {
+    // Get file inode
+    int inodeNum = getInodeFromPath(filename);
+    if (inodeNum == -1) {
+        std::cout << "Error: File not found\n";
         return;
     }
     
-    // Check if directory is empty (only . and .. entries)
-    std::vector<DirectoryEntry> entries = readDirectoryEntries(dirInode);
-    if (entries.size() > 2) {
-        std::cout << "Error: Directory not empty\n";
+    // Reads see the blocks, so place any buffered writes first
+    flushFile(inodeNum);
+    
+    // Check if it's a file
+    Inode inode = readInode(inodeNum);
+    if (inode.type != 0) {
+        std::cout << "Error: Not a file\n";
         return;
     }
     
-    // Remove directory entry from parent
-    if (!removeDirectoryEntry(parentInode, name)) {
-        std::cout << "Error: Could not remove directory entry\n";
+    // Print file contents
+    std::cout << "Contents of " << filename << " (" << inode.size << " bytes):\n";
+    
+    if (inode.flags & INODE_INLINE) {
+        std::cout.write(reinterpret_cast<const char*>(inode.blockAddresses), inode.size);
+        std::cout << std::endl;
         return;
     }
     
-    // Free blocks
-    for (unsigned int i = 0; i < DIRECT_BLOCKS; i++) {
-        if (inode.blockAddresses[i] != 0) {
-            deallocateBlock(inode.blockAddresses[i]);
+    // Compressed files are unpacked one cluster at a time
+    if (inode.flags & INODE_COMPRESSED) {
+        std::vector<Extent> extents = readExtents(inode);
+        std::vector<char> cluster(static_cast<size_t>(CLUSTER_BLOCKS) * blockSize);
+        for (unsigned long long position = 0; position < inode.size; position += cluster.size()) {
+            if (!readCluster(extents, static_cast<unsigned int>(position / blockSize), cluster.data())) {
+                std::cout << "\nError: Damaged compressed cluster at block " << position / blockSize << "\n";
+                return;
+            }
+            std::cout.write(cluster.data(), static_cast<std::streamsize>(std::min<unsigned long long>(inode.size - position, cluster.size())));
         }
+        std::cout << std::endl;
+        return;
     }
     
-    // Free indirect blocks
-    if (inode.indirectBlock != 0) {
-        unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(memory + inode.indirectBlock * BLOCK_SIZE);
+    // Holes read as zeros
+    std::vector<char> zeros(blockSize, 0);
+    auto writeZeros = [&zeros](unsigned long long count) {
+        while (count > 0) {
+            size_t chunk = static_cast<size_t>(std::min<unsigned long long>(count, zeros.size()));
+            std::cout.write(zeros.data(), chunk);
+            count -= chunk;
+        }
+    };
+    
+    // Write whole runs of contiguous blocks at once
+    unsigned long long position = 0;
+    for (const BlockRun& run : getFileRuns(inode)) {
+        unsigned long long runStart = static_cast<unsigned long long>(run.logicalBlock) * blockSize;
+        if (runStart >= inode.size) {
+            break;
+        }
+        
+        writeZeros(runStart - position);
         
-        for (unsigned int i = 0; i < BLOCK_SIZE / sizeof(unsigned int); i++) {
-            if (indirectBlockData[i] != 0) {
-                deallocateBlock(indirectBlockData[i]);
+        unsigned long long runBytes = static_cast<unsigned long long>(run.length) * blockSize;
+        unsigned long long bytesToRead = std::min(inode.size - runStart, runBytes);
+        
+        // Print block data; unwritten blocks read as zeros. Checked blocks
+        // are printed in pieces that are still in the cache when copied out.
+        if (run.flags & EXTENT_UNWRITTEN) {
+            writeZeros(bytesToRead);
+        } else {
+            unsigned int pieceBlocks = std::max(1U, CHECKSUM_PIECE_BYTES / blockSize);
+            for (unsigned long long done = 0; done < bytesToRead;) {
+                unsigned int first = static_cast<unsigned int>(done / blockSize);
+                unsigned long long pieceBytes = std::min(bytesToRead - done, static_cast<unsigned long long>(pieceBlocks) * blockSize);
+                unsigned int badBlock = 0;
+                if (!verifyBlocks(run.physicalBlock + first, static_cast<unsigned int>((pieceBytes + blockSize - 1) / blockSize), badBlock)) {
+                    std::cout << "\nError: Checksum mismatch in block " << badBlock << " (file block "
+                              << run.logicalBlock + (badBlock - run.physicalBlock) << ")\n";
+                    return;
+                }
+                std::cout.write(blockAt(run.physicalBlock + first), pieceBytes);
+                done += pieceBytes;
             }
         }
         
-        deallocateBlock(inode.indirectBlock);
+        position = runStart + bytesToRead;
     }
+    writeZeros(inode.size - position);
     
-    // Free inode
-    deallocateInode(dirInode);
-    
-    std::cout << "Removed directory: " << dirname << "\n";
+    std::cout << std::endl;
 }
 
-void FileSystem::cmdCd(const std::string& path) {
-    if (path.empty()) {
-        return;
-    }
-    
-    int inodeNum = getInodeFromPath(path);
+void FileSystem::cmdWrite(const std::string& filename, unsigned long long offset, const std::string& text) {
+    // Get file inode
+    int inodeNum = getInodeFromPath(filename);
     if (inodeNum == -1) {
-        std::cout << "Error: Invalid path\n";
+        std::cout << "Error: File not found\n";
         return;
     }
     
-    // Check if it's a directory
+    // Check if it's a file
     Inode inode = readInode(inodeNum);
-    if (inode.type != 1) {
-        std::cout << "Error: Not a directory\n";
+    if (inode.type != 0) {
+        std::cout << "Error: Not a file\n";
         return;
     }
     
-    // Update current directory
-    currentInodeNumber = inodeNum;
-    
-    // Update current path
-    if (path[0] == '/') {
-        // Absolute path
-        currentPath = path;
-    } else {
-        // Relative path
-        if (currentPath == "/") {
-            currentPath += path;
-        } else {
-            currentPath += "/" + path;
-        }
-    }
-    
-    // Normalize path (remove . and ..)
-    std::vector<std::string> components = parsePath(currentPath);
-    std::vector<std::string> normalizedComponents;
-    
-    for (const std::string& component : components) {
-        if (component == ".") {
-            continue;
-        } else if (component == "..") {
-            if (!normalizedComponents.empty()) {
-                normalizedComponents.pop_back();
-            }
-        } else {
-            normalizedComponents.push_back(component);
-        }
+    if (isSnapshot(inodeNum)) {
+        std::cout << "Error: Snapshots are read-only\n";
+        return;
     }
-    
-    currentPath = "/";
-    for (const std::string& component : normalizedComponents) {
-        if (!component.empty()) {
-            currentPath += component + "/";
-        }
+    if (!preserveInode(inodeNum)) {
+        return;
     }
     
-    // Remove trailing slash except for root
-    if (currentPath.length() > 1 && currentPath.back() == '/') {
-        currentPath.pop_back();
+    if (!writeFile(inodeNum, offset, text.data(), text.size())) {
+        std::cout << "Error: Failed to allocate blocks for write\n";
+        return;
     }
+    
+    std::cout << "Wrote " << text.size() << " bytes to " << filename << " at offset " << offset << "\n";
 }
 
-void FileSystem::cmdLs(const std::string& path) {
-    int inodeNum;
-    
-    if (path.empty()) {
-        inodeNum = currentInodeNumber;
-    } else {
-        inodeNum = getInodeFromPath(path);
-    }
-    
+void FileSystem::cmdPrealloc(const std::string& filename, unsigned long long bytes) {
+    // Get file inode
+    int inodeNum = getInodeFromPath(filename);
     if (inodeNum == -1) {
-        std::cout << "Error: Invalid path\n";
+        std::cout << "Error: File not found\n";
         return;
     }
     
-    // Check if it's a directory
+    // Check if it's a file
     Inode inode = readInode(inodeNum);
-    if (inode.type != 1) {
-        std::cout << "Error: Not a directory\n";
+    if (inode.type != 0) {
+        std::cout << "Error: Not a file\n";
         return;
     }
     
-    // Read directory entries
-    std::vector<DirectoryEntry> entries = readDirectoryEntries(inodeNum);
-    
-    // Sort entries by name
-    std::sort(entries.begin(), entries.end(), [](const DirectoryEntry& a, const DirectoryEntry& b) {
-        return strcmp(a.name, b.name) < 0;
-    });
+    if (isSnapshot(inodeNum)) {
+        std::cout << "Error: Snapshots are read-only\n";
+        return;
+    }
+    if (!preserveInode(inodeNum)) {
+        return;
+    }
     
-    // Print directory entries
-    std::cout << "Contents of " << (path.empty() ? currentPath : path) << ":\n";
-    std::cout << "Name                           Type       Size       Modified\n";
-    std::cout << "------------------------------------------------------------\n";
+    if (inode.flags & INODE_COMPRESSED) {
+        std::cout << "Error: Compressed files cannot be preallocated\n";
+        return;
+    }
     
-    for (const DirectoryEntry& entry : entries) {
-        Inode entryInode = readInode(entry.inodeNumber);
-        
-        // Format modification time
-        char timeStr[20];
-        struct tm* timeInfo = localtime(&entryInode.modificationTime);
-        strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", timeInfo);
-        
-        std::cout << std::left << std::setw(30) << entry.name;
-        std::cout << std::left << std::setw(10) << (entryInode.type == 0 ? "File" : "Directory");
-        std::cout << std::right << std::setw(10) << entryInode.size;
-        std::cout << "  " << timeStr << "\n";
+    // The first bytes of the file get blocks; the size stays as it is
+    if (!preallocateFile(inodeNum, 0, bytes)) {
+        std::cout << "Error: Failed to preallocate blocks\n";
+        return;
     }
+    
+    std::cout << "Preallocated " << bytes << " bytes for " << filename << "\n";
 }
 
-void FileSystem::cmdCopyFile(const std::string& src, const std::string& dest) {
-    // Get source file inode
-    int srcInodeNum = getInodeFromPath(src);
-    if (srcInodeNum == -1) {
-        std::cout << "Error: Source file not found\n";
+void FileSystem::cmdCompress(const std::string& filename) {
+    // Get file inode
+    int inodeNum = getInodeFromPath(filename);
+    if (inodeNum == -1) {
+        std::cout << "Error: File not found\n";
         return;
     }
     
-    // Check if source is a file
-    Inode srcInode = readInode(srcInodeNum);
-    if (srcInode.type != 0) {
-        std::cout << "Error: Source is not a file\n";
+    // Check if it's a file
+    Inode inode = readInode(inodeNum);
+    if (inode.type != 0) {
+        std::cout << "Error: Not a file\n";
         return;
     }
     
-    // Get destination parent directory and filename
-    auto [destParentInode, destName] = getParentInodeAndFilename(dest);
-    if (destParentInode == -1) {
-        std::cout << "Error: Invalid destination path\n";
+    if (isSnapshot(inodeNum)) {
+        std::cout << "Error: Snapshots are read-only\n";
         return;
     }
-    
-    // Check if destination already exists
-    if (findDirectoryEntry(destParentInode, destName) != -1) {
-        std::cout << "Error: Destination file already exists\n";
+    if (!preserveInode(inodeNum)) {
         return;
     }
     
-    // Calculate number of blocks needed
-    unsigned int blocksNeeded = (srcInode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    unsigned int indirectBlockNeeded = (blocksNeeded > DIRECT_BLOCKS) ? 1 : 0;
+    // The data already written is packed now, later writes as they happen
+    if (!compressFile(inodeNum)) {
+        std::cout << "Error: Not enough free blocks to compress file\n";
+        return;
+    }
     
-    // Check if we have enough free blocks
+    unsigned long long stored = 0;
+    for (const BlockRun& run : getFileRuns(readInode(inodeNum))) {
+        stored += run.length;
+    }
+    std::cout << "Compressed " << filename << ": " << inode.size << " bytes stored in " << stored << " block(s)\n";
+}
+
+void FileSystem::cmdSnapshot(const std::string& action, const std::string& name) {
     SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
-    if (superBlock->freeBlocks < blocksNeeded + indirectBlockNeeded) {
-        std::cout << "Error: Not enough free blocks. Need " << blocksNeeded + indirectBlockNeeded 
-                  << ", have " << superBlock->freeBlocks << "\n";
+    
+    if (action != "create" && action != "list" && action != "delete" && action != "restore") {
+        std::cout << "Usage: snapshot create|delete|restore NAME, snapshot list\n";
         return;
     }
     
-    // Allocate inode for the destination file
-    unsigned int destInodeNum = allocateInode();
-    if (destInodeNum == MAX_INODES) {
-        std::cout << "Error: No free inodes\n";
+    // Snapshot files share their blocks with the live ones through the reference counts
+    if (refcountStart == 0) {
+        std::cout << "Error: Snapshots need an image formatted with --reflink or --dedup\n";
         return;
     }
     
-    // Initialize the destination file inode
-    Inode destInode = readInode(destInodeNum);
-    destInode.type = 0; // File
-    destInode.size = srcInode.size;
+    // The first map block of each snapshot records when it was taken
+    auto createdAt = [this](const SnapshotView& view) {
+        int64_t created = 0;
+        memcpy(&created, reinterpret_cast<ChainBlockHeader*>(blockAt(view.mapStart))->reserved, sizeof(created));
+        return static_cast<time_t>(created);
+    };
+    unsigned int runBlocks = std::max(INODE_CHUNK_SIZE, blockSize) / blockSize;
+    std::set<unsigned long long> liveChunks(inodeChunkOffsets.begin(), inodeChunkOffsets.end());
+    
+    if (action == "list") {
+        std::vector<DirectoryEntry> entries;
+        if (superBlock->snapshotDir != 0) {
+            entries = readDirectoryEntries(superBlock->snapshotDir);
+        }
+        std::sort(entries.begin(), entries.end(), [](const DirectoryEntry& a, const DirectoryEntry& b) {
+            return strcmp(a.name, b.name) < 0;
+        });
+        
+        // Own blocks: the snapshot's inode map, and the inode chunks no one
+        // else holds any more with the blocks only their inodes use
+        std::cout << "Name                           Files     Own blocks  Created\n";
+        std::cout << "------------------------------------------------------------\n";
+        const uint16_t* refs = blockRefs();
+        for (const DirectoryEntry& entry : entries) {
+            const SnapshotView& view = snapshotViews[entry.inodeNumber];
+            std::vector<unsigned int> files;
+            collectFiles(entry.inodeNumber, files);
+            
+            unsigned long long ownBlocks = view.mapBlocks.size();
+            for (unsigned int chunk = 0; chunk < view.chunkOffsets.size(); chunk++) {
+                unsigned long long offset = view.chunkOffsets[chunk];
+                if (liveChunks.count(offset) != 0 || chunkSharers[offset] > 1) {
+                    continue;
+                }
+                ownBlocks += runBlocks;
+                for (uint64_t used = viewChunk(view, chunk)->usedMask; used != 0; used &= used - 1) {
+                    Inode inode = readInode(entry.inodeNumber + chunk * INODES_PER_CHUNK + countTrailingZeros(used));
+                    for (const BlockRun& run : getFileRuns(inode)) {
+                        for (unsigned int i = 0; i < run.length; i++) {
+                            ownBlocks += refs[run.physicalBlock + i] == 0;
+                        }
+                    }
+                    for (unsigned int block : getMappingBlocks(inode)) {
+                        ownBlocks += refs[block] == 0;
+                    }
+                }
+            }
+            
+            time_t created = createdAt(view);
+            char timeStr[20];
+            strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", localtime(&created));
+            std::cout << std::left << std::setw(30) << entry.name << " " << std::right << std::setw(5) << files.size()
+                      << std::setw(15) << ownBlocks << "  " << timeStr << "\n";
+        }
+        return;
+    }
+    
+    if (name.empty() || name.length() >= MAX_FILENAME_LENGTH || name == "." || name == ".." ||
+        name.find('/') != std::string::npos) {
+        std::cout << "Error: Invalid snapshot name\n";
+        return;
+    }
     
-    // Calculate number of direct blocks
-    unsigned int directBlocks = std::min<unsigned int>(blocksNeeded, DIRECT_BLOCKS);
+    // Buffered writes reach their blocks first, so both sides see them
+    flushDelayed();
     
-    // Allocate direct blocks
-    bool allocationFailed = false;
-    for (unsigned int i = 0; i < directBlocks; i++) {
-        unsigned int newBlock = allocateBlock();
-        if (newBlock == 0) {
-            allocationFailed = true;
-            break;
+    int snapshotRoot = superBlock->snapshotDir != 0 ? findDirectoryEntry(superBlock->snapshotDir, name) : -1;
+    if (action == "create") {
+        if (snapshotRoot != -1) {
+            std::cout << "Error: Snapshot already exists\n";
+            return;
+        }
+        
+        // The directory holding the snapshots is made with the first one
+        if (superBlock->snapshotDir == 0) {
+            unsigned int snapshotDir = createDirectory(0);
+            if (snapshotDir == INVALID_INODE) {
+                std::cout << "Error: Not enough free blocks or inodes for snapshot\n";
+                return;
+            }
+            Inode dirInode = readInode(snapshotDir);
+            dirInode.flags |= INODE_SNAPSHOT;
+            writeInode(snapshotDir, dirInode);
+            superBlock->snapshotDir = snapshotDir;
+        }
+        
+        // The snapshot gets a copy of the inode map; the chunks it lists,
+        // and the directories and data behind them, stay shared until live
+        // changes them
+        std::vector<unsigned int> mapBlocks;
+        if (!allocateBlocks(static_cast<unsigned int>(inodeMapBlocks.size()), mapBlocks, inodeMapBlocks[0], false)) {
+            std::cout << "Error: Not enough free blocks for snapshot\n";
+            return;
         }
+        for (size_t i = 0; i < mapBlocks.size(); i++) {
+            journalBlock(mapBlocks[i], true);
+            memcpy(blockAt(mapBlocks[i]), blockAt(inodeMapBlocks[i]), blockSize);
+            reinterpret_cast<ChainBlockHeader*>(blockAt(mapBlocks[i]))->nextBlock = i + 1 < mapBlocks.size() ? mapBlocks[i + 1] : 0;
+        }
+        int64_t created = time(nullptr);
+        memcpy(reinterpret_cast<ChainBlockHeader*>(blockAt(mapBlocks[0]))->reserved, &created, sizeof(created));
         
-        destInode.blockAddresses[i] = newBlock;
+        // The snapshot directory itself stays out of the snapshot
+        unsigned int dirChunk = superBlock->snapshotDir / INODES_PER_CHUNK;
+        InodeChunk* dirEntry = reinterpret_cast<InodeChunk*>(blockAt(mapBlocks[dirChunk / chunksPerMapBlock()]) +
+                                                             sizeof(ChainBlockHeader)) + dirChunk % chunksPerMapBlock();
+        dirEntry->usedMask &= ~(1ULL << (superBlock->snapshotDir % INODES_PER_CHUNK));
         
-        // Copy data
-        if (srcInode.blockAddresses[i] != 0) {
-            memcpy(memory + newBlock * BLOCK_SIZE, memory + srcInode.blockAddresses[i] * BLOCK_SIZE, BLOCK_SIZE);
+        unsigned int base = addSnapshotView(mapBlocks[0]);
+        if (base == 0) {
+            deallocateBlocks(mapBlocks);
+            std::cout << "Error: Too many snapshots\n";
+            return;
+        }
+        if (!addDirectoryEntry(superBlock->snapshotDir, name, mapBlocks[0])) {
+            removeSnapshotView(base);
+            deallocateBlocks(mapBlocks);
+            std::cout << "Error: Not enough free blocks for snapshot\n";
+            return;
         }
+        
+        std::cout << "Created snapshot: " << name << "\n";
+        return;
     }
     
-    if (allocationFailed) {
-        // Cleanup allocated blocks
-        for (unsigned int i = 0; i < directBlocks; i++) {
-            if (destInode.blockAddresses[i] != 0) {
-                deallocateBlock(destInode.blockAddresses[i]);
+    if (snapshotRoot == -1) {
+        std::cout << "Error: Snapshot not found\n";
+        return;
+    }
+    unsigned int base = static_cast<unsigned int>(snapshotRoot);
+    SnapshotView& view = snapshotViews[base];
+    
+    if (action == "delete") {
+        // Free the chunks only this snapshot still holds, with what their
+        // inodes alone use
+        for (unsigned int chunk = 0; chunk < view.chunkOffsets.size(); chunk++) {
+            unsigned long long offset = view.chunkOffsets[chunk];
+            if (liveChunks.count(offset) != 0 || chunkSharers[offset] > 1) {
+                continue;
+            }
+            for (uint64_t used = viewChunk(view, chunk)->usedMask; used != 0; used &= used - 1) {
+                freeInodeBlocks(readInode(base + chunk * INODES_PER_CHUNK + countTrailingZeros(used)));
             }
+            deallocateBlockRun(static_cast<unsigned int>(offset / blockSize), runBlocks);
         }
-        deallocateInode(destInodeNum);
-        std::cout << "Error: Failed to allocate blocks for file copy\n";
+        deallocateBlocks(view.mapBlocks);
+        removeDirectoryEntry(superBlock->snapshotDir, name);
+        removeSnapshotView(base);
+        
+        // Leave the snapshot if the shell was inside it
+        std::string inside = std::string("/") + SNAPSHOT_PREFIX + "/" + name;
+        if (currentPath == inside || currentPath.compare(0, inside.size() + 1, inside + "/") == 0) {
+            currentInodeNumber = 0;
+            currentPath = "/";
+        }
+        std::cout << "Deleted snapshot: " << name << "\n";
         return;
     }
     
-    // Allocate indirect blocks if needed
-    if (blocksNeeded > DIRECT_BLOCKS) {
-        // Allocate indirect block
-        unsigned int indirectBlock = allocateBlock();
-        if (indirectBlock == 0) {
-            // Cleanup allocated blocks
-            for (unsigned int i = 0; i < directBlocks; i++) {
-                deallocateBlock(destInode.blockAddresses[i]);
+    // Restore: only the live chunks that differ from the snapshot's change.
+    // Inode numbers match between the two, so directories need no rewriting.
+    std::vector<unsigned int> differing;
+    for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+        if (chunk >= view.chunkOffsets.size() || view.chunkOffsets[chunk] != inodeChunkOffsets[chunk]) {
+            differing.push_back(chunk);
+        }
+    }
+    
+    // The restored files take one more reference on every block
+    for (unsigned int chunk : differing) {
+        for (uint64_t used = chunk < view.chunkOffsets.size() ? viewChunk(view, chunk)->usedMask : 0; used != 0;
+             used &= used - 1) {
+            Inode inode = readInode(base + chunk * INODES_PER_CHUNK + countTrailingZeros(used));
+            if (inode.type == 0 && !(inode.flags & INODE_INLINE) && !canReflink(inode)) {
+                std::cout << "Error: Block reference count limit reached; cannot restore snapshot\n";
+                return;
             }
-            deallocateInode(destInodeNum);
-            std::cout << "Error: Failed to allocate indirect block for file copy\n";
+        }
+    }
+    
+    // Other snapshots sharing the live chunks keep them
+    for (unsigned int chunk : differing) {
+        if (!preserveChunk(chunk)) {
             return;
         }
-        
-        destInode.indirectBlock = indirectBlock;
-        
-        // Copy indirect block data
-        if (srcInode.indirectBlock != 0) {
-            unsigned int* srcIndirectBlockData = reinterpret_cast<unsigned int*>(memory + srcInode.indirectBlock * BLOCK_SIZE);
-            unsigned int* destIndirectBlockData = reinterpret_cast<unsigned int*>(memory + indirectBlock * BLOCK_SIZE);
-            
-            unsigned int indirectBlocks = blocksNeeded - DIRECT_BLOCKS;
-            
-            for (unsigned int i = 0; i < indirectBlocks; i++) {
-                if (srcIndirectBlockData[i] != 0) {
-                    unsigned int newBlock = allocateBlock();
-                    if (newBlock == 0) {
-                        // Cleanup allocated blocks
-                        for (unsigned int j = 0; j < i; j++) {
-                            if (destIndirectBlockData[j] != 0) {
-                                deallocateBlock(destIndirectBlockData[j]);
-                            }
-                        }
-                        deallocateBlock(indirectBlock);
-                        for (unsigned int j = 0; j < directBlocks; j++) {
-                            deallocateBlock(destInode.blockAddresses[j]);
-                        }
-                        deallocateInode(destInodeNum);
-                        std::cout << "Error: Failed to allocate indirect data block for file copy\n";
-                        return;
+    }
+    
+    // Stage the snapshot's chunks with their own hold on what they map, so
+    // running out of space leaves the live tree untouched
+    std::vector<std::vector<char>> staged;
+    for (unsigned int chunk : differing) {
+        if (chunk >= view.chunkOffsets.size()) {
+            break;
+        }
+        const char* source = memory + view.chunkOffsets[chunk];
+        staged.emplace_back(source, source + INODE_CHUNK_SIZE);
+        uint64_t used = viewChunk(view, chunk)->usedMask;
+        for (uint64_t mask = used; mask != 0; mask &= mask - 1) {
+            if (!shareInode(*reinterpret_cast<Inode*>(staged.back().data() + countTrailingZeros(mask) * INODE_SIZE))) {
+                // Undo the chunks staged so far, then this one's first inodes
+                for (size_t i = 0; i < staged.size(); i++) {
+                    uint64_t done = viewChunk(view, differing[i])->usedMask;
+                    if (i + 1 == staged.size()) {
+                        done &= ~mask;
+                    }
+                    for (; done != 0; done &= done - 1) {
+                        freeInodeBlocks(*reinterpret_cast<Inode*>(staged[i].data() + countTrailingZeros(done) * INODE_SIZE));
                     }
-                    
-                    destIndirectBlockData[i] = newBlock;
-                    
-                    // Copy data
-                    memcpy(memory + newBlock * BLOCK_SIZE, memory + srcIndirectBlockData[i] * BLOCK_SIZE, BLOCK_SIZE);
                 }
+                std::cout << "Error: Not enough free blocks to restore snapshot\n";
+                return;
             }
         }
     }
     
-    // Write the destination inode
-    writeInode(destInodeNum, destInode);
-    
-    // Add entry to parent directory
-    if (!addDirectoryEntry(destParentInode, destName, destInodeNum)) {
-        // Cleanup allocated blocks
-        for (unsigned int i = 0; i < directBlocks; i++) {
-            deallocateBlock(destInode.blockAddresses[i]);
+    // Swap the staged chunks in, keeping the snapshot directory in place
+    unsigned int snapshotDir = superBlock->snapshotDir;
+    for (size_t i = 0; i < differing.size(); i++) {
+        unsigned int chunk = differing[i];
+        unsigned long long offset = inodeChunkOffsets[chunk];
+        InodeChunk* entry = inodeChunk(chunk);
+        for (uint64_t used = entry->usedMask; used != 0; used &= used - 1) {
+            unsigned int inodeNum = chunk * INODES_PER_CHUNK + countTrailingZeros(used);
+            if (inodeNum != snapshotDir) {
+                discardDelayed(inodeNum);
+                freeInodeBlocks(readInode(inodeNum));
+            }
         }
         
-        if (destInode.indirectBlock != 0) {
-            unsigned int* destIndirectBlockData = reinterpret_cast<unsigned int*>(memory + destInode.indirectBlock * BLOCK_SIZE);
-            unsigned int indirectBlocks = blocksNeeded - DIRECT_BLOCKS;
-            
-            for (unsigned int i = 0; i < indirectBlocks; i++) {
-                if (destIndirectBlockData[i] != 0) {
-                    deallocateBlock(destIndirectBlockData[i]);
-                }
+        for (unsigned long long block = offset / blockSize; block <= (offset + INODE_CHUNK_SIZE - 1) / blockSize; block++) {
+            journalBlock(static_cast<unsigned int>(block));
+        }
+        uint64_t used = 0;
+        if (i < staged.size()) {
+            Inode dirInode = readInode(snapshotDir);
+            memcpy(memory + offset, staged[i].data(), INODE_CHUNK_SIZE);
+            used = viewChunk(view, chunk)->usedMask;
+            if (snapshotDir / INODES_PER_CHUNK == chunk) {
+                memcpy(inodeSlot(snapshotDir), &dirInode, sizeof(Inode));
             }
-            deallocateBlock(destInode.indirectBlock);
         }
-        
-        deallocateInode(destInodeNum);
-        std::cout << "Error: Could not add directory entry\n";
-        return;
+        if (snapshotDir / INODES_PER_CHUNK == chunk) {
+            used |= 1ULL << (snapshotDir % INODES_PER_CHUNK);
+        }
+        journalBlock(inodeMapBlocks[chunk / chunksPerMapBlock()]);
+        entry->usedMask = used;
     }
     
-    std::cout << "Copied file: " << src << " -> " << dest << "\n";
+    // Inode counts follow the restored map
+    unsigned int usedInodes = 0;
+    for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+        usedInodes += popCount(inodeChunk(chunk)->usedMask);
+    }
+    superBlock->freeInodes = superBlock->maxInodes - usedInodes;
+    superBlock->firstFreeInode = 0;
+    loadInodeMap();
+    recountGroups();
+    
+    currentInodeNumber = 0;
+    currentPath = "/";
+    std::cout << "Restored snapshot: " << name << "\n";
 }
 
-void FileSystem::cmdSum() {
+void FileSystem::cmdDefrag(const std::string& path, unsigned int budgetMs) {
     SuperBlock* superBlock = reinterpret_cast<SuperBlock*>(memory);
     
-    unsigned int totalBlocks = superBlock->totalBlocks;
-    unsigned int freeBlocks = superBlock->freeBlocks;
-    unsigned int usedBlocks = totalBlocks - freeBlocks;
+    // Every file, or the file or directory tree given
+    int target = -1;
+    std::vector<unsigned int> files;
+    if (path.empty()) {
+        for (unsigned int chunk = 0; chunk < superBlock->inodeChunks; chunk++) {
+            uint64_t used = inodeChunk(chunk)->usedMask;
+            while (used != 0) {
+                unsigned int inodeNum = chunk * INODES_PER_CHUNK + countTrailingZeros(used);
+                used &= used - 1;
+                if (readInode(inodeNum).type == 0) {
+                    files.push_back(inodeNum);
+                }
+            }
+        }
+    } else {
+        target = getInodeFromPath(path);
+        if (target == -1) {
+            std::cout << "Error: Path not found\n";
+            return;
+        }
+        if (isSnapshot(target)) {
+            std::cout << "Error: Snapshots are read-only\n";
+            return;
+        }
+        if (readInode(target).type == 0) {
+            files.push_back(target);
+        } else {
+            collectFiles(target, files);
+        }
+    }
+    std::sort(files.begin(), files.end());
     
-    unsigned int totalInodes = superBlock->maxInodes;
-    unsigned int freeInodes = superBlock->freeInodes;
-    unsigned int usedInodes = totalInodes - freeInodes;
+    // The same target resumes where the last run ran out of time
+    if (target != defragTarget) {
+        defragTarget = target;
+        defragNext = 0;
+    }
     
-    unsigned int totalSpace = totalBlocks * BLOCK_SIZE;
-    unsigned int freeSpace = freeBlocks * BLOCK_SIZE;
-    unsigned int usedSpace = usedBlocks * BLOCK_SIZE;
+    auto report = [this, &files](const char* label) {
+        unsigned int fragments = 0;
+        unsigned int fragmented = 0;
+        for (unsigned int inodeNum : files) {
+            unsigned int count = countFragments(readInode(inodeNum));
+            fragments += count;
+            if (count > 1) {
+                fragmented++;
+            }
+        }
+        std::cout << label << ": " << fragments << " fragment(s) in " << files.size() << " file(s), "
+                  << fragmented << " fragmented\n";
+    };
+    
+    report("Before");
+    
+    // Relocate files in inode order until the budget is used up; at least
+    // one file is handled per run so repeated runs always finish
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(budgetMs);
+    unsigned int relocated = 0;
+    unsigned int blocksMoved = 0;
+    bool processed = false;
+    bool finished = true;
+    
+    // A file's old blocks are not reused before the checkpoint below
+    deferFrees = journalFd >= 0;
+    for (unsigned int inodeNum : files) {
+        if (inodeNum < defragNext) {
+            continue;
+        }
+        if (processed && std::chrono::steady_clock::now() >= deadline) {
+            defragNext = inodeNum;
+            finished = false;
+            break;
+        }
+        
+        if (defragFile(inodeNum, blocksMoved)) {
+            relocated++;
+        }
+        processed = true;
+    }
+    if (finished) {
+        defragNext = 0;
+    }
+    deferFrees = false;
     
-    std::cout << "File System Summary:\n";
-    std::cout << "-------------------\n";
-    std::cout << "Total space: " << totalSpace << " bytes (" << totalBlocks << " blocks)\n";
-    std::cout << "Used space: " << usedSpace << " bytes (" << usedBlocks << " blocks, " 
-              << std::fixed << std::setprecision(1) << (usedBlocks * 100.0 / totalBlocks) << "%)\n";
-    std::cout << "Free space: " << freeSpace << " bytes (" << freeBlocks << " blocks, " 
-              << std::fixed << std::setprecision(1) << (freeBlocks * 100.0 / totalBlocks) << "%)\n";
-    std::cout << "Inodes: " << usedInodes << " used, " << freeInodes << " free, " << totalInodes << " total\n";
+    // Moved data blocks are not in the journal: write the image back, which
+    // frees the blocks they left
+    if (blocksMoved > 0) {
+        checkpoint();
+    }
+    
+    std::cout << "Relocated " << relocated << " file(s), " << blocksMoved << " block(s) moved\n";
+    report("After");
+    if (!finished) {
+        std::cout << "Time budget of " << budgetMs << " ms used up; run defrag again to continue\n";
+    }
 }
 
-void FileSystem::cmdCat(const std::string& filename) {
-    // Get file inode
-    int inodeNum = getInodeFromPath(filename);
-    if (inodeNum == -1) {
-        std::cout << "Error: File not found\n";
-        return;
+// Parse a byte count with an optional K/M/G suffix
+static bool parseSize(const std::string& text, unsigned long long& value) {
+    if (text.empty()) {
+        return false;
     }
     
-    // Check if it's a file
-    Inode inode = readInode(inodeNum);
-    if (inode.type != 0) {
-        std::cout << "Error: Not a file\n";
-        return;
+    size_t pos = 0;
+    try {
+        value = std::stoull(text, &pos);
+    } catch (...) {
+        return false;
     }
     
-    // Print file contents
-    std::cout << "Contents of " << filename << " (" << inode.size << " bytes):\n";
-    
-    unsigned int remainingBytes = inode.size;
-    
-    // Read from direct blocks
-    for (unsigned int i = 0; i < DIRECT_BLOCKS && remainingBytes > 0; i++) {
-        if (inode.blockAddresses[i] == 0) {
-            continue;
-        }
-        
-        char* blockData = memory + inode.blockAddresses[i] * BLOCK_SIZE;
-        unsigned int bytesToRead = std::min(remainingBytes, BLOCK_SIZE);
-        
-        // Print block data
-        std::cout.write(blockData, bytesToRead);
-        
-        remainingBytes -= bytesToRead;
+    std::string suffix = text.substr(pos);
+    if (suffix == "K" || suffix == "k") {
+        value <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        value <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        value <<= 30;
+    } else if (!suffix.empty()) {
+        return false;
     }
     
-    // Read from indirect blocks
-    if (inode.indirectBlock != 0 && remainingBytes > 0) {
-        unsigned int* indirectBlockData = reinterpret_cast<unsigned int*>(memory + inode.indirectBlock * BLOCK_SIZE);
+    return true;
+}
+
+// Main function
+// Usage: module [--format [--size BYTES] [--block-size BYTES] [--inodes N] [--direct-blocks N] [--extents] [--delalloc] [--buddy] [--dedup] [--reflink] [--checksums]]
+int main(int argc, char* argv[]) {
+    FormatOptions options = FileSystem::defaultFormatOptions();
+    bool format = false;
+    unsigned long long flushSeconds = FLUSH_INTERVAL_SECONDS;
+    bool verify = false;
+    
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        std::string next = (i + 1 < argc) ? argv[i + 1] : "";
+        unsigned long long value = 0;
         
-        for (unsigned int i = 0; i < BLOCK_SIZE / sizeof(unsigned int) && remainingBytes > 0; i++) {
-            if (indirectBlockData[i] == 0) {
-                continue;
-            }
-            
-            char* blockData = memory + indirectBlockData[i] * BLOCK_SIZE;
-            unsigned int bytesToRead = std::min(remainingBytes, BLOCK_SIZE);
-            
-            // Print block data
-            std::cout.write(blockData, bytesToRead);
-            
-            remainingBytes -= bytesToRead;
+        if (arg == "--format") {
+            format = true;
+        } else if (arg == "--size" && parseSize(next, value)) {
+            options.imageSize = value;
+            i++;
+        } else if (arg == "--block-size" && parseSize(next, value)) {
+            options.blockSize = static_cast<unsigned int>(value);
+            i++;
+        } else if (arg == "--inodes" && parseSize(next, value)) {
+            options.maxInodes = static_cast<unsigned int>(value);
+            i++;
+        } else if (arg == "--direct-blocks" && parseSize(next, value)) {
+            options.directBlocks = static_cast<unsigned int>(value);
+            i++;
+        } else if (arg == "--extents") {
+            options.features |= FEATURE_EXTENTS;
+        } else if (arg == "--delalloc") {
+            options.features |= FEATURE_DELALLOC;
+        } else if (arg == "--buddy") {
+            options.features |= FEATURE_BUDDY;
+        } else if (arg == "--dedup") {
+            options.features |= FEATURE_DEDUP;
+        } else if (arg == "--reflink") {
+            options.features |= FEATURE_REFLINK;
+        } else if (arg == "--checksums") {
+            options.features |= FEATURE_CHECKSUMS;
+        } else if (arg == "--flush-interval" && parseSize(next, flushSeconds)) {
+            i++;
+        } else if (arg == "--verify") {
+            verify = true;
+        } else {
+            std::cout << "Usage: " << argv[0] << " [--format [--size BYTES] [--block-size BYTES]"
+                      << " [--inodes N] [--direct-blocks N] [--extents] [--delalloc] [--buddy] [--dedup] [--reflink] [--checksums]]"
+                      << " [--flush-interval SECONDS] [--verify]\n";
+            return 1;
         }
     }
     
-    std::cout << std::endl;
-}
-
-// Main function
-int main() {
-    FileSystem fs;
-    fs.run();
+    if (format && !FileSystem::validateFormatOptions(options)) {
+        return 1;
+    }
+    
+    FileSystem fs(format ? &options : nullptr);
+    if (!fs.isOpen()) {
+        return 1;
+    }
+    
+    fs.run(static_cast<unsigned int>(flushSeconds), verify);
     return 0;
 }
 